@@ -0,0 +1,31 @@
+#pragma once
+
+#include <sqlite3.h>
+#include <stdint.h>
+
+typedef enum {
+  PRIORITY_READ,
+  PRIORITY_WRITE,
+  PRIORITY_AUTH,
+  // Long reads such as exports, run by workers of their own on read-only
+  // connections so they never hold up the classes above
+  PRIORITY_SNAPSHOT,
+  PRIORITY_COUNT
+} Priority;
+
+// Intrusive queue entry: embed it in the object that carries the request.
+// Exactly one of run or shed is called for every submitted job, on a worker
+// thread.
+typedef struct Job {
+  struct Job *next;
+  Priority priority;
+  uint64_t enqueued_ms;
+  uint64_t deadline_ms;
+  void *data;
+  void (*run)(struct Job *job, sqlite3 *db, char **err_msg);
+  void (*shed)(struct Job *job);
+} Job;
+
+uint64_t admission_now_ms(void);
+int admission_start(void);
+int admission_submit(Job *job);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "cJSON.h"
+#include <sqlite3.h>
+#include <stddef.h>
+
+void autocomplete_build(sqlite3 *db);
+void autocomplete_free(void);
+
+void autocomplete_insert(long game_id, const char *title, long popularity);
+void autocomplete_rename(long game_id, const char *title);
+void autocomplete_remove(long game_id);
+void autocomplete_add_popularity(long game_id, long delta);
+
+cJSON *autocomplete_query(const char *prefix, size_t limit);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+#define BITMAP_BITSET_WORDS 1024
+
+// Roaring-style compressed bitmap of 32-bit ids. Ids are split by their high
+// 16 bits into containers that hold either a sorted array of the low bits
+// (sparse) or a 65536-bit bitset (dense).
+typedef struct {
+  uint16_t key;
+  uint8_t is_bitset;
+  uint32_t cardinality;
+  uint32_t capacity;
+  union {
+    uint16_t *values;
+    uint64_t *words;
+  } data;
+} BitmapContainer;
+
+typedef struct {
+  BitmapContainer *containers;
+  uint32_t count;
+  uint32_t capacity;
+} Bitmap;
+
+void bitmap_init(Bitmap *bitmap);
+void bitmap_free(Bitmap *bitmap);
+
+int bitmap_add(Bitmap *bitmap, uint32_t id);
+int bitmap_remove(Bitmap *bitmap, uint32_t id);
+int bitmap_contains(const Bitmap *bitmap, uint32_t id);
+
+uint64_t bitmap_cardinality(const Bitmap *bitmap);
+uint64_t bitmap_and_cardinality(const Bitmap *a, const Bitmap *b);
+int bitmap_and(const Bitmap *a, const Bitmap *b, Bitmap *out);
+int bitmap_copy(const Bitmap *src, Bitmap *out);
+void bitmap_for_each(const Bitmap *bitmap,
+                     void (*visit)(uint32_t id, void *data), void *data);
@@ -0,0 +1,35 @@
+#pragma once
+
+// Runtime settings, defaulted from defines.h and overridable through the
+// environment at startup
+typedef struct {
+  int header_timeout_ms;
+  int body_timeout_ms;
+  int upload_timeout_ms;
+  int idle_timeout_ms;
+  int write_timeout_ms;
+  int stream_heartbeat_ms;
+  int max_connections;
+  int worker_threads;
+  int write_workers;
+  int queue_capacity;
+  int queue_target_ms;
+  int queue_interval_ms;
+  int request_deadline_ms;
+  int auth_workers;
+  int snapshot_workers;
+  int hash_threads;
+  int hash_queue_capacity;
+  int hash_rounds;
+  const char *rate_limits;
+  int task_budget_ms;
+  int optimize_interval_ms;
+  int search_merge_interval_ms;
+  int facets_rebuild_interval_ms;
+  int checkpoint_interval_ms;
+  int wal_size_limit_mb;
+} ServerConfig;
+
+extern ServerConfig config;
+
+void config_load(void);
@@ -1,12 +1,21 @@
 #pragma once
 
+#include "cJSON.h"
 #include <sqlite3.h>
 
-void db_request(sqlite3 *db, const char *sql,
-                int (*callback)(void *, int, char **, char **), void *data,
-                char **err_msg, char *description);
+int db_request(sqlite3 *db, const char *sql,
+               int (*callback)(void *, int, char **, char **), void *data,
+               char **err_msg, char *description);
 
 int callback_object(void *buffer, int argc, char **argv, char **colName);
 int callback_array(void *buffer, int argc, char **argv, char **colName);
 
+cJSON *db_row_to_object(sqlite3_stmt *stmt);
+int db_step_array(sqlite3_stmt *stmt, cJSON *json_array);
+
+sqlite3 *db_open(void);
+sqlite3 *db_open_snapshot(void);
+int db_begin_snapshot(sqlite3 *db);
+void db_end_snapshot(sqlite3 *db);
+
 void init_tables(sqlite3 *db, char **err_msg);
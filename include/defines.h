@@ -1,7 +1,88 @@
 #pragma once
 
 #define PORT 8080
+#define DB_PATH "steam.db"
 #define MAX_REQUEST_SIZE 1048576
+#define MAX_HEADER_SIZE 16384
+#define MAX_STREAM_BODY_SIZE 268435456
+#define BODY_WINDOW_SIZE 65536
+
+#define HEADER_TIMEOUT_MS 10000
+#define BODY_TIMEOUT_MS 30000
+#define UPLOAD_TIMEOUT_MS 120000
+#define IDLE_TIMEOUT_MS 15000
+#define WRITE_TIMEOUT_MS 30000
+#define MAX_CONNECTIONS 1024
 #define CHUNK_SIZE 8192
+#define STREAM_THRESHOLD 65536
+
+#define WORKER_THREADS 4
+#define WRITE_WORKERS 1
+#define QUEUE_CAPACITY 1024
+#define QUEUE_TARGET_MS 20
+#define QUEUE_INTERVAL_MS 100
+#define REQUEST_DEADLINE_MS 5000
+#define AUTH_WORKERS 2
+#define SNAPSHOT_WORKERS 1
+
+#define HASH_THREADS 2
+#define HASH_QUEUE_CAPACITY 64
+#define HASH_ROUNDS 50000
+#define HASH_NICE 10
+
+// "METHOD /path=rate:burst" separated by ';', rate in requests per second;
+// a trailing '*' matches any path with that prefix
+#define RATE_LIMITS                                                            \
+  "POST /login=1:5;POST /register=0.2:3;GET /games=2:10;GET /export/*=0.1:2"
+#define RATE_LIMIT_SHARDS 64
+#define RATE_LIMIT_ENTRIES 65536
+
+#define SEARCH_DEFAULT_LIMIT 20
+#define SEARCH_MAX_LIMIT 100
+
+#define AUTOCOMPLETE_DEFAULT_LIMIT 10
+#define AUTOCOMPLETE_MAX_LIMIT 50
+
+#define FACETS_MAX_VALUES 50
+
+#define REVIEWS_DEFAULT_LIMIT 50
+#define REVIEWS_MAX_LIMIT 100
+
+#define OWNERSHIP_CACHE_USERS 10000
+#define OWNERSHIP_WARM_PURCHASES 5000
+
+#define MAX_BATCH_IDS 100
+#define MAX_BULK_ITEMS 10000
+#define BULK_BATCH_ITEMS 1000
 
 #define SECRET "djfhdlkfh"
+#define SESSION_TTL_SECONDS 604800
+#define SESSION_CACHE_SLOTS 4096
+#define SESSION_REVOKED_BUCKETS 4096
+
+#define LEADERBOARD_DEFAULT_LIMIT 10
+#define LEADERBOARD_MAX_LIMIT 100
+
+#define PUBSUB_TOPIC_BUCKETS 4096
+#define STREAM_QUEUE_LENGTH 64
+#define STREAM_WRITE_BATCH 16
+#define STREAM_HEARTBEAT_MS 15000
+#define STREAM_RETRY_MS 3000
+#define WEBSOCKET_MAX_MESSAGE 1024
+#define WEBSOCKET_MAX_SUBSCRIPTIONS 64
+#define RECOMMEND_TOP_K 20
+#define RECOMMEND_DEFAULT_LIMIT 10
+#define SCHEDULER_MAX_TASKS 16
+#define SCHEDULER_MAX_BACKOFF 8
+#define SCHEDULER_NICE 10
+#define SCHEDULER_BUSY_TIMEOUT_MS 100
+#define TASK_BUDGET_MS 200
+#define OPTIMIZE_INTERVAL_MS 3600000
+#define SEARCH_MERGE_INTERVAL_MS 60000
+#define SEARCH_MERGE_PAGES 64
+#define FACETS_REBUILD_INTERVAL_MS 900000
+#define ANALYSIS_LIMIT 1000
+#define CHECKPOINT_INTERVAL_MS 250
+#define WAL_SIZE_LIMIT_MB 64
+#define WAL_TRUNCATE_FACTOR 4
+#define CHECKPOINT_BUSY_TIMEOUT_MS 20
@@ -0,0 +1,3 @@
+#pragma once
+
+void event_loop_run(int server_fd);
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "cJSON.h"
+#include <sqlite3.h>
+
+void facets_build(sqlite3 *db);
+void facets_free(void);
+
+void facets_load_game(sqlite3 *db, long game_id);
+void facets_remove_game(long game_id);
+
+cJSON *facets_query(const char *genre, const char *developer,
+                    const char *price);
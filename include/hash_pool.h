@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+#define HASH_POOL_BUSY -2
+
+// Password hashing runs on its own threads so a burst of logins queues
+// there, bounded, instead of occupying request workers on the CPU.
+int hash_pool_start(void);
+
+// A fresh "$6$rounds=N$salt$" crypt setting with a random per-user salt
+int hash_pool_new_setting(char *setting, size_t size);
+
+// Blocks until the hash is done. Returns 0, -1 on failure, or
+// HASH_POOL_BUSY when the queue is full.
+int hash_pool_hash(const char *password, const char *setting, char *hashed,
+                   size_t size);
@@ -2,16 +2,75 @@
 
 #include "defines.h"
 #include <sqlite3.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef enum {
+  SWITCHING_PROTOCOLS = 101,
   SUCCESS = 200,
   EMPTY = 204,
   BAD_REQUEST = 400,
+  UNAUTHORIZED = 401,
   NOT_FOUND = 404,
-  INTERNAL_SERVER_ERROR = 500
+  PAYLOAD_TOO_LARGE = 413,
+  TOO_MANY_REQUESTS = 429,
+  REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
+  INTERNAL_SERVER_ERROR = 500,
+  SERVICE_UNAVAILABLE = 503
 } StatusCode;
 
+#define CHUNK_PREFIX_SIZE 8
+
+// Chunk data sits between room for its hex size line and room for the
+// trailing CRLF (plus the terminating chunk), so each flush is one send()
+typedef struct {
+  int socket;
+  size_t length;
+  int failed;
+  char buffer[CHUNK_PREFIX_SIZE + CHUNK_SIZE + 8];
+} ChunkedWriter;
+
+// Response body that is buffered while small and switches to chunked
+// transfer once it grows past STREAM_THRESHOLD
+typedef struct {
+  ChunkedWriter chunked;
+  int socket;
+  int streaming;
+  char *buffer;
+  size_t length;
+  size_t capacity;
+} ResponseStream;
+
+// Request body read through a fixed window, so a streaming handler holds at
+// most BODY_WINDOW_SIZE bytes of it at a time. The whole body must arrive
+// before deadline_ms, so a trickling upload cannot keep a worker forever.
+typedef struct {
+  int socket;
+  uint64_t deadline_ms;
+  size_t remaining;
+  size_t start;
+  size_t end;
+  int failed;
+  char window[BODY_WINDOW_SIZE + 1];
+} BodyReader;
+
+// What the connection loop needs to know about a request before its body
+typedef struct {
+  size_t head_length;
+  size_t content_length;
+  int stream_body;
+  int expect_continue;
+  int keep_alive;
+} RequestHead;
+
+// Set by a response that keeps its connection open after the head: an
+// event stream on one topic, or a WebSocket that picks its own topics
+typedef struct {
+  char *topic;
+  int websocket;
+  long user_id;
+} StreamUpgrade;
+
 typedef struct {
   char **keys;
   char **values;
@@ -19,15 +78,42 @@ typedef struct {
 } QueryParams;
 
 char *construct_response(StatusCode status_code, const char *body);
+char *construct_response_with_headers(StatusCode status_code,
+                                      const char *headers, const char *body);
+char *construct_stream_response(const char *topic);
+char *construct_websocket_response(const char *request, long user_id);
+StreamUpgrade take_stream_upgrade(void);
+
+int send_all(int socket, const char *data, size_t length);
+int chunked_begin(ChunkedWriter *writer, int socket, StatusCode status_code,
+                  const char *content_type);
+int chunked_write(ChunkedWriter *writer, const char *data, size_t length);
+int chunked_end(ChunkedWriter *writer);
+
+void stream_init(ResponseStream *stream, int socket);
+int stream_write(ResponseStream *stream, const char *data, size_t length);
+void stream_finish(ResponseStream *stream, char **response);
+void stream_fail(ResponseStream *stream, StatusCode status_code,
+                 const char *body, char **response);
 
 char *extract_path(char *request);
 char *extract_path_base(char *path);
 QueryParams extract_query(char *path);
 void free_query_params(QueryParams *params);
+char *get_query_value(QueryParams *params, const char *key);
+long get_query_long(QueryParams *params, const char *key, long fallback);
 char *extract_path_id(char *path);
+char *extract_path_inner_id(char *path);
 char *extract_method(char *request);
 char *extract_body(char *request);
+char *get_header_value(const char *request, const char *name);
+
+void body_reader_init(BodyReader *reader, int socket, const char *prefix,
+                      size_t prefix_length, size_t content_length);
+char *body_read_line(BodyReader *reader);
 
 int is_integer(const char *str);
 
-void handle_request(sqlite3 *db, char **err_msg, int socket);
+char *parse_request_head(char *buffer, RequestHead *head);
+char *handle_request(sqlite3 *db, char **err_msg, int socket, char *head,
+                     char *body, BodyReader *reader);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "bitmap.h"
+#include "cJSON.h"
+#include <sqlite3.h>
+#include <stddef.h>
+
+// Achievement-point rankings, global and per game, kept in indexable skip
+// lists so that rank lookups and top-k reads are O(log n). The per-game
+// boards double as each player's unlock counters for that game.
+void leaderboard_build(sqlite3 *db);
+void leaderboard_free(void);
+
+// One pending change: points and unlocks for a player on a game, or with
+// user_id 0, achievements and points for the game's own totals
+typedef struct {
+  long user_id;
+  long game_id;
+  long points;
+  long count;
+} LeaderboardChange;
+
+// Changes read inside a write transaction and applied only once it commits,
+// so a rolled-back write never reaches the boards. Zero-initialize.
+typedef struct {
+  LeaderboardChange *changes;
+  size_t count;
+  size_t capacity;
+} LeaderboardDelta;
+
+// Credit a freshly inserted unlock
+void leaderboard_unlock(sqlite3 *db, long user_id, long achievement_id);
+// Re-apply one achievement to its game's totals and to everyone who
+// unlocked it; sign is -1 before its points change or it is deleted, +1
+// after it is created or changed
+void leaderboard_apply_achievement(sqlite3 *db, long achievement_id, int sign);
+
+// The same two updates, collected into delta instead of applied; -1 if the
+// rows could not be read
+int leaderboard_collect_unlock(sqlite3 *db, long user_id, long achievement_id,
+                               LeaderboardDelta *delta);
+int leaderboard_collect_achievement(sqlite3 *db, long achievement_id, int sign,
+                                    LeaderboardDelta *delta);
+// Apply after COMMIT, or discard after ROLLBACK; both free the delta
+void leaderboard_apply(LeaderboardDelta *delta);
+void leaderboard_discard(LeaderboardDelta *delta);
+
+// game_id < 0 selects the global board
+cJSON *leaderboard_top(long game_id, size_t limit);
+cJSON *leaderboard_rank(long game_id, long user_id);
+// Unlocked and total achievements and points for each owned game
+cJSON *leaderboard_summary(long user_id, const Bitmap *owned);
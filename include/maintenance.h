@@ -0,0 +1,4 @@
+#pragma once
+
+// Register the database and index upkeep tasks with the scheduler
+int maintenance_schedule(void);
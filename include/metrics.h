@@ -0,0 +1,51 @@
+#pragma once
+
+#include "cJSON.h"
+
+typedef enum {
+  METRIC_CONNECTIONS_ACCEPTED,
+  METRIC_CONNECTIONS_REJECTED,
+  METRIC_CONNECTIONS_OPEN,
+  METRIC_REQUESTS,
+  METRIC_HEADER_TIMEOUTS,
+  METRIC_BODY_TIMEOUTS,
+  METRIC_IDLE_TIMEOUTS,
+  METRIC_WRITE_TIMEOUTS,
+  METRIC_QUEUED_READS,
+  METRIC_QUEUED_WRITES,
+  METRIC_QUEUED_AUTH,
+  METRIC_QUEUED_SNAPSHOT,
+  METRIC_SHED_QUEUE_FULL,
+  METRIC_SHED_QUEUE_DELAY,
+  METRIC_SHED_DEADLINE,
+  METRIC_RATE_LIMITED,
+  METRIC_RATE_LIMIT_ENTRIES,
+  METRIC_HASH_QUEUE_DEPTH,
+  METRIC_HASHES,
+  METRIC_HASH_TIME_US,
+  METRIC_HASH_REJECTED,
+  METRIC_STREAMS_OPEN,
+  METRIC_STREAMS_DROPPED,
+  METRIC_SUBSCRIPTIONS,
+  METRIC_EVENTS_PUBLISHED,
+  METRIC_EVENTS_DELIVERED,
+  METRIC_EVENTS_COALESCED,
+  METRIC_WEBSOCKETS_OPEN,
+  METRIC_RECOMMEND_BYTES,
+  METRIC_RECOMMEND_PAIRS,
+  METRIC_WAL_BYTES,
+  METRIC_WAL_FRAMES,
+  METRIC_CHECKPOINTS,
+  METRIC_CHECKPOINTS_BUSY,
+  METRIC_CHECKPOINT_RESTARTS,
+  METRIC_CHECKPOINT_TRUNCATES,
+  METRIC_CHECKPOINT_TIME_US,
+  METRIC_CHECKPOINT_LAST_US,
+  METRIC_COUNT
+} Metric;
+
+void metrics_add(Metric metric, long delta);
+// For gauges that are measured rather than counted
+void metrics_set(Metric metric, long value);
+long metrics_get(Metric metric);
+cJSON *metrics_to_json(void);
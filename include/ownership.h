@@ -0,0 +1,9 @@
+#pragma once
+
+#include "bitmap.h"
+#include <sqlite3.h>
+
+int ownership_get(sqlite3 *db, long user_id, Bitmap *owned);
+void ownership_add(long user_id, long game_id);
+void ownership_remove(long user_id, long game_id);
+void ownership_free(void);
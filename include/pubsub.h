@@ -0,0 +1,48 @@
+#pragma once
+
+#include "websocket.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// An event serialized once and shared by reference between the send queues
+// of every subscriber it reaches. It carries both wire encodings: the
+// Server-Sent Events text in data, then the WebSocket frame right after it.
+// A non-zero key marks an update that a newer one with the same key may
+// replace while both are still queued.
+typedef struct {
+  atomic_int references;
+  uint64_t key;
+  size_t length;
+  size_t frame_length;
+  char data[];
+} Message;
+
+#define message_frame(message) ((message)->data + (message)->length)
+
+typedef struct Subscription Subscription;
+
+Message *message_create(const char *text, size_t length, const char *frame,
+                        size_t frame_length);
+// "event: <event>\ndata: <data>\n\n" for event streams, and a text frame of
+// {"topic": ..., "event": ..., "data": <data>} for WebSockets
+Message *message_event(const char *topic, const char *event, const char *data,
+                       int replaceable);
+// A frame for one WebSocket only, such as a reply or a pong
+Message *message_websocket(WebSocketOpcode opcode, const char *payload,
+                           size_t length);
+Message *message_retain(Message *message);
+void message_release(Message *message);
+
+// Topics and subscriptions belong to the event loop thread; wake is called
+// from a publishing thread when the loop has deliveries waiting
+void pubsub_init(void (*wake)(void));
+// 1 when newly subscribed, 0 if owned already has topic, -1 on failure
+int pubsub_subscribe(Subscription **owned, const char *topic, void *owner);
+// 1 when removed, 0 if owned did not have topic
+int pubsub_unsubscribe(Subscription **owned, const char *topic);
+void pubsub_unsubscribe_all(Subscription **owned);
+void pubsub_deliver(void (*deliver)(void *owner, Message *message));
+
+// Safe from any thread; takes over the caller's reference to message
+void pubsub_publish(const char *topic, Message *message);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+int rate_limit_init(void);
+
+// Charges the request line against the limits of its route, once for the
+// peer address and once for its user_id. Returns 0 when it may proceed,
+// otherwise the number of seconds until it would be allowed.
+int rate_limit_check(uint32_t peer, const char *request);
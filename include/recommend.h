@@ -0,0 +1,23 @@
+#pragma once
+
+#include "bitmap.h"
+#include "cJSON.h"
+#include <sqlite3.h>
+#include <stddef.h>
+
+// "Players who own this also own": a sparse game-by-game matrix of how many
+// players own both, with each game's best RECOMMEND_TOP_K kept ranked. It
+// is built once from Libraries by a background task, then kept current by
+// the library handlers.
+int recommend_build(sqlite3 *db);
+int recommend_ready(void);
+void recommend_free(void);
+
+// library is the owner's whole library after the change; sign is +1 when
+// game_id was added to it and -1 when it was removed
+void recommend_update(long game_id, const Bitmap *library, int sign);
+void recommend_remove_game(long game_id);
+
+cJSON *recommend_similar(long game_id, size_t limit);
+// Games outside owned, scored by how often they are co-owned with it
+cJSON *recommend_for_user(const Bitmap *owned, size_t limit);
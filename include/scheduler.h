@@ -0,0 +1,33 @@
+#pragma once
+
+#include "cJSON.h"
+#include <sqlite3.h>
+
+// Maintenance tasks run off the request path, one at a time on each lane.
+// Every lane has a background thread and connections of its own, so a long
+// task on one lane never delays a short periodic one on another. A task
+// with an interval
+// runs again that long after each run ends; one without runs once. A run
+// that uses more CPU than its budget pushes the next one back in
+// proportion. A snapshot task only reads, and is given a read-only
+// connection with one snapshot held for the whole run. run returns 0, or -1
+// when it failed.
+typedef enum {
+  // Index builds and other tasks that may run for seconds
+  SCHEDULER_LANE_BACKGROUND,
+  // WAL checkpoints, which must keep to their interval
+  SCHEDULER_LANE_CHECKPOINT,
+  SCHEDULER_LANE_COUNT
+} SchedulerLane;
+
+int scheduler_start(void);
+// Call once the scheduler is started
+int scheduler_add(const char *name, SchedulerLane lane, int delay_ms,
+                  int interval_ms, int budget_ms, int snapshot,
+                  int (*run)(sqlite3 *db));
+
+// For tasks that work in steps: whether the running task has used up its
+// CPU budget and should stop at the next step
+int scheduler_over_budget(void);
+
+cJSON *scheduler_stats(void);
@@ -0,0 +1,9 @@
+#pragma once
+
+// Session tokens are "<user_id>.<expires>.<nonce>.<signature>", where the
+// signature is HMAC-SHA256 over everything before it, keyed with SECRET.
+// They verify without a database lookup; logging out revokes a token until
+// it would have expired anyway.
+char *session_issue(long user_id);
+long session_verify(const char *token);
+int session_revoke(const char *token);
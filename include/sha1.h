@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_SIZE 20
+#define SHA1_BLOCK_SIZE 64
+
+// Only for the WebSocket handshake (RFC 6455); not for anything that needs
+// collision resistance
+typedef struct {
+  uint32_t state[5];
+  uint64_t length;
+  uint8_t block[SHA1_BLOCK_SIZE];
+  size_t used;
+} Sha1;
+
+void sha1_init(Sha1 *ctx);
+void sha1_update(Sha1 *ctx, const void *data, size_t length);
+void sha1_final(Sha1 *ctx, uint8_t digest[SHA1_DIGEST_SIZE]);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[SHA256_BLOCK_SIZE];
+  size_t used;
+} Sha256;
+
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t length);
+void sha256_final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void hmac_sha256(const void *key, size_t key_length, const void *data,
+                 size_t length, uint8_t mac[SHA256_DIGEST_SIZE]);
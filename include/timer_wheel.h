@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+// Intrusive timer: embed it in the object it times out. pprev points at
+// whichever pointer links to this timer, so cancel is O(1) without a search.
+typedef struct Timer {
+  struct Timer *next;
+  struct Timer **pprev;
+  uint64_t expires;
+  void *data;
+} Timer;
+
+// Hierarchical timing wheel. Level 0 holds timers due within 64 ticks; each
+// higher level covers 64 times the span of the one below and is cascaded
+// down as the wheel turns.
+typedef struct {
+  uint64_t current;
+  size_t count;
+  Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms);
+void timer_init(Timer *timer, void *data);
+int timer_pending(const Timer *timer);
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t expires_ms);
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms,
+                         void (*expire)(Timer *timer));
+int timer_wheel_next_timeout(const TimerWheel *wheel, uint64_t now_ms);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WEBSOCKET_ACCEPT_SIZE 29
+#define WEBSOCKET_MAX_HEADER 14
+
+typedef enum {
+  WEBSOCKET_CONTINUATION = 0x0,
+  WEBSOCKET_TEXT = 0x1,
+  WEBSOCKET_BINARY = 0x2,
+  WEBSOCKET_CLOSE = 0x8,
+  WEBSOCKET_PING = 0x9,
+  WEBSOCKET_PONG = 0xa
+} WebSocketOpcode;
+
+// A client frame, unmasked in place inside the read buffer
+typedef struct {
+  int fin;
+  WebSocketOpcode opcode;
+  char *payload;
+  size_t length;
+} WebSocketFrame;
+
+// Sec-WebSocket-Accept for a Sec-WebSocket-Key (RFC 6455 section 4.2.2)
+void websocket_accept_key(const char *key, char accept[WEBSOCKET_ACCEPT_SIZE]);
+// Header of an unmasked server frame; returns its length
+size_t websocket_frame_header(WebSocketOpcode opcode, size_t length,
+                              uint8_t header[WEBSOCKET_MAX_HEADER]);
+// Bytes taken by one client frame, 0 if it is incomplete, or -1 if it
+// breaks the protocol or carries more than max_payload bytes
+long websocket_parse_frame(char *buffer, size_t length, size_t max_payload,
+                           WebSocketFrame *frame);
@@ -0,0 +1,231 @@
+#include "admission.h"
+#include "config.h"
+#include "db.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// One FIFO per priority class. last_empty_ms is the last time the queue was
+// seen empty; a queue that has stayed non-empty for a whole interval is
+// standing, not absorbing a burst, and from then on anything that waited
+// longer than the target is shed instead of run late.
+typedef struct {
+  Job *head;
+  Job *tail;
+  int length;
+  uint64_t last_empty_ms;
+} JobQueue;
+
+static JobQueue queues[PRIORITY_COUNT];
+static int running[PRIORITY_COUNT];
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t snapshot_ready = PTHREAD_COND_INITIALIZER;
+
+static const Metric queued_metrics[PRIORITY_COUNT] = {
+    [PRIORITY_READ] = METRIC_QUEUED_READS,
+    [PRIORITY_WRITE] = METRIC_QUEUED_WRITES,
+    [PRIORITY_AUTH] = METRIC_QUEUED_AUTH,
+    [PRIORITY_SNAPSHOT] = METRIC_QUEUED_SNAPSHOT,
+};
+
+typedef struct {
+  sqlite3 *db;
+  int snapshot;
+} Worker;
+
+uint64_t admission_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int admission_submit(Job *job)
+{
+  uint64_t now = admission_now_ms();
+  job->next = NULL;
+  job->enqueued_ms = now;
+  job->deadline_ms = now + config.request_deadline_ms;
+
+  pthread_mutex_lock(&queue_lock);
+  JobQueue *queue = &queues[job->priority];
+  // A snapshot job would wait out a whole export for its worker and be shed
+  // at its deadline anyway, so it is turned away now instead
+  int capacity = job->priority == PRIORITY_SNAPSHOT
+                     ? config.snapshot_workers - running[PRIORITY_SNAPSHOT]
+                     : config.queue_capacity;
+  if (queue->length >= capacity) {
+    pthread_mutex_unlock(&queue_lock);
+    metrics_add(METRIC_SHED_QUEUE_FULL, 1);
+    return -1;
+  }
+
+  if (queue->tail) {
+    queue->tail->next = job;
+  } else {
+    queue->head = job;
+    queue->last_empty_ms = now;
+  }
+  queue->tail = job;
+  queue->length++;
+  metrics_add(queued_metrics[job->priority], 1);
+
+  pthread_cond_signal(job->priority == PRIORITY_SNAPSHOT ? &snapshot_ready
+                                                        : &queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+  return 0;
+}
+
+// Reads always have a worker available; writes and the CPU-heavy auth
+// routes are capped so a storm of either can never occupy every worker.
+// Among the classes under their cap, the oldest head goes first.
+static int class_limit(Priority priority)
+{
+  switch (priority) {
+  case PRIORITY_WRITE:
+    return config.write_workers;
+  case PRIORITY_AUTH:
+    return config.auth_workers;
+  default:
+    return config.worker_threads;
+  }
+}
+
+static JobQueue *pick_queue(int snapshot)
+{
+  if (snapshot) {
+    JobQueue *queue = &queues[PRIORITY_SNAPSHOT];
+    return queue->head ? queue : NULL;
+  }
+
+  JobQueue *picked = NULL;
+  for (int p = 0; p < PRIORITY_COUNT; p++) {
+    JobQueue *queue = &queues[p];
+    if (p == PRIORITY_SNAPSHOT) {
+      continue;
+    }
+    if (queue->head && running[p] < class_limit(p) &&
+        (!picked || queue->head->enqueued_ms < picked->head->enqueued_ms)) {
+      picked = queue;
+    }
+  }
+  return picked;
+}
+
+static Job *pop_job(JobQueue *queue, uint64_t now)
+{
+  Job *job = queue->head;
+  queue->head = job->next;
+  if (!queue->head) {
+    queue->tail = NULL;
+    queue->last_empty_ms = now;
+  }
+  queue->length--;
+  metrics_add(queued_metrics[job->priority], -1);
+  return job;
+}
+
+static int should_shed(const JobQueue *queue, const Job *job, uint64_t now)
+{
+  if (now >= job->deadline_ms) {
+    metrics_add(METRIC_SHED_DEADLINE, 1);
+    return 1;
+  }
+  if (now - queue->last_empty_ms > (uint64_t)config.queue_interval_ms &&
+      now - job->enqueued_ms > (uint64_t)config.queue_target_ms) {
+    metrics_add(METRIC_SHED_QUEUE_DELAY, 1);
+    return 1;
+  }
+  return 0;
+}
+
+static void *worker_main(void *arg)
+{
+  Worker *worker = arg;
+  pthread_cond_t *ready = worker->snapshot ? &snapshot_ready : &queue_ready;
+  char *err_msg = NULL;
+
+  pthread_mutex_lock(&queue_lock);
+  while (1) {
+    JobQueue *queue = pick_queue(worker->snapshot);
+    if (!queue) {
+      pthread_cond_wait(ready, &queue_lock);
+      continue;
+    }
+
+    uint64_t now = admission_now_ms();
+    int shed = should_shed(queue, queue->head, now);
+    Job *job = pop_job(queue, now);
+    Priority priority = job->priority;
+    if (!shed) {
+      running[priority]++;
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    if (shed) {
+      job->shed(job);
+    } else if (worker->snapshot) {
+      db_begin_snapshot(worker->db);
+      job->run(job, worker->db, &err_msg);
+      db_end_snapshot(worker->db);
+    } else {
+      job->run(job, worker->db, &err_msg);
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    if (!shed) {
+      running[priority]--;
+      // A job that was waiting on its class cap may be runnable now
+      if (priority != PRIORITY_READ && priority != PRIORITY_SNAPSHOT) {
+        pthread_cond_broadcast(&queue_ready);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static int start_worker(int snapshot)
+{
+  Worker *worker = malloc(sizeof(Worker));
+  if (!worker) {
+    return -1;
+  }
+  worker->snapshot = snapshot;
+  worker->db = snapshot ? db_open_snapshot() : db_open();
+  if (!worker->db) {
+    free(worker);
+    return -1;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, worker_main, worker) != 0) {
+    fprintf(stderr, "ERROR: Failed to start worker thread\n");
+    sqlite3_close(worker->db);
+    free(worker);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+int admission_start(void)
+{
+  for (int i = 0; i < config.worker_threads; i++) {
+    if (start_worker(0) < 0) {
+      return -1;
+    }
+  }
+  for (int i = 0; i < config.snapshot_workers; i++) {
+    if (start_worker(1) < 0) {
+      return -1;
+    }
+  }
+
+  printf("LOG: Started %d worker threads and %d snapshot workers\n",
+         config.worker_threads, config.snapshot_workers);
+  return 0;
+}
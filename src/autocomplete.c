@@ -0,0 +1,396 @@
+#include "autocomplete.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  long game_id;
+  long popularity;
+  char *title;
+  char *key;
+} TitleEntry;
+
+// The same entries are kept sorted twice: by normalized title for prefix
+// lookups and by game_id for updates coming from the write handlers.
+typedef struct {
+  TitleEntry **by_key;
+  TitleEntry **by_id;
+  size_t count;
+  size_t capacity;
+} TitleIndex;
+
+static TitleIndex index_ = {NULL, NULL, 0, 0};
+
+// Queries from the worker threads share a read lock; the write handlers
+// take it exclusively for their (short) in-place updates
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Lowercase ASCII and collapse every run of punctuation/space into a single
+// space, so "Half-Life 2" and "half life 2" share a key.
+static char *normalize_title(const char *title, int keep_trailing_space)
+{
+  size_t length = strlen(title);
+  char *key = malloc(length + 1);
+  if (!key) {
+    return NULL;
+  }
+
+  size_t key_length = 0;
+  int pending_space = 0;
+  for (const unsigned char *p = (const unsigned char *)title; *p; p++) {
+    if (isalnum(*p) || *p >= 0x80) {
+      if (pending_space && key_length > 0) {
+        key[key_length++] = ' ';
+      }
+      pending_space = 0;
+      key[key_length++] = (char)tolower(*p);
+    } else {
+      pending_space = 1;
+    }
+  }
+  if (keep_trailing_space && pending_space && key_length > 0) {
+    key[key_length++] = ' ';
+  }
+  key[key_length] = '\0';
+
+  return key;
+}
+
+static int compare_key(const TitleEntry *entry, const char *key, long game_id)
+{
+  int cmp = strcmp(entry->key, key);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (entry->game_id > game_id) - (entry->game_id < game_id);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+  const TitleEntry *entry_b = *(TitleEntry *const *)b;
+  return compare_key(*(TitleEntry *const *)a, entry_b->key, entry_b->game_id);
+}
+
+static size_t lower_bound_key(const char *key, long game_id)
+{
+  size_t lo = 0, hi = index_.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (compare_key(index_.by_key[mid], key, game_id) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static size_t lower_bound_id(long game_id)
+{
+  size_t lo = 0, hi = index_.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index_.by_id[mid]->game_id < game_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static TitleEntry *find_by_id(long game_id, size_t *position)
+{
+  size_t i = lower_bound_id(game_id);
+  if (i < index_.count && index_.by_id[i]->game_id == game_id) {
+    if (position) {
+      *position = i;
+    }
+    return index_.by_id[i];
+  }
+  return NULL;
+}
+
+static int reserve(size_t capacity)
+{
+  if (capacity <= index_.capacity) {
+    return 1;
+  }
+
+  size_t new_capacity = index_.capacity ? index_.capacity * 2 : 1024;
+  while (new_capacity < capacity) {
+    new_capacity *= 2;
+  }
+
+  TitleEntry **by_key = realloc(index_.by_key, new_capacity * sizeof(*by_key));
+  if (!by_key) {
+    return 0;
+  }
+  index_.by_key = by_key;
+
+  TitleEntry **by_id = realloc(index_.by_id, new_capacity * sizeof(*by_id));
+  if (!by_id) {
+    return 0;
+  }
+  index_.by_id = by_id;
+
+  index_.capacity = new_capacity;
+  return 1;
+}
+
+static void insert_by_key(TitleEntry *entry)
+{
+  size_t i = lower_bound_key(entry->key, entry->game_id);
+  memmove(&index_.by_key[i + 1], &index_.by_key[i],
+          (index_.count - i) * sizeof(*index_.by_key));
+  index_.by_key[i] = entry;
+}
+
+static void remove_by_key(TitleEntry *entry)
+{
+  size_t i = lower_bound_key(entry->key, entry->game_id);
+  memmove(&index_.by_key[i], &index_.by_key[i + 1],
+          (index_.count - i - 1) * sizeof(*index_.by_key));
+}
+
+static void free_entry(TitleEntry *entry)
+{
+  free(entry->title);
+  free(entry->key);
+  free(entry);
+}
+
+static void rename_entry(TitleEntry *entry, const char *title)
+{
+  char *new_title = strdup(title);
+  char *new_key = normalize_title(title, 0);
+  if (!new_title || !new_key) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    free(new_title);
+    free(new_key);
+    return;
+  }
+
+  remove_by_key(entry);
+  index_.count--;
+  free(entry->title);
+  free(entry->key);
+  entry->title = new_title;
+  entry->key = new_key;
+  insert_by_key(entry);
+  index_.count++;
+}
+
+static void insert_entry(long game_id, const char *title, long popularity)
+{
+  TitleEntry *existing = find_by_id(game_id, NULL);
+  if (existing) {
+    rename_entry(existing, title);
+    return;
+  }
+
+  if (!reserve(index_.count + 1)) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    return;
+  }
+
+  TitleEntry *entry = malloc(sizeof(*entry));
+  if (!entry) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    return;
+  }
+  entry->game_id = game_id;
+  entry->popularity = popularity;
+  entry->title = strdup(title);
+  entry->key = normalize_title(title, 0);
+  if (!entry->title || !entry->key) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    free_entry(entry);
+    return;
+  }
+
+  size_t i = lower_bound_id(game_id);
+  memmove(&index_.by_id[i + 1], &index_.by_id[i],
+          (index_.count - i) * sizeof(*index_.by_id));
+  index_.by_id[i] = entry;
+  insert_by_key(entry);
+  index_.count++;
+}
+
+void autocomplete_insert(long game_id, const char *title, long popularity)
+{
+  pthread_rwlock_wrlock(&index_lock);
+  insert_entry(game_id, title, popularity);
+  pthread_rwlock_unlock(&index_lock);
+}
+
+void autocomplete_rename(long game_id, const char *title)
+{
+  pthread_rwlock_wrlock(&index_lock);
+  TitleEntry *entry = find_by_id(game_id, NULL);
+  if (entry) {
+    rename_entry(entry, title);
+  }
+  pthread_rwlock_unlock(&index_lock);
+}
+
+void autocomplete_remove(long game_id)
+{
+  pthread_rwlock_wrlock(&index_lock);
+  size_t position;
+  TitleEntry *entry = find_by_id(game_id, &position);
+  if (entry) {
+    remove_by_key(entry);
+    memmove(&index_.by_id[position], &index_.by_id[position + 1],
+            (index_.count - position - 1) * sizeof(*index_.by_id));
+    index_.count--;
+    free_entry(entry);
+  }
+  pthread_rwlock_unlock(&index_lock);
+}
+
+void autocomplete_add_popularity(long game_id, long delta)
+{
+  pthread_rwlock_wrlock(&index_lock);
+  TitleEntry *entry = find_by_id(game_id, NULL);
+  if (entry) {
+    entry->popularity += delta;
+  }
+  pthread_rwlock_unlock(&index_lock);
+}
+
+static int is_more_popular(const TitleEntry *a, const TitleEntry *b)
+{
+  if (a->popularity != b->popularity) {
+    return a->popularity > b->popularity;
+  }
+  return strcmp(a->key, b->key) < 0;
+}
+
+cJSON *autocomplete_query(const char *prefix, size_t limit)
+{
+  cJSON *json_array = cJSON_CreateArray();
+  char *key = normalize_title(prefix, 1);
+  TitleEntry **top = malloc(limit * sizeof(*top));
+  if (!json_array || !key || !top) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    cJSON_Delete(json_array);
+    free(key);
+    free(top);
+    return NULL;
+  }
+
+  // Walk the contiguous range of keys sharing the prefix, keeping the k most
+  // popular in a small sorted buffer.
+  size_t key_length = strlen(key);
+  size_t found = 0;
+  pthread_rwlock_rdlock(&index_lock);
+  for (size_t i = lower_bound_key(key, 0); i < index_.count; i++) {
+    TitleEntry *entry = index_.by_key[i];
+    if (strncmp(entry->key, key, key_length) != 0) {
+      break;
+    }
+
+    if (found == limit && !is_more_popular(entry, top[limit - 1])) {
+      continue;
+    }
+
+    size_t j = found < limit ? found++ : limit - 1;
+    while (j > 0 && is_more_popular(entry, top[j - 1])) {
+      top[j] = top[j - 1];
+      j--;
+    }
+    top[j] = entry;
+  }
+
+  for (size_t i = 0; i < found; i++) {
+    cJSON *json_row = cJSON_CreateObject();
+    if (!json_row) {
+      break;
+    }
+    char game_id[32];
+    snprintf(game_id, sizeof(game_id), "%ld", top[i]->game_id);
+    cJSON_AddStringToObject(json_row, "game_id", game_id);
+    cJSON_AddStringToObject(json_row, "title", top[i]->title);
+    cJSON_AddItemToArray(json_array, json_row);
+  }
+  pthread_rwlock_unlock(&index_lock);
+
+  free(key);
+  free(top);
+  return json_array;
+}
+
+static void free_index(void)
+{
+  for (size_t i = 0; i < index_.count; i++) {
+    free_entry(index_.by_id[i]);
+  }
+  free(index_.by_key);
+  free(index_.by_id);
+  index_.by_key = NULL;
+  index_.by_id = NULL;
+  index_.count = 0;
+  index_.capacity = 0;
+}
+
+void autocomplete_free(void)
+{
+  pthread_rwlock_wrlock(&index_lock);
+  free_index();
+  pthread_rwlock_unlock(&index_lock);
+}
+
+void autocomplete_build(sqlite3 *db)
+{
+  const char *select_sql =
+      "SELECT Games.game_id, Games.title, "
+      "(SELECT COUNT(*) FROM Libraries WHERE Libraries.game_id = "
+      "Games.game_id) "
+      "FROM Games ORDER BY Games.game_id;";
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to build autocomplete index: %s\n",
+            sqlite3_errmsg(db));
+    return;
+  }
+
+  pthread_rwlock_wrlock(&index_lock);
+  free_index();
+
+  // Rows arrive ordered by game_id, so by_id can be filled directly and
+  // by_key sorted once at the end.
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *title = (const char *)sqlite3_column_text(stmt, 1);
+    if (!title || !reserve(index_.count + 1)) {
+      continue;
+    }
+
+    TitleEntry *entry = malloc(sizeof(*entry));
+    if (!entry) {
+      break;
+    }
+    entry->game_id = sqlite3_column_int64(stmt, 0);
+    entry->popularity = sqlite3_column_int64(stmt, 2);
+    entry->title = strdup(title);
+    entry->key = normalize_title(title, 0);
+    if (!entry->title || !entry->key) {
+      free_entry(entry);
+      break;
+    }
+
+    index_.by_id[index_.count] = entry;
+    index_.by_key[index_.count] = entry;
+    index_.count++;
+  }
+  sqlite3_finalize(stmt);
+
+  qsort(index_.by_key, index_.count, sizeof(*index_.by_key),
+        compare_entries);
+  pthread_rwlock_unlock(&index_lock);
+
+  printf("LOG: Autocomplete index built with %zu titles.\n", index_.count);
+}
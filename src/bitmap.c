@@ -0,0 +1,540 @@
+#include "bitmap.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define ARRAY_MAX_CARDINALITY 4096
+#define BITSET_WORDS BITMAP_BITSET_WORDS
+
+static uint64_t and_popcount_scalar(const uint64_t *a, const uint64_t *b,
+                                    size_t words)
+{
+  uint64_t total = 0;
+  for (size_t i = 0; i < words; i++) {
+    total += __builtin_popcountll(a[i] & b[i]);
+  }
+  return total;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Nibble lookup popcount (Mula), 256 bits per iteration
+__attribute__((target("avx2"))) static uint64_t
+and_popcount_avx2(const uint64_t *a, const uint64_t *b, size_t words)
+{
+  const __m256i lookup =
+      _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1,
+                       2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i total = _mm256_setzero_si256();
+
+  for (size_t i = 0; i < words; i += 4) {
+    __m256i v = _mm256_and_si256(
+        _mm256_loadu_si256((const __m256i *)(a + i)),
+        _mm256_loadu_si256((const __m256i *)(b + i)));
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                     _mm256_shuffle_epi8(lookup, hi));
+    total = _mm256_add_epi64(
+        total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+  }
+
+  return (uint64_t)_mm256_extract_epi64(total, 0) +
+         (uint64_t)_mm256_extract_epi64(total, 1) +
+         (uint64_t)_mm256_extract_epi64(total, 2) +
+         (uint64_t)_mm256_extract_epi64(total, 3);
+}
+#elif defined(__aarch64__)
+static uint64_t and_popcount_neon(const uint64_t *a, const uint64_t *b,
+                                  size_t words)
+{
+  uint64x2_t total = vdupq_n_u64(0);
+  for (size_t i = 0; i < words; i += 2) {
+    uint8x16_t v =
+        vreinterpretq_u8_u64(vandq_u64(vld1q_u64(a + i), vld1q_u64(b + i)));
+    total = vaddq_u64(total, vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vcntq_u8(v)))));
+  }
+  return vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+}
+#endif
+
+// Popcount of a & b over a full bitset container
+static uint64_t and_popcount(const uint64_t *a, const uint64_t *b)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  static int has_avx2 = -1;
+  if (has_avx2 < 0) {
+    has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  if (has_avx2) {
+    return and_popcount_avx2(a, b, BITSET_WORDS);
+  }
+#elif defined(__aarch64__)
+  return and_popcount_neon(a, b, BITSET_WORDS);
+#endif
+  return and_popcount_scalar(a, b, BITSET_WORDS);
+}
+
+void bitmap_init(Bitmap *bitmap)
+{
+  bitmap->containers = NULL;
+  bitmap->count = 0;
+  bitmap->capacity = 0;
+}
+
+static void free_container(BitmapContainer *container)
+{
+  if (container->is_bitset) {
+    free(container->data.words);
+  } else {
+    free(container->data.values);
+  }
+}
+
+void bitmap_free(Bitmap *bitmap)
+{
+  for (uint32_t i = 0; i < bitmap->count; i++) {
+    free_container(&bitmap->containers[i]);
+  }
+  free(bitmap->containers);
+  bitmap_init(bitmap);
+}
+
+// Binary search for a container key; returns its index or the insertion
+// position encoded as -(position + 1).
+static long find_container(const Bitmap *bitmap, uint16_t key)
+{
+  long lo = 0, hi = (long)bitmap->count - 1;
+  while (lo <= hi) {
+    long mid = lo + (hi - lo) / 2;
+    uint16_t mid_key = bitmap->containers[mid].key;
+    if (mid_key < key) {
+      lo = mid + 1;
+    } else if (mid_key > key) {
+      hi = mid - 1;
+    } else {
+      return mid;
+    }
+  }
+  return -(lo + 1);
+}
+
+static long find_value(const uint16_t *values, uint32_t count, uint16_t value)
+{
+  long lo = 0, hi = (long)count - 1;
+  while (lo <= hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (values[mid] < value) {
+      lo = mid + 1;
+    } else if (values[mid] > value) {
+      hi = mid - 1;
+    } else {
+      return mid;
+    }
+  }
+  return -(lo + 1);
+}
+
+static BitmapContainer *insert_container(Bitmap *bitmap, uint32_t position,
+                                         uint16_t key)
+{
+  if (bitmap->count == bitmap->capacity) {
+    uint32_t new_capacity = bitmap->capacity ? bitmap->capacity * 2 : 4;
+    BitmapContainer *containers =
+        realloc(bitmap->containers, new_capacity * sizeof(*containers));
+    if (!containers) {
+      return NULL;
+    }
+    bitmap->containers = containers;
+    bitmap->capacity = new_capacity;
+  }
+
+  memmove(&bitmap->containers[position + 1], &bitmap->containers[position],
+          (bitmap->count - position) * sizeof(*bitmap->containers));
+  bitmap->count++;
+
+  BitmapContainer *container = &bitmap->containers[position];
+  memset(container, 0, sizeof(*container));
+  container->key = key;
+  return container;
+}
+
+static void remove_container(Bitmap *bitmap, uint32_t position)
+{
+  free_container(&bitmap->containers[position]);
+  memmove(&bitmap->containers[position], &bitmap->containers[position + 1],
+          (bitmap->count - position - 1) * sizeof(*bitmap->containers));
+  bitmap->count--;
+}
+
+static int array_to_bitset(BitmapContainer *container)
+{
+  uint64_t *words = calloc(BITSET_WORDS, sizeof(*words));
+  if (!words) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < container->cardinality; i++) {
+    uint16_t value = container->data.values[i];
+    words[value >> 6] |= (uint64_t)1 << (value & 63);
+  }
+  free(container->data.values);
+  container->data.words = words;
+  container->is_bitset = 1;
+  container->capacity = 0;
+  return 1;
+}
+
+static int bitset_to_array(BitmapContainer *container)
+{
+  uint16_t *values = malloc(
+      (container->cardinality ? container->cardinality : 1) * sizeof(*values));
+  if (!values) {
+    return 0;
+  }
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < BITSET_WORDS; i++) {
+    uint64_t word = container->data.words[i];
+    while (word) {
+      values[n++] = (uint16_t)(i * 64 + __builtin_ctzll(word));
+      word &= word - 1;
+    }
+  }
+  free(container->data.words);
+  container->data.values = values;
+  container->is_bitset = 0;
+  container->capacity = container->cardinality;
+  return 1;
+}
+
+int bitmap_add(Bitmap *bitmap, uint32_t id)
+{
+  uint16_t key = (uint16_t)(id >> 16);
+  uint16_t low = (uint16_t)(id & 0xFFFF);
+
+  long position = find_container(bitmap, key);
+  BitmapContainer *container;
+  if (position >= 0) {
+    container = &bitmap->containers[position];
+  } else {
+    container = insert_container(bitmap, (uint32_t)(-position - 1), key);
+    if (!container) {
+      return 0;
+    }
+  }
+
+  if (!container->is_bitset) {
+    long value_position =
+        find_value(container->data.values, container->cardinality, low);
+    if (value_position >= 0) {
+      return 0;
+    }
+
+    if (container->cardinality == ARRAY_MAX_CARDINALITY) {
+      if (!array_to_bitset(container)) {
+        return 0;
+      }
+    } else {
+      if (container->cardinality == container->capacity) {
+        uint32_t new_capacity =
+            container->capacity ? container->capacity * 2 : 4;
+        if (new_capacity > ARRAY_MAX_CARDINALITY) {
+          new_capacity = ARRAY_MAX_CARDINALITY;
+        }
+        uint16_t *values = realloc(container->data.values,
+                                   new_capacity * sizeof(*values));
+        if (!values) {
+          return 0;
+        }
+        container->data.values = values;
+        container->capacity = new_capacity;
+      }
+
+      uint32_t insert_at = (uint32_t)(-value_position - 1);
+      memmove(&container->data.values[insert_at + 1],
+              &container->data.values[insert_at],
+              (container->cardinality - insert_at) * sizeof(uint16_t));
+      container->data.values[insert_at] = low;
+      container->cardinality++;
+      return 1;
+    }
+  }
+
+  uint64_t mask = (uint64_t)1 << (low & 63);
+  if (container->data.words[low >> 6] & mask) {
+    return 0;
+  }
+  container->data.words[low >> 6] |= mask;
+  container->cardinality++;
+  return 1;
+}
+
+int bitmap_remove(Bitmap *bitmap, uint32_t id)
+{
+  uint16_t key = (uint16_t)(id >> 16);
+  uint16_t low = (uint16_t)(id & 0xFFFF);
+
+  long position = find_container(bitmap, key);
+  if (position < 0) {
+    return 0;
+  }
+  BitmapContainer *container = &bitmap->containers[position];
+
+  if (container->is_bitset) {
+    uint64_t mask = (uint64_t)1 << (low & 63);
+    if (!(container->data.words[low >> 6] & mask)) {
+      return 0;
+    }
+    container->data.words[low >> 6] &= ~mask;
+    container->cardinality--;
+    if (container->cardinality <= ARRAY_MAX_CARDINALITY / 2) {
+      bitset_to_array(container);
+    }
+  } else {
+    long value_position =
+        find_value(container->data.values, container->cardinality, low);
+    if (value_position < 0) {
+      return 0;
+    }
+    memmove(&container->data.values[value_position],
+            &container->data.values[value_position + 1],
+            (container->cardinality - value_position - 1) * sizeof(uint16_t));
+    container->cardinality--;
+  }
+
+  if (container->cardinality == 0) {
+    remove_container(bitmap, (uint32_t)position);
+  }
+  return 1;
+}
+
+int bitmap_contains(const Bitmap *bitmap, uint32_t id)
+{
+  long position = find_container(bitmap, (uint16_t)(id >> 16));
+  if (position < 0) {
+    return 0;
+  }
+
+  const BitmapContainer *container = &bitmap->containers[position];
+  uint16_t low = (uint16_t)(id & 0xFFFF);
+  if (container->is_bitset) {
+    return (container->data.words[low >> 6] >> (low & 63)) & 1;
+  }
+  return find_value(container->data.values, container->cardinality, low) >= 0;
+}
+
+uint64_t bitmap_cardinality(const Bitmap *bitmap)
+{
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < bitmap->count; i++) {
+    total += bitmap->containers[i].cardinality;
+  }
+  return total;
+}
+
+static int bitset_test(const BitmapContainer *container, uint16_t value)
+{
+  return (container->data.words[value >> 6] >> (value & 63)) & 1;
+}
+
+static uint64_t container_and_cardinality(const BitmapContainer *a,
+                                          const BitmapContainer *b)
+{
+  if (a->is_bitset && b->is_bitset) {
+    return and_popcount(a->data.words, b->data.words);
+  }
+
+  if (a->is_bitset || b->is_bitset) {
+    const BitmapContainer *array = a->is_bitset ? b : a;
+    const BitmapContainer *bitset = a->is_bitset ? a : b;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < array->cardinality; i++) {
+      total += bitset_test(bitset, array->data.values[i]);
+    }
+    return total;
+  }
+
+  // Probe the larger array by binary search when sizes are lopsided
+  const BitmapContainer *small = a->cardinality <= b->cardinality ? a : b;
+  const BitmapContainer *large = small == a ? b : a;
+  uint64_t total = 0;
+  if ((uint64_t)small->cardinality * 32 < large->cardinality) {
+    for (uint32_t i = 0; i < small->cardinality; i++) {
+      total += find_value(large->data.values, large->cardinality,
+                          small->data.values[i]) >= 0;
+    }
+    return total;
+  }
+
+  uint32_t i = 0, j = 0;
+  while (i < a->cardinality && j < b->cardinality) {
+    uint16_t va = a->data.values[i], vb = b->data.values[j];
+    total += va == vb;
+    i += va <= vb;
+    j += vb <= va;
+  }
+  return total;
+}
+
+uint64_t bitmap_and_cardinality(const Bitmap *a, const Bitmap *b)
+{
+  uint64_t total = 0;
+  uint32_t i = 0, j = 0;
+  while (i < a->count && j < b->count) {
+    uint16_t ka = a->containers[i].key, kb = b->containers[j].key;
+    if (ka == kb) {
+      total += container_and_cardinality(&a->containers[i], &b->containers[j]);
+    }
+    i += ka <= kb;
+    j += kb <= ka;
+  }
+  return total;
+}
+
+// Intersect two containers into an empty container already keyed in out
+static int container_and(const BitmapContainer *a, const BitmapContainer *b,
+                         BitmapContainer *out)
+{
+  if (a->is_bitset && b->is_bitset) {
+    uint64_t *words = malloc(BITSET_WORDS * sizeof(*words));
+    if (!words) {
+      return 0;
+    }
+    for (uint32_t i = 0; i < BITSET_WORDS; i++) {
+      words[i] = a->data.words[i] & b->data.words[i];
+    }
+    uint32_t cardinality = (uint32_t)and_popcount(words, words);
+    out->is_bitset = 1;
+    out->data.words = words;
+    out->cardinality = cardinality;
+    if (cardinality <= ARRAY_MAX_CARDINALITY) {
+      return bitset_to_array(out);
+    }
+    return 1;
+  }
+
+  const BitmapContainer *smaller = a->is_bitset ? b : a;
+  const BitmapContainer *other = a->is_bitset ? a : b;
+  uint16_t *values = malloc(
+      (smaller->cardinality ? smaller->cardinality : 1) * sizeof(*values));
+  if (!values) {
+    return 0;
+  }
+
+  uint32_t n = 0;
+  if (other->is_bitset) {
+    for (uint32_t i = 0; i < smaller->cardinality; i++) {
+      uint16_t value = smaller->data.values[i];
+      if (bitset_test(other, value)) {
+        values[n++] = value;
+      }
+    }
+  } else {
+    uint32_t i = 0, j = 0;
+    while (i < smaller->cardinality && j < other->cardinality) {
+      uint16_t va = smaller->data.values[i], vb = other->data.values[j];
+      if (va == vb) {
+        values[n++] = va;
+      }
+      i += va <= vb;
+      j += vb <= va;
+    }
+  }
+
+  out->is_bitset = 0;
+  out->data.values = values;
+  out->cardinality = n;
+  out->capacity = smaller->cardinality;
+  return 1;
+}
+
+int bitmap_and(const Bitmap *a, const Bitmap *b, Bitmap *out)
+{
+  bitmap_init(out);
+
+  uint32_t i = 0, j = 0;
+  while (i < a->count && j < b->count) {
+    uint16_t ka = a->containers[i].key, kb = b->containers[j].key;
+    if (ka == kb) {
+      BitmapContainer *container = insert_container(out, out->count, ka);
+      if (!container ||
+          !container_and(&a->containers[i], &b->containers[j], container)) {
+        bitmap_free(out);
+        return 0;
+      }
+      if (container->cardinality == 0) {
+        remove_container(out, out->count - 1);
+      }
+    }
+    i += ka <= kb;
+    j += kb <= ka;
+  }
+
+  return 1;
+}
+
+int bitmap_copy(const Bitmap *src, Bitmap *out)
+{
+  bitmap_init(out);
+
+  for (uint32_t i = 0; i < src->count; i++) {
+    const BitmapContainer *from = &src->containers[i];
+    BitmapContainer *container = insert_container(out, out->count, from->key);
+    if (!container) {
+      bitmap_free(out);
+      return 0;
+    }
+
+    size_t size = from->is_bitset ? BITSET_WORDS * sizeof(uint64_t)
+                                  : from->cardinality * sizeof(uint16_t);
+    void *data = malloc(size ? size : 1);
+    if (!data) {
+      remove_container(out, out->count - 1);
+      bitmap_free(out);
+      return 0;
+    }
+    memcpy(data, from->is_bitset ? (void *)from->data.words
+                                 : (void *)from->data.values,
+           size);
+
+    container->is_bitset = from->is_bitset;
+    container->cardinality = from->cardinality;
+    if (from->is_bitset) {
+      container->data.words = data;
+    } else {
+      container->data.values = data;
+      container->capacity = from->cardinality;
+    }
+  }
+
+  return 1;
+}
+
+// Visit every id in ascending order
+void bitmap_for_each(const Bitmap *bitmap,
+                     void (*visit)(uint32_t id, void *data), void *data)
+{
+  for (uint32_t i = 0; i < bitmap->count; i++) {
+    const BitmapContainer *container = &bitmap->containers[i];
+    uint32_t high = (uint32_t)container->key << 16;
+
+    if (!container->is_bitset) {
+      for (uint32_t j = 0; j < container->cardinality; j++) {
+        visit(high | container->data.values[j], data);
+      }
+      continue;
+    }
+
+    for (uint32_t word = 0; word < BITSET_WORDS; word++) {
+      uint64_t bits = container->data.words[word];
+      while (bits) {
+        visit(high | (word * 64 + __builtin_ctzll(bits)), data);
+        bits &= bits - 1;
+      }
+    }
+  }
+}
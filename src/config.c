@@ -0,0 +1,110 @@
+#include "config.h"
+#include "defines.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+ServerConfig config = {
+    .header_timeout_ms = HEADER_TIMEOUT_MS,
+    .body_timeout_ms = BODY_TIMEOUT_MS,
+    .upload_timeout_ms = UPLOAD_TIMEOUT_MS,
+    .idle_timeout_ms = IDLE_TIMEOUT_MS,
+    .write_timeout_ms = WRITE_TIMEOUT_MS,
+    .stream_heartbeat_ms = STREAM_HEARTBEAT_MS,
+    .max_connections = MAX_CONNECTIONS,
+    .worker_threads = WORKER_THREADS,
+    .write_workers = WRITE_WORKERS,
+    .queue_capacity = QUEUE_CAPACITY,
+    .queue_target_ms = QUEUE_TARGET_MS,
+    .queue_interval_ms = QUEUE_INTERVAL_MS,
+    .request_deadline_ms = REQUEST_DEADLINE_MS,
+    .auth_workers = AUTH_WORKERS,
+    .snapshot_workers = SNAPSHOT_WORKERS,
+    .hash_threads = HASH_THREADS,
+    .hash_queue_capacity = HASH_QUEUE_CAPACITY,
+    .hash_rounds = HASH_ROUNDS,
+    .rate_limits = RATE_LIMITS,
+    .task_budget_ms = TASK_BUDGET_MS,
+    .optimize_interval_ms = OPTIMIZE_INTERVAL_MS,
+    .search_merge_interval_ms = SEARCH_MERGE_INTERVAL_MS,
+    .facets_rebuild_interval_ms = FACETS_REBUILD_INTERVAL_MS,
+    .checkpoint_interval_ms = CHECKPOINT_INTERVAL_MS,
+    .wal_size_limit_mb = WAL_SIZE_LIMIT_MB,
+};
+
+static void load_int(const char *name, int *value)
+{
+  const char *env = getenv(name);
+  if (!env) {
+    return;
+  }
+
+  char *endptr;
+  long parsed = strtol(env, &endptr, 10);
+  if (*endptr != '\0' || endptr == env || parsed <= 0 || parsed > 1 << 30) {
+    fprintf(stderr, "ERROR: Ignoring invalid %s=%s\n", name, env);
+    return;
+  }
+  *value = (int)parsed;
+}
+
+void config_load(void)
+{
+  load_int("STEAM_HEADER_TIMEOUT_MS", &config.header_timeout_ms);
+  load_int("STEAM_BODY_TIMEOUT_MS", &config.body_timeout_ms);
+  load_int("STEAM_UPLOAD_TIMEOUT_MS", &config.upload_timeout_ms);
+  load_int("STEAM_IDLE_TIMEOUT_MS", &config.idle_timeout_ms);
+  load_int("STEAM_WRITE_TIMEOUT_MS", &config.write_timeout_ms);
+  load_int("STEAM_STREAM_HEARTBEAT_MS", &config.stream_heartbeat_ms);
+  load_int("STEAM_MAX_CONNECTIONS", &config.max_connections);
+  load_int("STEAM_WORKER_THREADS", &config.worker_threads);
+  load_int("STEAM_WRITE_WORKERS", &config.write_workers);
+  load_int("STEAM_QUEUE_CAPACITY", &config.queue_capacity);
+  load_int("STEAM_QUEUE_TARGET_MS", &config.queue_target_ms);
+  load_int("STEAM_QUEUE_INTERVAL_MS", &config.queue_interval_ms);
+  load_int("STEAM_REQUEST_DEADLINE_MS", &config.request_deadline_ms);
+  load_int("STEAM_AUTH_WORKERS", &config.auth_workers);
+  load_int("STEAM_SNAPSHOT_WORKERS", &config.snapshot_workers);
+  load_int("STEAM_HASH_THREADS", &config.hash_threads);
+  load_int("STEAM_HASH_QUEUE_CAPACITY", &config.hash_queue_capacity);
+  load_int("STEAM_HASH_ROUNDS", &config.hash_rounds);
+  load_int("STEAM_TASK_BUDGET_MS", &config.task_budget_ms);
+  load_int("STEAM_OPTIMIZE_INTERVAL_MS", &config.optimize_interval_ms);
+  load_int("STEAM_SEARCH_MERGE_INTERVAL_MS", &config.search_merge_interval_ms);
+  load_int("STEAM_FACETS_REBUILD_INTERVAL_MS",
+           &config.facets_rebuild_interval_ms);
+  load_int("STEAM_CHECKPOINT_INTERVAL_MS", &config.checkpoint_interval_ms);
+  load_int("STEAM_WAL_SIZE_LIMIT_MB", &config.wal_size_limit_mb);
+  if (getenv("STEAM_RATE_LIMITS")) {
+    config.rate_limits = getenv("STEAM_RATE_LIMITS");
+  }
+
+  // At least one worker must be free for reads at all times
+  if (config.write_workers >= config.worker_threads) {
+    config.write_workers =
+        config.worker_threads > 1 ? config.worker_threads - 1 : 1;
+  }
+  if (config.auth_workers >= config.worker_threads) {
+    config.auth_workers =
+        config.worker_threads > 1 ? config.worker_threads - 1 : 1;
+  }
+
+  printf("LOG: Timeouts (ms): header %d, body %d, upload %d, idle %d, "
+         "write %d, stream heartbeat %d; max connections %d\n",
+         config.header_timeout_ms, config.body_timeout_ms,
+         config.upload_timeout_ms,
+         config.idle_timeout_ms, config.write_timeout_ms,
+         config.stream_heartbeat_ms, config.max_connections);
+  printf("LOG: Workers %d (%d for writes, %d for auth) plus %d snapshot, "
+         "queue capacity %d, target %d ms, interval %d ms, deadline %d ms\n",
+         config.worker_threads, config.write_workers, config.auth_workers,
+         config.snapshot_workers, config.queue_capacity, config.queue_target_ms,
+         config.queue_interval_ms, config.request_deadline_ms);
+  printf("LOG: Hash threads %d, queue capacity %d, rounds %d\n",
+         config.hash_threads, config.hash_queue_capacity, config.hash_rounds);
+  printf("LOG: Task budget %d ms; intervals (ms): optimize %d, search merge "
+         "%d, facets rebuild %d\n",
+         config.task_budget_ms, config.optimize_interval_ms,
+         config.search_merge_interval_ms, config.facets_rebuild_interval_ms);
+  printf("LOG: Checkpoint interval %d ms, WAL size limit %d MB\n",
+         config.checkpoint_interval_ms, config.wal_size_limit_mb);
+}
@@ -1,10 +1,11 @@
 #include "db.h"
 #include "cJSON.h"
+#include "defines.h"
 #include <stdio.h>
 
-void db_request(sqlite3 *db, const char *sql,
-                int (*callback)(void *, int, char **, char **), void *data,
-                char **err_msg, char *description)
+int db_request(sqlite3 *db, const char *sql,
+               int (*callback)(void *, int, char **, char **), void *data,
+               char **err_msg, char *description)
 {
   int rc = sqlite3_exec(db, sql, callback, data, err_msg);
 
@@ -18,6 +19,8 @@ void db_request(sqlite3 *db, const char *sql,
       printf("LOG: SQL query executed successfully.\n");
     }
   }
+
+  return rc;
 }
 
 int callback_object(void *buffer, int argc, char **argv, char **colName)
@@ -64,6 +67,293 @@ int callback_array(void *buffer, int argc, char **argv, char **colName)
   return 0;
 }
 
+cJSON *db_row_to_object(sqlite3_stmt *stmt)
+{
+  cJSON *json_row = cJSON_CreateObject();
+  if (!json_row) {
+    fprintf(stderr, "ERROR: Failed to create JSON object.\n");
+    return NULL;
+  }
+
+  int column_count = sqlite3_column_count(stmt);
+  for (int i = 0; i < column_count; i++) {
+    const char *key = sqlite3_column_name(stmt, i);
+    const char *value = (const char *)sqlite3_column_text(stmt, i);
+
+    if (value) {
+      cJSON_AddStringToObject(json_row, key, value);
+    } else {
+      cJSON_AddNullToObject(json_row, key);
+    }
+  }
+
+  return json_row;
+}
+
+int db_step_array(sqlite3_stmt *stmt, cJSON *json_array)
+{
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    cJSON *json_row = db_row_to_object(stmt);
+    if (!json_row) {
+      return SQLITE_NOMEM;
+    }
+    cJSON_AddItemToArray(json_array, json_row);
+  }
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "ERROR: Failed to step SQL statement: %s\n",
+            sqlite3_errmsg(sqlite3_db_handle(stmt)));
+    return rc;
+  }
+
+  return SQLITE_OK;
+}
+
+static int callback_exists(void *data, int argc, char **argv, char **colName)
+{
+  (void)argc;
+  (void)argv;
+  (void)colName;
+  *(int *)data = 1;
+  return 0;
+}
+
+// Per-game review aggregates, maintained by request_post_review
+static void init_review_stats(sqlite3 *db, char **err_msg)
+{
+  const char *create_review_stats_table_sql =
+      "CREATE TABLE IF NOT EXISTS Review_Stats("
+      "game_id INTEGER PRIMARY KEY, "
+      "review_count INTEGER NOT NULL DEFAULT 0, "
+      "rating_sum INTEGER NOT NULL DEFAULT 0, "
+      "rating_1 INTEGER NOT NULL DEFAULT 0, "
+      "rating_2 INTEGER NOT NULL DEFAULT 0, "
+      "rating_3 INTEGER NOT NULL DEFAULT 0, "
+      "rating_4 INTEGER NOT NULL DEFAULT 0, "
+      "rating_5 INTEGER NOT NULL DEFAULT 0, "
+      "FOREIGN KEY (game_id) REFERENCES Games(game_id) ON DELETE CASCADE);";
+  const char *backfill_review_stats_sql =
+      "INSERT INTO Review_Stats (game_id, review_count, rating_sum, "
+      "rating_1, rating_2, rating_3, rating_4, rating_5) "
+      "SELECT game_id, COUNT(*), SUM(rating), "
+      "SUM(rating = 1), SUM(rating = 2), SUM(rating = 3), SUM(rating = 4), "
+      "SUM(rating = 5) "
+      "FROM Reviews GROUP BY game_id;";
+
+  int stats_exists = 0;
+  db_request(db,
+             "SELECT 1 FROM sqlite_master WHERE type = 'table' AND "
+             "name = 'Review_Stats';",
+             callback_exists, &stats_exists, err_msg,
+             "Checked Review_Stats table.");
+
+  db_request(db, create_review_stats_table_sql, 0, 0, err_msg,
+             "Review_Stats table created.");
+
+  // Reviews written before the table existed are aggregated once here
+  if (!stats_exists) {
+    db_request(db, backfill_review_stats_sql, 0, 0, err_msg,
+               "Review_Stats backfilled.");
+  }
+}
+
+// Databases created before price_cents existed only have the TEXT price
+static void migrate_games_price(sqlite3 *db, char **err_msg)
+{
+  int has_price_cents = 0;
+  db_request(db,
+             "SELECT 1 FROM pragma_table_xinfo('Games') WHERE name = "
+             "'price_cents';",
+             callback_exists, &has_price_cents, err_msg,
+             "Checked Games.price_cents column.");
+
+  if (!has_price_cents) {
+    db_request(db,
+               "ALTER TABLE Games ADD COLUMN price_cents INTEGER GENERATED "
+               "ALWAYS AS (CAST(ROUND(CAST(price AS REAL) * 100) AS INTEGER)) "
+               "VIRTUAL;",
+               0, 0, err_msg, "Games.price_cents column added.");
+  }
+}
+
+// Each achievement unlocks once per user. Databases created before the unique
+// index existed may hold repeated unlocks, so the later copies are dropped
+// before the index is built.
+static void migrate_user_achievements_unique(sqlite3 *db, char **err_msg)
+{
+  const char *delete_duplicate_unlocks_sql =
+      "DELETE FROM User_Achievements WHERE user_achievement_id NOT IN ("
+      "SELECT MIN(user_achievement_id) FROM User_Achievements "
+      "GROUP BY user_id, achievement_id);";
+  const char *create_user_achievements_unique_sql =
+      "CREATE UNIQUE INDEX IF NOT EXISTS User_Achievements_User_Achievement "
+      "ON User_Achievements(user_id, achievement_id);";
+
+  int unique_exists = 0;
+  db_request(db,
+             "SELECT 1 FROM sqlite_master WHERE type = 'index' AND "
+             "name = 'User_Achievements_User_Achievement';",
+             callback_exists, &unique_exists, err_msg,
+             "Checked User_Achievements_User_Achievement index.");
+
+  if (!unique_exists) {
+    db_request(db, delete_duplicate_unlocks_sql, 0, 0, err_msg,
+               "Duplicate User_Achievements removed.");
+    db_request(db, create_user_achievements_unique_sql, 0, 0, err_msg,
+               "User_Achievements_User_Achievement index created.");
+  }
+}
+
+static void init_indexes(sqlite3 *db, char **err_msg)
+{
+  const char *create_games_price_index_sql =
+      "CREATE INDEX IF NOT EXISTS Games_Price ON Games(price_cents);";
+  const char *create_games_genre_index_sql =
+      "CREATE INDEX IF NOT EXISTS Games_Genre_Price ON Games(genre, "
+      "price_cents);";
+  const char *create_games_developer_index_sql =
+      "CREATE INDEX IF NOT EXISTS Games_Developer_Price ON Games(developer, "
+      "price_cents);";
+  const char *create_reviews_newest_index_sql =
+      "CREATE INDEX IF NOT EXISTS Reviews_Game_Created ON Reviews(game_id, "
+      "created_at, review_id);";
+  const char *create_reviews_rating_index_sql =
+      "CREATE INDEX IF NOT EXISTS Reviews_Game_Rating ON Reviews(game_id, "
+      "rating, created_at, review_id);";
+  const char *create_games_release_index_sql =
+      "CREATE INDEX IF NOT EXISTS Games_Release_Date ON Games(release_date);";
+
+  db_request(db, create_games_price_index_sql, 0, 0, err_msg,
+             "Games_Price index created.");
+  db_request(db, create_games_genre_index_sql, 0, 0, err_msg,
+             "Games_Genre_Price index created.");
+  db_request(db, create_games_developer_index_sql, 0, 0, err_msg,
+             "Games_Developer_Price index created.");
+  db_request(db, create_games_release_index_sql, 0, 0, err_msg,
+             "Games_Release_Date index created.");
+  db_request(db, create_reviews_newest_index_sql, 0, 0, err_msg,
+             "Reviews_Game_Created index created.");
+  db_request(db, create_reviews_rating_index_sql, 0, 0, err_msg,
+             "Reviews_Game_Rating index created.");
+}
+
+// External-content FTS5 index over Games, kept in sync by triggers.
+static void init_search_index(sqlite3 *db, char **err_msg)
+{
+  const char *create_games_search_sql =
+      "CREATE VIRTUAL TABLE IF NOT EXISTS Games_Search USING fts5("
+      "title, description, developer, genre, "
+      "content='Games', content_rowid='game_id', "
+      "tokenize='unicode61 remove_diacritics 2', prefix='2 3');";
+  const char *create_games_search_insert_trigger_sql =
+      "CREATE TRIGGER IF NOT EXISTS Games_Search_Insert AFTER INSERT ON Games "
+      "BEGIN "
+      "INSERT INTO Games_Search(rowid, title, description, developer, genre) "
+      "VALUES (new.game_id, new.title, new.description, new.developer, "
+      "new.genre); "
+      "END;";
+  const char *create_games_search_delete_trigger_sql =
+      "CREATE TRIGGER IF NOT EXISTS Games_Search_Delete AFTER DELETE ON Games "
+      "BEGIN "
+      "INSERT INTO Games_Search(Games_Search, rowid, title, description, "
+      "developer, genre) "
+      "VALUES ('delete', old.game_id, old.title, old.description, "
+      "old.developer, old.genre); "
+      "END;";
+  const char *create_games_search_update_trigger_sql =
+      "CREATE TRIGGER IF NOT EXISTS Games_Search_Update "
+      "AFTER UPDATE OF title, description, developer, genre ON Games "
+      "BEGIN "
+      "INSERT INTO Games_Search(Games_Search, rowid, title, description, "
+      "developer, genre) "
+      "VALUES ('delete', old.game_id, old.title, old.description, "
+      "old.developer, old.genre); "
+      "INSERT INTO Games_Search(rowid, title, description, developer, genre) "
+      "VALUES (new.game_id, new.title, new.description, new.developer, "
+      "new.genre); "
+      "END;";
+
+  int search_exists = 0;
+  db_request(db,
+             "SELECT 1 FROM sqlite_master WHERE type = 'table' AND "
+             "name = 'Games_Search';",
+             callback_exists, &search_exists, err_msg,
+             "Checked Games_Search table.");
+
+  db_request(db, create_games_search_sql, 0, 0, err_msg,
+             "Games_Search table created.");
+  db_request(db, create_games_search_insert_trigger_sql, 0, 0, err_msg,
+             "Games_Search insert trigger created.");
+  db_request(db, create_games_search_delete_trigger_sql, 0, 0, err_msg,
+             "Games_Search delete trigger created.");
+  db_request(db, create_games_search_update_trigger_sql, 0, 0, err_msg,
+             "Games_Search update trigger created.");
+
+  // Index games that were inserted before the search table existed
+  if (!search_exists) {
+    db_request(db,
+               "INSERT INTO Games_Search(Games_Search) VALUES ('rebuild');",
+               0, 0, err_msg, "Games_Search index rebuilt.");
+  }
+
+  // Segments are merged by the background search_merge task instead of by
+  // whichever write happens to fill a level
+  db_request(db,
+             "INSERT INTO Games_Search(Games_Search, rank) "
+             "VALUES ('automerge', 0);",
+             0, 0, err_msg, "Games_Search automerge disabled.");
+}
+
+sqlite3 *db_open(void)
+{
+  sqlite3 *db;
+  if (sqlite3_open(DB_PATH, &db) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Can't open database: %s\n", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  sqlite3_busy_timeout(db, 5000);
+  // Checkpoints are left to the maintenance scheduler, so no request pays
+  // for one on commit
+  sqlite3_wal_autocheckpoint(db, 0);
+  return db;
+}
+
+// Read-only connection for long scans; under WAL it reads a consistent
+// snapshot without blocking writers on the main connection
+sqlite3 *db_open_snapshot(void)
+{
+  sqlite3 *db;
+  if (sqlite3_open_v2(DB_PATH, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Can't open snapshot connection: %s\n",
+            sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  sqlite3_busy_timeout(db, 5000);
+  return db;
+}
+
+// Pin one snapshot until db_end_snapshot, so every statement in between
+// sees the database as it was when the first one started reading
+int db_begin_snapshot(sqlite3 *db)
+{
+  if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to begin snapshot: %s\n",
+            sqlite3_errmsg(db));
+    return -1;
+  }
+  return 0;
+}
+
+void db_end_snapshot(sqlite3 *db)
+{
+  if (!sqlite3_get_autocommit(db)) {
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  }
+}
+
 void init_tables(sqlite3 *db, char **err_msg)
 {
   const char *create_users_table_sql =
@@ -81,6 +371,8 @@ void init_tables(sqlite3 *db, char **err_msg)
       "title TEXT NOT NULL, "
       "description TEXT NOT NULL, "
       "price TEXT NOT NULL, "
+      "price_cents INTEGER GENERATED ALWAYS AS "
+      "(CAST(ROUND(CAST(price AS REAL) * 100) AS INTEGER)) VIRTUAL, "
       "genre TEXT NOT NULL, "
       "cover_image TEXT NOT NULL, "
       "icon_image TEXT NOT NULL, "
@@ -124,6 +416,8 @@ void init_tables(sqlite3 *db, char **err_msg)
       "FOREIGN KEY (achievement_id) REFERENCES Achievements(achievement_id) ON "
       "DELETE CASCADE);";
 
+  db_request(db, "PRAGMA journal_mode=WAL;", 0, 0, err_msg,
+             "Enabled WAL journal.");
   db_request(db, create_users_table_sql, 0, 0, err_msg, "Users table created.");
   db_request(db, create_games_table_sql, 0, 0, err_msg, "Games table created.");
   db_request(db, create_libraries_table_sql, 0, 0, err_msg,
@@ -134,4 +428,10 @@ void init_tables(sqlite3 *db, char **err_msg)
              "Achievements table created.");
   db_request(db, create_user_achievements_table_sql, 0, 0, err_msg,
              "User_Achievements table created.");
+
+  init_review_stats(db, err_msg);
+  migrate_games_price(db, err_msg);
+  migrate_user_achievements_unique(db, err_msg);
+  init_indexes(db, err_msg);
+  init_search_index(db, err_msg);
 }
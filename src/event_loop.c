@@ -0,0 +1,1128 @@
+#include "event_loop.h"
+#include "admission.h"
+#include "cJSON.h"
+#include "config.h"
+#include "defines.h"
+#include "http.h"
+#include "metrics.h"
+#include "pubsub.h"
+#include "rate_limit.h"
+#include "timer_wheel.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#define MAX_EVENTS 256
+
+typedef enum {
+  CONNECTION_READING_HEAD,
+  CONNECTION_READING_BODY,
+  CONNECTION_QUEUED,
+  CONNECTION_WRITING,
+  CONNECTION_STREAMING
+} ConnectionState;
+
+typedef enum {
+  TIMEOUT_HEADER,
+  TIMEOUT_BODY,
+  TIMEOUT_IDLE,
+  TIMEOUT_WRITE,
+  TIMEOUT_HEARTBEAT
+} TimeoutKind;
+
+// One client socket. Requests are read without blocking until the head (and
+// a buffered body) is complete, then queued for a worker; buffered responses
+// are written back by the loop. Every phase on the loop runs under one
+// deadline in the timer wheel. While queued or running, the socket is out of
+// the poller and the connection belongs to the worker.
+//
+// A response that names a topic turns the connection into a stream: once
+// its head is written the read buffer is released, and published messages
+// are queued by reference and written out in batches. A WebSocket streams
+// the same way but keeps its buffer to read frames that change which topics
+// it follows.
+typedef struct Connection {
+  int socket;
+  uint32_t peer;
+  ConnectionState state;
+  TimeoutKind timeout_kind;
+  Timer timer;
+  int writable;
+  RequestHead head;
+  int keep_alive;
+  char *buffer;
+  size_t length;
+  size_t capacity;
+  char *response;
+  size_t response_length;
+  size_t response_sent;
+  Job job;
+  char saved;
+  struct Connection *next_completed;
+  StreamUpgrade upgrade;
+  int closing;
+  int subscription_count;
+  Subscription *subscriptions;
+  Message **queue;
+  size_t queue_head;
+  size_t queue_length;
+  size_t queue_offset;
+} Connection;
+
+static TimerWheel wheel;
+static int open_connections = 0;
+
+// Workers hand finished connections back through this list and wake the
+// loop with a byte on the pipe, which sits in the poller under &wake_token
+static Connection *completed = NULL;
+static pthread_mutex_t completed_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_pipe[2] = {-1, -1};
+static int wake_token;
+
+// Written to a quiet stream so proxies keep it open and a vanished client
+// is noticed
+static Message *heartbeat = NULL;
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+#ifdef __linux__
+
+static int epoll_fd = -1;
+
+static int poller_init(void)
+{
+  epoll_fd = epoll_create1(0);
+  return epoll_fd < 0 ? -1 : 0;
+}
+
+static int poller_add(int fd, int writable, void *data)
+{
+  struct epoll_event event = {.events = writable ? EPOLLOUT : EPOLLIN,
+                              .data.ptr = data};
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static int poller_modify(int fd, int writable, void *data)
+{
+  struct epoll_event event = {.events = writable ? EPOLLOUT : EPOLLIN,
+                              .data.ptr = data};
+  return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+static void poller_remove(int fd)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int poller_wait(void **ready, int max_ready, int timeout_ms)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int count = epoll_wait(epoll_fd, events,
+                         max_ready < MAX_EVENTS ? max_ready : MAX_EVENTS,
+                         timeout_ms);
+  for (int i = 0; i < count; i++) {
+    ready[i] = events[i].data.ptr;
+  }
+  return count;
+}
+
+#else
+
+// poll() fallback: a flat registry turned into a pollfd array per wait
+typedef struct {
+  int fd;
+  int writable;
+  void *data;
+} Watched;
+
+static Watched *watched = NULL;
+static struct pollfd *poll_fds = NULL;
+static int watched_count = 0;
+static int watched_capacity = 0;
+
+static int poller_init(void)
+{
+  return 0;
+}
+
+static int poller_add(int fd, int writable, void *data)
+{
+  if (watched_count == watched_capacity) {
+    int capacity = watched_capacity ? watched_capacity * 2 : 64;
+    Watched *grown = realloc(watched, capacity * sizeof(Watched));
+    struct pollfd *grown_fds =
+        grown ? realloc(poll_fds, capacity * sizeof(struct pollfd)) : NULL;
+    if (!grown || !grown_fds) {
+      watched = grown ? grown : watched;
+      return -1;
+    }
+    watched = grown;
+    poll_fds = grown_fds;
+    watched_capacity = capacity;
+  }
+  watched[watched_count++] = (Watched){fd, writable, data};
+  return 0;
+}
+
+static int poller_modify(int fd, int writable, void *data)
+{
+  for (int i = 0; i < watched_count; i++) {
+    if (watched[i].fd == fd) {
+      watched[i].writable = writable;
+      watched[i].data = data;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void poller_remove(int fd)
+{
+  for (int i = 0; i < watched_count; i++) {
+    if (watched[i].fd == fd) {
+      watched[i] = watched[--watched_count];
+      return;
+    }
+  }
+}
+
+static int poller_wait(void **ready, int max_ready, int timeout_ms)
+{
+  for (int i = 0; i < watched_count; i++) {
+    poll_fds[i].fd = watched[i].fd;
+    poll_fds[i].events = watched[i].writable ? POLLOUT : POLLIN;
+    poll_fds[i].revents = 0;
+  }
+
+  int rc = poll(poll_fds, watched_count, timeout_ms);
+  if (rc <= 0) {
+    return rc;
+  }
+
+  // Snapshot the ready set first: handling one entry may remove others
+  int count = 0;
+  for (int i = 0; i < watched_count && count < max_ready; i++) {
+    if (poll_fds[i].revents) {
+      ready[count++] = watched[i].data;
+    }
+  }
+  return count;
+}
+
+#endif
+
+static void arm_timeout(Connection *connection, TimeoutKind kind)
+{
+  static const int *const timeouts[] = {
+      [TIMEOUT_HEADER] = &config.header_timeout_ms,
+      [TIMEOUT_BODY] = &config.body_timeout_ms,
+      [TIMEOUT_IDLE] = &config.idle_timeout_ms,
+      [TIMEOUT_WRITE] = &config.write_timeout_ms,
+      [TIMEOUT_HEARTBEAT] = &config.stream_heartbeat_ms,
+  };
+
+  connection->timeout_kind = kind;
+  timer_add(&wheel, &connection->timer, now_ms() + *timeouts[kind]);
+}
+
+static void close_connection(Connection *connection)
+{
+  timer_cancel(&wheel, &connection->timer);
+  poller_remove(connection->socket);
+  close(connection->socket);
+  free(connection->buffer);
+  free(connection->response);
+
+  if (connection->state == CONNECTION_STREAMING) {
+    pubsub_unsubscribe_all(&connection->subscriptions);
+    for (size_t i = 0; i < connection->queue_length; i++) {
+      message_release(connection->queue[(connection->queue_head + i) %
+                                        STREAM_QUEUE_LENGTH]);
+    }
+    free(connection->queue);
+    metrics_add(METRIC_STREAMS_OPEN, -1);
+    if (connection->upgrade.websocket) {
+      metrics_add(METRIC_WEBSOCKETS_OPEN, -1);
+    }
+  }
+  free(connection->upgrade.topic);
+  free(connection);
+
+  open_connections--;
+  metrics_add(METRIC_CONNECTIONS_OPEN, -1);
+}
+
+static int queue_message(Connection *connection, Message *message);
+
+static void expire_connection(Timer *timer)
+{
+  static const Metric metrics[] = {
+      [TIMEOUT_HEADER] = METRIC_HEADER_TIMEOUTS,
+      [TIMEOUT_BODY] = METRIC_BODY_TIMEOUTS,
+      [TIMEOUT_IDLE] = METRIC_IDLE_TIMEOUTS,
+      [TIMEOUT_WRITE] = METRIC_WRITE_TIMEOUTS,
+  };
+
+  Connection *connection = timer->data;
+  if (connection->timeout_kind == TIMEOUT_HEARTBEAT) {
+    queue_message(connection, message_retain(heartbeat));
+    return;
+  }
+
+  metrics_add(metrics[connection->timeout_kind], 1);
+  if (connection->timeout_kind != TIMEOUT_IDLE) {
+    printf("LOG: Closing connection %d after a timeout\n", connection->socket);
+  }
+  close_connection(connection);
+}
+
+static int watch_writable(Connection *connection, int writable)
+{
+  if (connection->writable == writable) {
+    return 0;
+  }
+  connection->writable = writable;
+  return poller_modify(connection->socket, writable, connection);
+}
+
+static int reserve_buffer(Connection *connection, size_t capacity)
+{
+  if (connection->capacity >= capacity) {
+    return 0;
+  }
+
+  char *buffer = realloc(connection->buffer, capacity);
+  if (!buffer) {
+    return -1;
+  }
+  connection->buffer = buffer;
+  connection->capacity = capacity;
+  return 0;
+}
+
+static void process_buffer(Connection *connection);
+
+// The bytes of message in the encoding this connection speaks
+static char *message_wire(const Connection *connection, Message *message,
+                          size_t *length)
+{
+  if (connection->upgrade.websocket) {
+    *length = message->frame_length;
+    return message_frame(message);
+  }
+  *length = message->length;
+  return message->data;
+}
+
+// Write queued messages, several per writev(), until the queue is empty or
+// the socket is full. Returns -1 once the connection is closed.
+static int flush_stream(Connection *connection)
+{
+  while (connection->queue_length > 0) {
+    struct iovec iov[STREAM_WRITE_BATCH];
+    int count = 0;
+    while (count < STREAM_WRITE_BATCH &&
+           (size_t)count < connection->queue_length) {
+      Message *message =
+          connection->queue[(connection->queue_head + count) %
+                            STREAM_QUEUE_LENGTH];
+      size_t skip = count == 0 ? connection->queue_offset : 0;
+      size_t length;
+      iov[count].iov_base = message_wire(connection, message, &length) + skip;
+      iov[count].iov_len = length - skip;
+      count++;
+    }
+
+    ssize_t sent = writev(connection->socket, iov, count);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+          watch_writable(connection, 1) == 0) {
+        if (connection->timeout_kind != TIMEOUT_WRITE ||
+            !timer_pending(&connection->timer)) {
+          arm_timeout(connection, TIMEOUT_WRITE);
+        }
+        return 0;
+      }
+      close_connection(connection);
+      return -1;
+    }
+
+    // Retire every message that went out whole
+    size_t remaining = (size_t)sent;
+    while (remaining > 0) {
+      Message *message = connection->queue[connection->queue_head];
+      size_t length;
+      message_wire(connection, message, &length);
+      size_t unsent = length - connection->queue_offset;
+      if (remaining < unsent) {
+        connection->queue_offset += remaining;
+        break;
+      }
+      remaining -= unsent;
+      connection->queue_offset = 0;
+      connection->queue_head =
+          (connection->queue_head + 1) % STREAM_QUEUE_LENGTH;
+      connection->queue_length--;
+      message_release(message);
+    }
+  }
+
+  // A WebSocket that sent its close frame is done once that is out
+  if (connection->closing || watch_writable(connection, 0) < 0) {
+    close_connection(connection);
+    return -1;
+  }
+  arm_timeout(connection, TIMEOUT_HEARTBEAT);
+  return 0;
+}
+
+// A subscriber that lets its queue fill is dropped rather than buffered
+// without bound; the client reconnects and reloads what it missed. An
+// update that supersedes one still waiting takes its place instead of a
+// new slot, so a burst on one game costs a slow reader a single message.
+static int queue_message(Connection *connection, Message *message)
+{
+  if (!message) {
+    close_connection(connection);
+    return -1;
+  }
+  if (connection->closing) {
+    message_release(message);
+    return 0;
+  }
+
+  if (message->key) {
+    // The head may be half written, and must go out as it started
+    for (size_t i = connection->queue_offset > 0 ? 1 : 0;
+         i < connection->queue_length; i++) {
+      Message **queued = &connection->queue[(connection->queue_head + i) %
+                                            STREAM_QUEUE_LENGTH];
+      if ((*queued)->key == message->key) {
+        message_release(*queued);
+        *queued = message;
+        metrics_add(METRIC_EVENTS_COALESCED, 1);
+        return 0;
+      }
+    }
+  }
+
+  if (connection->queue_length == STREAM_QUEUE_LENGTH) {
+    message_release(message);
+    metrics_add(METRIC_STREAMS_DROPPED, 1);
+    printf("LOG: Dropping stream %d, its queue is full\n", connection->socket);
+    close_connection(connection);
+    return -1;
+  }
+
+  connection->queue[(connection->queue_head + connection->queue_length) %
+                    STREAM_QUEUE_LENGTH] = message;
+  connection->queue_length++;
+  return connection->writable ? 0 : flush_stream(connection);
+}
+
+static void deliver_message(void *owner, Message *message)
+{
+  metrics_add(METRIC_EVENTS_DELIVERED, 1);
+  queue_message(owner, message);
+}
+
+static int send_frame(Connection *connection, WebSocketOpcode opcode,
+                      const char *payload, size_t length)
+{
+  return queue_message(connection,
+                       message_websocket(opcode, payload, length));
+}
+
+// Send a close frame; the connection goes once it is out
+static int send_close(Connection *connection, const char *payload,
+                      size_t length)
+{
+  int rc = send_frame(connection, WEBSOCKET_CLOSE, payload, length);
+  if (rc == 0) {
+    connection->closing = 1;
+    if (connection->queue_length == 0) {
+      close_connection(connection);
+      return -1;
+    }
+  }
+  return rc;
+}
+
+static int close_websocket(Connection *connection, int code)
+{
+  char payload[2] = {(char)(code >> 8), (char)(code & 0xff)};
+  return send_close(connection, payload, sizeof(payload));
+}
+
+// A WebSocket may follow the catalog, any game, and only its own user
+static int topic_allowed(const Connection *connection, const char *topic)
+{
+  if (strcmp(topic, "catalog") == 0) {
+    return 1;
+  }
+
+  char expected[32];
+  char *end;
+  if (strncmp(topic, "game:", 5) == 0 && isdigit((unsigned char)topic[5])) {
+    long game_id = strtol(topic + 5, &end, 10);
+    snprintf(expected, sizeof(expected), "game:%ld", game_id);
+    return *end == '\0' && strcmp(topic, expected) == 0;
+  }
+
+  snprintf(expected, sizeof(expected), "user:%ld",
+           connection->upgrade.user_id);
+  return connection->upgrade.user_id >= 0 && strcmp(topic, expected) == 0;
+}
+
+// {"subscribe": topic} or {"unsubscribe": topic}, answered in kind
+static int run_command(Connection *connection, const WebSocketFrame *frame)
+{
+  cJSON *command = cJSON_ParseWithLength(frame->payload, frame->length);
+  cJSON *subscribe = cJSON_GetObjectItemCaseSensitive(command, "subscribe");
+  cJSON *unsubscribe =
+      cJSON_GetObjectItemCaseSensitive(command, "unsubscribe");
+
+  char reply[96];
+  if (cJSON_IsString(subscribe) &&
+      topic_allowed(connection, subscribe->valuestring)) {
+    int added;
+    if (connection->subscription_count >= WEBSOCKET_MAX_SUBSCRIPTIONS) {
+      snprintf(reply, sizeof(reply),
+               "{\"error\": \"Too many subscriptions.\"}");
+    } else if ((added = pubsub_subscribe(&connection->subscriptions,
+                                         subscribe->valuestring,
+                                         connection)) < 0) {
+      cJSON_Delete(command);
+      close_connection(connection);
+      return -1;
+    } else {
+      connection->subscription_count += added;
+      snprintf(reply, sizeof(reply), "{\"subscribed\": \"%s\"}",
+               subscribe->valuestring);
+    }
+  } else if (cJSON_IsString(unsubscribe) &&
+             topic_allowed(connection, unsubscribe->valuestring)) {
+    connection->subscription_count -=
+        pubsub_unsubscribe(&connection->subscriptions,
+                           unsubscribe->valuestring);
+    snprintf(reply, sizeof(reply), "{\"unsubscribed\": \"%s\"}",
+             unsubscribe->valuestring);
+  } else {
+    snprintf(reply, sizeof(reply),
+             "{\"error\": \"Unknown command or topic.\"}");
+  }
+  cJSON_Delete(command);
+
+  return send_frame(connection, WEBSOCKET_TEXT, reply, strlen(reply));
+}
+
+// Act on every whole frame in the buffer. Returns -1 once the connection
+// is closed.
+static int process_frames(Connection *connection)
+{
+  size_t used = 0;
+  int rc = 0;
+  while (rc == 0 && !connection->closing) {
+    WebSocketFrame frame;
+    long taken = websocket_parse_frame(connection->buffer + used,
+                                       connection->length - used,
+                                       WEBSOCKET_MAX_MESSAGE, &frame);
+    if (taken == 0) {
+      break;
+    }
+    if (taken < 0) {
+      return close_websocket(connection, 1002);
+    }
+    used += taken;
+
+    switch (frame.opcode) {
+    case WEBSOCKET_TEXT:
+      // Commands are small; there is no reassembly of fragments
+      rc = frame.fin ? run_command(connection, &frame)
+                     : close_websocket(connection, 1003);
+      break;
+    case WEBSOCKET_PING:
+      rc = send_frame(connection, WEBSOCKET_PONG, frame.payload, frame.length);
+      break;
+    case WEBSOCKET_PONG:
+      break;
+    case WEBSOCKET_CLOSE:
+      // Echo the status code, if the client gave one
+      rc = send_close(connection, frame.payload, frame.length < 2 ? 0 : 2);
+      break;
+    default:
+      rc = close_websocket(connection, 1003);
+      break;
+    }
+  }
+  if (rc < 0) {
+    return -1;
+  }
+
+  connection->length -= used;
+  memmove(connection->buffer, connection->buffer + used, connection->length);
+  return 0;
+}
+
+static void read_websocket(Connection *connection)
+{
+  while (!connection->closing) {
+    ssize_t bytes_read =
+        read(connection->socket, connection->buffer + connection->length,
+             connection->capacity - connection->length);
+    if (bytes_read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (bytes_read <= 0) {
+      close_connection(connection);
+      return;
+    }
+    connection->length += bytes_read;
+    if (process_frames(connection) < 0) {
+      return;
+    }
+  }
+}
+
+static void start_stream(Connection *connection)
+{
+  connection->state = CONNECTION_STREAMING;
+  metrics_add(METRIC_STREAMS_OPEN, 1);
+
+  if (connection->upgrade.websocket) {
+    // A buffer that always fits the largest frame it accepts; a client
+    // may already have sent some behind the handshake
+    metrics_add(METRIC_WEBSOCKETS_OPEN, 1);
+    if (reserve_buffer(connection,
+                       WEBSOCKET_MAX_HEADER + WEBSOCKET_MAX_MESSAGE) < 0) {
+      close_connection(connection);
+      return;
+    }
+  } else {
+    // Nothing more is read from an event stream, so its buffer goes
+    free(connection->buffer);
+    connection->buffer = NULL;
+    connection->capacity = 0;
+    connection->length = 0;
+  }
+
+  connection->queue = malloc(STREAM_QUEUE_LENGTH * sizeof(Message *));
+  if (!connection->queue ||
+      (connection->upgrade.topic &&
+       pubsub_subscribe(&connection->subscriptions, connection->upgrade.topic,
+                        connection) < 0) ||
+      watch_writable(connection, 0) < 0) {
+    close_connection(connection);
+    return;
+  }
+  free(connection->upgrade.topic);
+  connection->upgrade.topic = NULL;
+  arm_timeout(connection, TIMEOUT_HEARTBEAT);
+
+  if (connection->upgrade.websocket && connection->length > 0) {
+    process_frames(connection);
+  }
+}
+
+// The client has nothing to say on an event stream; reading only notices
+// it leave
+static void read_stream(Connection *connection)
+{
+  if (connection->upgrade.websocket) {
+    read_websocket(connection);
+    return;
+  }
+
+  char discard[256];
+  while (1) {
+    ssize_t bytes_read = read(connection->socket, discard, sizeof(discard));
+    if (bytes_read > 0 || (bytes_read < 0 && errno == EINTR)) {
+      continue;
+    }
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    close_connection(connection);
+    return;
+  }
+}
+
+static void write_connection(Connection *connection)
+{
+  while (connection->response_sent < connection->response_length) {
+    ssize_t sent = send(connection->socket,
+                        connection->response + connection->response_sent,
+                        connection->response_length - connection->response_sent,
+                        0);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+          watch_writable(connection, 1) == 0) {
+        if (!timer_pending(&connection->timer)) {
+          arm_timeout(connection, TIMEOUT_WRITE);
+        }
+        return;
+      }
+      close_connection(connection);
+      return;
+    }
+    connection->response_sent += sent;
+  }
+
+  free(connection->response);
+  connection->response = NULL;
+  timer_cancel(&wheel, &connection->timer);
+
+  if (connection->upgrade.topic || connection->upgrade.websocket) {
+    start_stream(connection);
+    return;
+  }
+
+  // Give back a large body buffer before going idle; a pipelined leftover
+  // always fits in the header window
+  if (connection->capacity > MAX_HEADER_SIZE + 1) {
+    char *buffer = realloc(connection->buffer, MAX_HEADER_SIZE + 1);
+    if (buffer) {
+      connection->buffer = buffer;
+      connection->capacity = MAX_HEADER_SIZE + 1;
+    }
+  }
+
+  if (!connection->keep_alive || watch_writable(connection, 0) < 0) {
+    close_connection(connection);
+    return;
+  }
+
+  // Anything left in the buffer is the start of a pipelined request
+  connection->state = CONNECTION_READING_HEAD;
+  if (connection->length > 0) {
+    arm_timeout(connection, TIMEOUT_HEADER);
+    process_buffer(connection);
+  } else {
+    arm_timeout(connection, TIMEOUT_IDLE);
+  }
+}
+
+static void wake_loop(void)
+{
+  char byte = 0;
+  write(wake_pipe[1], &byte, 1);
+}
+
+static void complete_request(Connection *connection)
+{
+  pthread_mutex_lock(&completed_lock);
+  int was_empty = completed == NULL;
+  connection->next_completed = completed;
+  completed = connection;
+  pthread_mutex_unlock(&completed_lock);
+
+  if (was_empty) {
+    wake_loop();
+  }
+}
+
+// Runs on a worker thread
+static void run_request(Job *job, sqlite3 *db, char **err_msg)
+{
+  Connection *connection = job->data;
+  RequestHead *head = &connection->head;
+  char *body = NULL;
+  BodyReader *reader = NULL;
+
+  if (head->stream_body) {
+    // The handler pulls the rest of the body straight off the socket
+    reader = malloc(sizeof(BodyReader));
+    if (!reader) {
+      connection->response = NULL;
+      complete_request(connection);
+      return;
+    }
+    if (head->expect_continue) {
+      const char *continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+      send_all(connection->socket, continue_response,
+               strlen(continue_response));
+    }
+    body_reader_init(reader, connection->socket,
+                     connection->buffer + head->head_length,
+                     connection->length - head->head_length,
+                     head->content_length);
+  } else {
+    body = connection->buffer + head->head_length;
+  }
+
+  connection->response = handle_request(db, err_msg, connection->socket,
+                                        connection->buffer, body, reader);
+  connection->upgrade = take_stream_upgrade();
+  free(reader);
+  complete_request(connection);
+}
+
+// Runs on a worker thread, in place of run_request
+static void shed_request(Job *job)
+{
+  Connection *connection = job->data;
+  connection->response = construct_response_with_headers(
+      SERVICE_UNAVAILABLE, "Retry-After: 1\r\n",
+      "{\"error\": \"Server is busy, try again later.\"}");
+  complete_request(connection);
+}
+
+// Routes that read whole tables; they are served on snapshot connections
+static const char *const snapshot_routes[] = {
+    "GET /export/",
+};
+
+static Priority request_priority(const char *request)
+{
+  for (size_t i = 0; i < sizeof(snapshot_routes) / sizeof(snapshot_routes[0]);
+       i++) {
+    if (strncmp(request, snapshot_routes[i], strlen(snapshot_routes[i])) ==
+        0) {
+      return PRIORITY_SNAPSHOT;
+    }
+  }
+  if (strncmp(request, "POST /login ", 12) == 0 ||
+      strncmp(request, "POST /register ", 15) == 0) {
+    return PRIORITY_AUTH;
+  }
+  if (strncmp(request, "GET ", 4) == 0 || strncmp(request, "HEAD ", 5) == 0 ||
+      strncmp(request, "OPTIONS ", 8) == 0) {
+    return PRIORITY_READ;
+  }
+  return PRIORITY_WRITE;
+}
+
+static void finish_request(Connection *connection);
+
+static void dispatch(Connection *connection)
+{
+  timer_cancel(&wheel, &connection->timer);
+  metrics_add(METRIC_REQUESTS, 1);
+
+  RequestHead *head = &connection->head;
+  if (!head->stream_body) {
+    // Terminate the body in place; the byte it overwrites may belong to a
+    // pipelined request and is put back afterwards
+    char *body = connection->buffer + head->head_length;
+    connection->saved = body[head->content_length];
+    body[head->content_length] = '\0';
+  }
+
+  // Out of the poller until the worker is done: pipelined bytes must wait
+  poller_remove(connection->socket);
+  connection->state = CONNECTION_QUEUED;
+  connection->writable = 0;
+
+  int retry_after = rate_limit_check(connection->peer, connection->buffer);
+  if (retry_after) {
+    char headers[64];
+    snprintf(headers, sizeof(headers), "Retry-After: %d\r\n", retry_after);
+    connection->response = construct_response_with_headers(
+        TOO_MANY_REQUESTS, headers,
+        "{\"error\": \"Too many requests, slow down.\"}");
+    finish_request(connection);
+    return;
+  }
+
+  connection->job.priority = request_priority(connection->buffer);
+  connection->job.data = connection;
+  connection->job.run = run_request;
+  connection->job.shed = shed_request;
+
+  if (admission_submit(&connection->job) < 0) {
+    connection->response = construct_response_with_headers(
+        SERVICE_UNAVAILABLE, "Retry-After: 1\r\n",
+        "{\"error\": \"Server is busy, try again later.\"}");
+    complete_request(connection);
+  }
+}
+
+// Back on the loop thread with the worker's response
+static void finish_request(Connection *connection)
+{
+  RequestHead *head = &connection->head;
+  size_t request_length = head->head_length + head->content_length;
+  char *response = connection->response;
+  connection->response = NULL;
+
+  // A streamed response or request body leaves the connection in an
+  // unknown state, so only fully buffered exchanges are kept alive
+  connection->keep_alive = head->keep_alive && response &&
+                           !head->stream_body && !connection->upgrade.topic &&
+                           !connection->upgrade.websocket;
+  // Frames may follow a WebSocket handshake as a pipelined request would
+  if (connection->keep_alive || connection->upgrade.websocket) {
+    connection->buffer[request_length] = connection->saved;
+    connection->length -= request_length;
+    memmove(connection->buffer, connection->buffer + request_length,
+            connection->length);
+  } else {
+    connection->length = 0;
+  }
+
+  if (!response || poller_add(connection->socket, 0, connection) < 0) {
+    free(response);
+    close_connection(connection);
+    return;
+  }
+
+  connection->state = CONNECTION_WRITING;
+  connection->response = response;
+  connection->response_length = strlen(response);
+  connection->response_sent = 0;
+  write_connection(connection);
+}
+
+static void drain_completions(void)
+{
+  char bytes[64];
+  while (read(wake_pipe[0], bytes, sizeof(bytes)) > 0) {
+  }
+
+  pthread_mutex_lock(&completed_lock);
+  Connection *connection = completed;
+  completed = NULL;
+  pthread_mutex_unlock(&completed_lock);
+
+  while (connection) {
+    Connection *next = connection->next_completed;
+    finish_request(connection);
+    connection = next;
+  }
+}
+
+static void reject(Connection *connection, char *response)
+{
+  timer_cancel(&wheel, &connection->timer);
+  connection->keep_alive = 0;
+  connection->length = 0;
+  connection->state = CONNECTION_WRITING;
+  connection->response = response;
+  connection->response_length = response ? strlen(response) : 0;
+  connection->response_sent = 0;
+  write_connection(connection);
+}
+
+static void process_buffer(Connection *connection)
+{
+  RequestHead *head = &connection->head;
+
+  if (connection->state == CONNECTION_READING_HEAD) {
+    connection->buffer[connection->length] = '\0';
+    if (!strstr(connection->buffer, "\r\n\r\n")) {
+      if (connection->length >= MAX_HEADER_SIZE) {
+        reject(connection,
+               construct_response(REQUEST_HEADER_FIELDS_TOO_LARGE,
+                                  "{\"error\": \"Headers too large.\"}"));
+      }
+      return;
+    }
+
+    char *error = parse_request_head(connection->buffer, head);
+    if (error) {
+      reject(connection, error);
+      return;
+    }
+
+    size_t request_length = head->head_length + head->content_length;
+    if (head->stream_body || connection->length >= request_length) {
+      dispatch(connection);
+      return;
+    }
+
+    if (reserve_buffer(connection, request_length + 1) < 0) {
+      reject(connection,
+             construct_response(INTERNAL_SERVER_ERROR,
+                                "{\"error\": \"An internal error occurred.\"}"));
+      return;
+    }
+    if (head->expect_continue) {
+      const char *continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+      send(connection->socket, continue_response, strlen(continue_response), 0);
+    }
+    connection->state = CONNECTION_READING_BODY;
+    arm_timeout(connection, TIMEOUT_BODY);
+    return;
+  }
+
+  if (connection->length >= head->head_length + head->content_length) {
+    dispatch(connection);
+  }
+}
+
+static void read_connection(Connection *connection)
+{
+  if (reserve_buffer(connection, MAX_HEADER_SIZE + 1) < 0) {
+    close_connection(connection);
+    return;
+  }
+
+  // Stop at the end of the declared body so a pipelined request that
+  // follows is never mistaken for part of it
+  size_t limit = connection->state == CONNECTION_READING_BODY
+                     ? connection->head.head_length +
+                           connection->head.content_length
+                     : MAX_HEADER_SIZE;
+
+  while (connection->length < limit) {
+    ssize_t bytes_read = read(connection->socket,
+                              connection->buffer + connection->length,
+                              limit - connection->length);
+    if (bytes_read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (bytes_read <= 0) {
+      close_connection(connection);
+      return;
+    }
+
+    // The first byte of a new request swaps the idle deadline for the
+    // header deadline
+    if (connection->timeout_kind == TIMEOUT_IDLE) {
+      arm_timeout(connection, TIMEOUT_HEADER);
+    }
+    connection->length += bytes_read;
+  }
+
+  process_buffer(connection);
+}
+
+static void accept_connections(int server_fd)
+{
+  while (1) {
+    struct sockaddr_in address;
+    socklen_t address_length = sizeof(address);
+    int socket = accept(server_fd, (struct sockaddr *)&address, &address_length);
+    if (socket < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("ERROR: Accept failed");
+      }
+      return;
+    }
+
+    if (open_connections >= config.max_connections) {
+      metrics_add(METRIC_CONNECTIONS_REJECTED, 1);
+      close(socket);
+      continue;
+    }
+
+    Connection *connection = calloc(1, sizeof(Connection));
+    if (!connection || set_nonblocking(socket) < 0 ||
+        poller_add(socket, 0, connection) < 0) {
+      perror("ERROR: Failed to set up connection");
+      free(connection);
+      close(socket);
+      continue;
+    }
+
+    connection->socket = socket;
+    connection->peer = address.sin_addr.s_addr;
+    connection->state = CONNECTION_READING_HEAD;
+    timer_init(&connection->timer, connection);
+    arm_timeout(connection, TIMEOUT_HEADER);
+
+    open_connections++;
+    metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+    metrics_add(METRIC_CONNECTIONS_OPEN, 1);
+  }
+}
+
+void event_loop_run(int server_fd)
+{
+  timer_wheel_init(&wheel, now_ms());
+
+  if (set_nonblocking(server_fd) < 0 || poller_init() < 0 ||
+      poller_add(server_fd, 0, NULL) < 0 || pipe(wake_pipe) < 0 ||
+      set_nonblocking(wake_pipe[0]) < 0 || set_nonblocking(wake_pipe[1]) < 0 ||
+      poller_add(wake_pipe[0], 0, &wake_token) < 0) {
+    perror("ERROR: Failed to start event loop");
+    return;
+  }
+
+  // A comment line for event streams, an empty ping for WebSockets
+  heartbeat = message_create(": heartbeat\n\n", strlen(": heartbeat\n\n"),
+                             "\x89\x00", 2);
+  if (!heartbeat) {
+    return;
+  }
+  pubsub_init(wake_loop);
+
+  void *ready[MAX_EVENTS];
+  while (1) {
+    int count =
+        poller_wait(ready, MAX_EVENTS, timer_wheel_next_timeout(&wheel, now_ms()));
+    if (count < 0 && errno != EINTR) {
+      perror("ERROR: Event wait failed");
+      return;
+    }
+
+    // Delivery can close any subscriber, including one later in ready[], so
+    // it waits until the batch has been handled
+    int woken = 0;
+    for (int i = 0; i < count; i++) {
+      Connection *connection = ready[i];
+      if (!connection) {
+        accept_connections(server_fd);
+      } else if (ready[i] == &wake_token) {
+        drain_completions();
+        woken = 1;
+      } else if (connection->state == CONNECTION_STREAMING) {
+        if (connection->writable) {
+          flush_stream(connection);
+        } else {
+          read_stream(connection);
+        }
+      } else if (connection->state == CONNECTION_WRITING) {
+        write_connection(connection);
+      } else {
+        read_connection(connection);
+      }
+    }
+    if (woken) {
+      pubsub_deliver(deliver_message);
+    }
+
+    timer_wheel_advance(&wheel, now_ms(), expire_connection);
+  }
+}
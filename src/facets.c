@@ -0,0 +1,674 @@
+#include "facets.h"
+#include "bitmap.h"
+#include "defines.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { FACET_GENRE, FACET_DEVELOPER, FACET_PRICE, FACET_DIMENSIONS };
+
+static const char *dimension_names[FACET_DIMENSIONS] = {"genre", "developer",
+                                                        "price"};
+
+static const struct {
+  const char *name;
+  long max_cents;
+} price_bands[] = {
+    {"free", 0},         {"under_5", 499},   {"5_to_10", 999},
+    {"10_to_20", 1999},  {"20_to_40", 3999}, {"40_plus", LONG_MAX},
+};
+
+typedef struct {
+  char *value;
+  uint64_t hash;
+  Bitmap games;
+} FacetValue;
+
+// Values are only ever appended so that their positions can be stored per
+// game; values whose bitmap becomes empty are simply skipped when reporting.
+// slots finds a value's position by its hash: open addressing, -1 is empty.
+typedef struct {
+  FacetValue *values;
+  size_t count;
+  size_t capacity;
+  int32_t *slots;
+  size_t slot_capacity;
+} FacetDimension;
+
+typedef struct {
+  int32_t value[FACET_DIMENSIONS];
+} GameFacets;
+
+typedef struct {
+  FacetDimension dimensions[FACET_DIMENSIONS];
+  Bitmap all_games;
+  // Facet positions of every indexed game, addressed by game_id
+  GameFacets *games;
+  size_t games_capacity;
+} FacetIndex;
+
+// A game change that arrived while a rebuild was scanning the table
+typedef struct FacetUpdate {
+  long game_id;
+  int removed;
+  char *genre;
+  char *developer;
+  long price_cents;
+  struct FacetUpdate *next;
+} FacetUpdate;
+
+static FacetIndex *facets = NULL;
+
+// Counting runs under the read lock; loading and removing games and
+// swapping in a rebuilt index take it exclusively. A rebuild scans into an
+// index of its own without holding it.
+static pthread_rwlock_t facets_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t build_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rebuilding = 0;
+static FacetUpdate *pending_head = NULL;
+static FacetUpdate **pending_tail = &pending_head;
+
+static uint64_t hash_value(const char *value)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *value; value++) {
+    hash = (hash ^ (unsigned char)*value) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static int find_value(const FacetDimension *dimension, const char *value)
+{
+  if (!dimension->slot_capacity) {
+    return -1;
+  }
+
+  uint64_t hash = hash_value(value);
+  size_t mask = dimension->slot_capacity - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    int32_t position = dimension->slots[slot];
+    if (position < 0) {
+      return -1;
+    }
+    const FacetValue *facet_value = &dimension->values[position];
+    if (facet_value->hash == hash && strcmp(facet_value->value, value) == 0) {
+      return position;
+    }
+  }
+}
+
+static void place_slot(int32_t *slots, size_t capacity, uint64_t hash,
+                       int32_t position)
+{
+  size_t slot = hash & (capacity - 1);
+  while (slots[slot] >= 0) {
+    slot = (slot + 1) & (capacity - 1);
+  }
+  slots[slot] = position;
+}
+
+// Keep the slot table at most three quarters full
+static int reserve_slots(FacetDimension *dimension)
+{
+  if ((dimension->count + 1) * 4 <= dimension->slot_capacity * 3) {
+    return 1;
+  }
+
+  size_t new_capacity =
+      dimension->slot_capacity ? dimension->slot_capacity * 2 : 64;
+  int32_t *slots = malloc(new_capacity * sizeof(*slots));
+  if (!slots) {
+    return 0;
+  }
+  for (size_t i = 0; i < new_capacity; i++) {
+    slots[i] = -1;
+  }
+  for (size_t i = 0; i < dimension->count; i++) {
+    place_slot(slots, new_capacity, dimension->values[i].hash, (int32_t)i);
+  }
+  free(dimension->slots);
+  dimension->slots = slots;
+  dimension->slot_capacity = new_capacity;
+  return 1;
+}
+
+static int intern_value(FacetDimension *dimension, const char *value)
+{
+  int position = find_value(dimension, value);
+  if (position >= 0) {
+    return position;
+  }
+
+  if (!reserve_slots(dimension)) {
+    return -1;
+  }
+  if (dimension->count == dimension->capacity) {
+    size_t new_capacity = dimension->capacity ? dimension->capacity * 2 : 16;
+    FacetValue *values =
+        realloc(dimension->values, new_capacity * sizeof(*values));
+    if (!values) {
+      return -1;
+    }
+    dimension->values = values;
+    dimension->capacity = new_capacity;
+  }
+
+  FacetValue *facet_value = &dimension->values[dimension->count];
+  facet_value->value = strdup(value);
+  if (!facet_value->value) {
+    return -1;
+  }
+  facet_value->hash = hash_value(value);
+  bitmap_init(&facet_value->games);
+  place_slot(dimension->slots, dimension->slot_capacity, facet_value->hash,
+             (int32_t)dimension->count);
+  return (int)dimension->count++;
+}
+
+static const char *price_band(long price_cents)
+{
+  size_t band = 0;
+  while (price_cents > price_bands[band].max_cents) {
+    band++;
+  }
+  return price_bands[band].name;
+}
+
+static int reserve_games(FacetIndex *index, size_t game_id)
+{
+  if (game_id < index->games_capacity) {
+    return 1;
+  }
+
+  size_t new_capacity = index->games_capacity ? index->games_capacity : 1024;
+  while (new_capacity <= game_id) {
+    new_capacity *= 2;
+  }
+
+  GameFacets *new_games =
+      realloc(index->games, new_capacity * sizeof(*new_games));
+  if (!new_games) {
+    return 0;
+  }
+  for (size_t i = index->games_capacity; i < new_capacity; i++) {
+    for (int d = 0; d < FACET_DIMENSIONS; d++) {
+      new_games[i].value[d] = -1;
+    }
+  }
+  index->games = new_games;
+  index->games_capacity = new_capacity;
+  return 1;
+}
+
+static void remove_game(FacetIndex *index, long game_id)
+{
+  if (game_id < 0 || (size_t)game_id >= index->games_capacity) {
+    return;
+  }
+
+  GameFacets *game = &index->games[game_id];
+  for (int d = 0; d < FACET_DIMENSIONS; d++) {
+    int position = game->value[d];
+    if (position >= 0) {
+      bitmap_remove(&index->dimensions[d].values[position].games,
+                    (uint32_t)game_id);
+      game->value[d] = -1;
+    }
+  }
+  bitmap_remove(&index->all_games, (uint32_t)game_id);
+}
+
+static void set_game(FacetIndex *index, long game_id, const char *genre,
+                     const char *developer, long price_cents)
+{
+  if (game_id < 0 || (uint64_t)game_id > UINT32_MAX ||
+      !reserve_games(index, (size_t)game_id)) {
+    return;
+  }
+
+  remove_game(index, game_id);
+
+  const char *values[FACET_DIMENSIONS] = {genre, developer,
+                                          price_band(price_cents)};
+  for (int d = 0; d < FACET_DIMENSIONS; d++) {
+    if (!values[d]) {
+      continue;
+    }
+    int position = intern_value(&index->dimensions[d], values[d]);
+    if (position >= 0) {
+      bitmap_add(&index->dimensions[d].values[position].games,
+                 (uint32_t)game_id);
+      index->games[game_id].value[d] = position;
+    }
+  }
+  bitmap_add(&index->all_games, (uint32_t)game_id);
+}
+
+static void free_index(FacetIndex *index)
+{
+  if (!index) {
+    return;
+  }
+  for (int d = 0; d < FACET_DIMENSIONS; d++) {
+    FacetDimension *dimension = &index->dimensions[d];
+    for (size_t i = 0; i < dimension->count; i++) {
+      free(dimension->values[i].value);
+      bitmap_free(&dimension->values[i].games);
+    }
+    free(dimension->values);
+    free(dimension->slots);
+  }
+  bitmap_free(&index->all_games);
+  free(index->games);
+  free(index);
+}
+
+static FacetIndex *create_index(void)
+{
+  FacetIndex *index = calloc(1, sizeof(*index));
+  if (!index) {
+    return NULL;
+  }
+  bitmap_init(&index->all_games);
+
+  // Keep price bands in ascending order regardless of the data
+  for (size_t i = 0; i < sizeof(price_bands) / sizeof(price_bands[0]); i++) {
+    if (intern_value(&index->dimensions[FACET_PRICE], price_bands[i].name) <
+        0) {
+      free_index(index);
+      return NULL;
+    }
+  }
+  return index;
+}
+
+static void free_update(FacetUpdate *update)
+{
+  free(update->genre);
+  free(update->developer);
+  free(update);
+}
+
+// Hold on to a change for the rebuild in progress; call with the lock held
+static void defer_update(long game_id, int removed, const char *genre,
+                         const char *developer, long price_cents)
+{
+  FacetUpdate *update = calloc(1, sizeof(*update));
+  if (!update) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    return;
+  }
+  update->game_id = game_id;
+  update->removed = removed;
+  update->genre = genre ? strdup(genre) : NULL;
+  update->developer = developer ? strdup(developer) : NULL;
+  update->price_cents = price_cents;
+  if ((genre && !update->genre) || (developer && !update->developer)) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    free_update(update);
+    return;
+  }
+  *pending_tail = update;
+  pending_tail = &update->next;
+}
+
+// Replay the deferred changes onto index, or just drop them when it is NULL
+static size_t replay_updates(FacetIndex *index)
+{
+  size_t replayed = 0;
+  while (pending_head) {
+    FacetUpdate *update = pending_head;
+    pending_head = update->next;
+    if (index && update->removed) {
+      remove_game(index, update->game_id);
+    } else if (index) {
+      set_game(index, update->game_id, update->genre, update->developer,
+               update->price_cents);
+    }
+    free_update(update);
+    replayed++;
+  }
+  pending_tail = &pending_head;
+  return replayed;
+}
+
+void facets_remove_game(long game_id)
+{
+  pthread_rwlock_wrlock(&facets_lock);
+  if (facets) {
+    remove_game(facets, game_id);
+  }
+  if (rebuilding) {
+    defer_update(game_id, 1, NULL, NULL, 0);
+  }
+  pthread_rwlock_unlock(&facets_lock);
+}
+
+void facets_load_game(sqlite3 *db, long game_id)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db,
+                         "SELECT genre, developer, price_cents FROM Games "
+                         "WHERE game_id = ?1;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to load facets: %s\n", sqlite3_errmsg(db));
+    return;
+  }
+  sqlite3_bind_int64(stmt, 1, game_id);
+
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *genre = (const char *)sqlite3_column_text(stmt, 0);
+    const char *developer = (const char *)sqlite3_column_text(stmt, 1);
+    long price_cents = sqlite3_column_int64(stmt, 2);
+
+    pthread_rwlock_wrlock(&facets_lock);
+    if (facets) {
+      set_game(facets, game_id, genre, developer, price_cents);
+    }
+    if (rebuilding) {
+      defer_update(game_id, 0, genre, developer, price_cents);
+    }
+    pthread_rwlock_unlock(&facets_lock);
+  }
+  sqlite3_finalize(stmt);
+}
+
+static int load_games(FacetIndex *index, sqlite3 *db)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(
+          db, "SELECT game_id, genre, developer, price_cents FROM Games;", -1,
+          &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to load facets: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  int rows = 0;
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    set_game(index, sqlite3_column_int64(stmt, 0),
+             (const char *)sqlite3_column_text(stmt, 1),
+             (const char *)sqlite3_column_text(stmt, 2),
+             sqlite3_column_int64(stmt, 3));
+    rows++;
+  }
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "ERROR: Failed to load facets: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+
+  return rc == SQLITE_DONE ? rows : -1;
+}
+
+void facets_free(void)
+{
+  pthread_rwlock_wrlock(&facets_lock);
+  free_index(facets);
+  facets = NULL;
+  replay_updates(NULL);
+  pthread_rwlock_unlock(&facets_lock);
+}
+
+// Scan into a fresh index while queries keep using the current one, then
+// swap it in. Changes made during the scan are replayed on top first; each
+// sets a game's whole state, so one the scan already saw is harmless.
+void facets_build(sqlite3 *db)
+{
+  pthread_mutex_lock(&build_lock);
+  pthread_rwlock_wrlock(&facets_lock);
+  rebuilding = 1;
+  pthread_rwlock_unlock(&facets_lock);
+
+  FacetIndex *index = create_index();
+  int rows = index ? load_games(index, db) : -1;
+
+  // A failed scan keeps the current index, unless there is none yet
+  pthread_rwlock_wrlock(&facets_lock);
+  FacetIndex *old = index;
+  if (rows >= 0 || !facets) {
+    old = facets;
+    facets = index;
+  }
+  size_t replayed = replay_updates(old == index ? NULL : index);
+  rebuilding = 0;
+  pthread_rwlock_unlock(&facets_lock);
+
+  free_index(old);
+  pthread_mutex_unlock(&build_lock);
+
+  if (rows >= 0) {
+    printf("LOG: Facet index built with %d games, %zu updates replayed.\n",
+           rows, replayed);
+  }
+}
+
+typedef struct {
+  const char *value;
+  uint64_t count;
+} FacetCount;
+
+static int compare_counts(const void *a, const void *b)
+{
+  const FacetCount *ca = a, *cb = b;
+  if (ca->count != cb->count) {
+    return ca->count < cb->count ? 1 : -1;
+  }
+  return strcmp(ca->value, cb->value);
+}
+
+// Keep the best `limit` counts in a heap whose root is the worst kept entry
+static void keep_top(FacetCount *top, size_t *found, size_t limit,
+                     FacetCount candidate)
+{
+  size_t i;
+  if (*found < limit) {
+    i = (*found)++;
+    while (i > 0 && compare_counts(&candidate, &top[(i - 1) / 2]) > 0) {
+      top[i] = top[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    top[i] = candidate;
+    return;
+  }
+
+  if (compare_counts(&candidate, &top[0]) >= 0) {
+    return;
+  }
+
+  i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= limit) {
+      break;
+    }
+    if (child + 1 < limit && compare_counts(&top[child + 1], &top[child]) > 0) {
+      child++;
+    }
+    if (compare_counts(&top[child], &candidate) <= 0) {
+      break;
+    }
+    top[i] = top[child];
+    i = child;
+  }
+  top[i] = candidate;
+}
+
+// Intersect every active filter except the skipped dimension. Returns NULL
+// for "no restriction", otherwise the result in *scratch or a filter bitmap.
+static const Bitmap *combine_filters(const Bitmap *filters[], int skip,
+                                     Bitmap *scratch, int *failed)
+{
+  const Bitmap *result = NULL;
+  for (int d = 0; d < FACET_DIMENSIONS; d++) {
+    if (d == skip || !filters[d]) {
+      continue;
+    }
+    if (!result) {
+      result = filters[d];
+      continue;
+    }
+
+    Bitmap combined;
+    if (!bitmap_and(result, filters[d], &combined)) {
+      *failed = 1;
+      break;
+    }
+    if (result == scratch) {
+      bitmap_free(scratch);
+    }
+    *scratch = combined;
+    result = scratch;
+  }
+  return result;
+}
+
+// Tally the dimension's value for every game in base
+static void scan_counts(const FacetIndex *index, const Bitmap *base, int d,
+                        uint64_t *counts)
+{
+  for (uint32_t i = 0; i < base->count; i++) {
+    const BitmapContainer *container = &base->containers[i];
+    const GameFacets *block = &index->games[(size_t)container->key << 16];
+
+    if (container->is_bitset) {
+      for (uint32_t w = 0; w < BITMAP_BITSET_WORDS; w++) {
+        uint64_t word = container->data.words[w];
+        while (word) {
+          int position = block[w * 64 + __builtin_ctzll(word)].value[d];
+          if (position >= 0) {
+            counts[position]++;
+          }
+          word &= word - 1;
+        }
+      }
+    } else {
+      for (uint32_t v = 0; v < container->cardinality; v++) {
+        int position = block[container->data.values[v]].value[d];
+        if (position >= 0) {
+          counts[position]++;
+        }
+      }
+    }
+  }
+}
+
+static cJSON *count_dimension(const FacetIndex *index, int d,
+                              const Bitmap *base)
+{
+  const FacetDimension *dimension = &index->dimensions[d];
+  FacetCount *counts = malloc((dimension->count + 1) * sizeof(*counts));
+  cJSON *json_array = cJSON_CreateArray();
+  if (!counts || !json_array) {
+    free(counts);
+    cJSON_Delete(json_array);
+    return NULL;
+  }
+
+  // Walking the filtered games once beats intersecting the filter with
+  // every value's bitmap, especially for developers where values are many.
+  uint64_t *scanned = NULL;
+  if (base) {
+    scanned = calloc(dimension->count + 1, sizeof(*scanned));
+    if (scanned) {
+      scan_counts(index, base, d, scanned);
+    }
+  }
+
+  size_t limit = d == FACET_PRICE ? dimension->count : FACETS_MAX_VALUES;
+  size_t found = 0;
+  for (size_t i = 0; i < dimension->count; i++) {
+    const Bitmap *games_with_value = &dimension->values[i].games;
+    FacetCount candidate = {dimension->values[i].value, 0};
+    if (base) {
+      candidate.count = scanned ? scanned[i] : 0;
+    } else {
+      candidate.count = bitmap_cardinality(games_with_value);
+    }
+
+    if (d == FACET_PRICE) {
+      counts[found++] = candidate;
+    } else if (candidate.count > 0) {
+      keep_top(counts, &found, limit, candidate);
+    }
+  }
+  free(scanned);
+
+  if (d != FACET_PRICE) {
+    qsort(counts, found, sizeof(*counts), compare_counts);
+  }
+
+  for (size_t i = 0; i < found; i++) {
+    cJSON *json_row = cJSON_CreateObject();
+    if (!json_row) {
+      break;
+    }
+    cJSON_AddStringToObject(json_row, "value", counts[i].value);
+    cJSON_AddNumberToObject(json_row, "count", (double)counts[i].count);
+    cJSON_AddItemToArray(json_array, json_row);
+  }
+
+  free(counts);
+  return json_array;
+}
+
+cJSON *facets_query(const char *genre, const char *developer,
+                    const char *price)
+{
+  static const Bitmap empty = {NULL, 0, 0};
+  const char *selected[FACET_DIMENSIONS] = {genre, developer, price};
+  const Bitmap *filters[FACET_DIMENSIONS];
+
+  pthread_rwlock_rdlock(&facets_lock);
+  if (!facets) {
+    pthread_rwlock_unlock(&facets_lock);
+    return NULL;
+  }
+  for (int d = 0; d < FACET_DIMENSIONS; d++) {
+    filters[d] = NULL;
+    if (selected[d]) {
+      const FacetDimension *dimension = &facets->dimensions[d];
+      int position = find_value(dimension, selected[d]);
+      filters[d] = position >= 0 ? &dimension->values[position].games : &empty;
+    }
+  }
+
+  cJSON *json = cJSON_CreateObject();
+  if (!json) {
+    pthread_rwlock_unlock(&facets_lock);
+    return NULL;
+  }
+
+  int failed = 0;
+  Bitmap scratch;
+  bitmap_init(&scratch);
+
+  // Each dimension is counted under the filters of the other dimensions, so
+  // picking a genre still shows how many games every other genre would have.
+  for (int d = 0; d < FACET_DIMENSIONS && !failed; d++) {
+    const Bitmap *base = combine_filters(filters, d, &scratch, &failed);
+    cJSON *json_counts = failed ? NULL : count_dimension(facets, d, base);
+    bitmap_free(&scratch);
+    if (!json_counts) {
+      failed = 1;
+      break;
+    }
+    cJSON_AddItemToObject(json, dimension_names[d], json_counts);
+  }
+
+  if (!failed) {
+    const Bitmap *base = combine_filters(filters, -1, &scratch, &failed);
+    uint64_t total = bitmap_cardinality(base ? base : &facets->all_games);
+    cJSON_AddNumberToObject(json, "total", (double)total);
+    bitmap_free(&scratch);
+  }
+  pthread_rwlock_unlock(&facets_lock);
+
+  if (failed) {
+    cJSON_Delete(json);
+    return NULL;
+  }
+  return json;
+}
@@ -0,0 +1,182 @@
+#include "hash_pool.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <crypt.h>
+#else
+// No crypt_r: the hash threads take turns on crypt()'s static buffer
+struct crypt_data {
+  char unused;
+};
+
+static pthread_mutex_t crypt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *crypt_r(const char *password, const char *setting,
+                           struct crypt_data *data)
+{
+  static _Thread_local char copy[256];
+  (void)data;
+
+  pthread_mutex_lock(&crypt_lock);
+  const char *result = crypt(password, setting);
+  if (result) {
+    snprintf(copy, sizeof(copy), "%s", result);
+  }
+  pthread_mutex_unlock(&crypt_lock);
+  return result ? copy : NULL;
+}
+#endif
+
+#define SALT_LENGTH 16
+
+// Lives on the stack of the request worker waiting for it
+typedef struct HashJob {
+  struct HashJob *next;
+  const char *password;
+  const char *setting;
+  char *hashed;
+  size_t size;
+  int done;
+  int ok;
+} HashJob;
+
+static HashJob *queue_head = NULL;
+static HashJob *queue_tail = NULL;
+static int queue_length = 0;
+static pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hash_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t hash_done = PTHREAD_COND_INITIALIZER;
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *hash_main(void *arg)
+{
+  (void)arg;
+#ifdef __linux__
+  // Linux applies nice per thread: hashing yields the CPU to request workers
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), HASH_NICE);
+#endif
+
+  // crypt_r keeps all of its state here; it is too big for the stack
+  struct crypt_data *data = calloc(1, sizeof(*data));
+  if (!data) {
+    fprintf(stderr, "ERROR: Hash thread failed to allocate its state\n");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&hash_lock);
+  while (1) {
+    while (!queue_head) {
+      pthread_cond_wait(&hash_ready, &hash_lock);
+    }
+    HashJob *job = queue_head;
+    queue_head = job->next;
+    if (!queue_head) {
+      queue_tail = NULL;
+    }
+    queue_length--;
+    metrics_add(METRIC_HASH_QUEUE_DEPTH, -1);
+    pthread_mutex_unlock(&hash_lock);
+
+    uint64_t started = now_us();
+    const char *result = crypt_r(job->password, job->setting, data);
+    // Failures come back as NULL or a string starting with '*'
+    int ok = result && result[0] != '*' && strlen(result) < job->size;
+    if (ok) {
+      strcpy(job->hashed, result);
+    }
+    metrics_add(METRIC_HASHES, 1);
+    metrics_add(METRIC_HASH_TIME_US, (long)(now_us() - started));
+
+    pthread_mutex_lock(&hash_lock);
+    job->ok = ok;
+    job->done = 1;
+    pthread_cond_broadcast(&hash_done);
+  }
+
+  return NULL;
+}
+
+int hash_pool_start(void)
+{
+  for (int i = 0; i < config.hash_threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, hash_main, NULL) != 0) {
+      fprintf(stderr, "ERROR: Failed to start hash thread\n");
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+
+  printf("LOG: Started %d hash threads\n", config.hash_threads);
+  return 0;
+}
+
+int hash_pool_new_setting(char *setting, size_t size)
+{
+  static const char alphabet[] =
+      "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+  unsigned char random[SALT_LENGTH];
+  if (getrandom(random, sizeof(random), 0) != sizeof(random)) {
+    fprintf(stderr, "ERROR: Failed to generate password salt\n");
+    return -1;
+  }
+
+  char salt[SALT_LENGTH + 1];
+  for (int i = 0; i < SALT_LENGTH; i++) {
+    salt[i] = alphabet[random[i] % 64];
+  }
+  salt[SALT_LENGTH] = '\0';
+
+  int length =
+      snprintf(setting, size, "$6$rounds=%d$%s$", config.hash_rounds, salt);
+  return length > 0 && (size_t)length < size ? 0 : -1;
+}
+
+int hash_pool_hash(const char *password, const char *setting, char *hashed,
+                   size_t size)
+{
+  HashJob job = {NULL, password, setting, hashed, size, 0, 0};
+
+  pthread_mutex_lock(&hash_lock);
+  if (queue_length >= config.hash_queue_capacity) {
+    pthread_mutex_unlock(&hash_lock);
+    metrics_add(METRIC_HASH_REJECTED, 1);
+    return HASH_POOL_BUSY;
+  }
+
+  if (queue_tail) {
+    queue_tail->next = &job;
+  } else {
+    queue_head = &job;
+  }
+  queue_tail = &job;
+  queue_length++;
+  metrics_add(METRIC_HASH_QUEUE_DEPTH, 1);
+  pthread_cond_signal(&hash_ready);
+
+  while (!job.done) {
+    pthread_cond_wait(&hash_done, &hash_lock);
+  }
+  pthread_mutex_unlock(&hash_lock);
+
+  return job.ok ? 0 : -1;
+}
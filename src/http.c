@@ -1,11 +1,19 @@
 #include "http.h"
+#include "config.h"
 #include "defines.h"
+#include "metrics.h"
 #include "requests.h"
+#include "session.h"
+#include "websocket.h"
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 int is_integer(const char *str)
@@ -26,48 +34,355 @@ int is_integer(const char *str)
 
 char *construct_response(StatusCode status_code, const char *body)
 {
-  const char *status_text;
+  return construct_response_with_headers(status_code, "", body);
+}
+
+static const char *get_status_text(StatusCode status_code)
+{
   switch (status_code) {
+  case SWITCHING_PROTOCOLS:
+    return "101 Switching Protocols";
   case SUCCESS:
-    status_text = "200 OK";
-    break;
+    return "200 OK";
   case EMPTY:
-    status_text = "204 No Content";
-    break;
+    return "204 No Content";
   case INTERNAL_SERVER_ERROR:
-    status_text = "500 Internal Server Error";
-    break;
+    return "500 Internal Server Error";
+  case SERVICE_UNAVAILABLE:
+    return "503 Service Unavailable";
+  case UNAUTHORIZED:
+    return "401 Unauthorized";
   case NOT_FOUND:
-    status_text = "404 Not Found";
-    break;
+    return "404 Not Found";
+  case PAYLOAD_TOO_LARGE:
+    return "413 Payload Too Large";
+  case TOO_MANY_REQUESTS:
+    return "429 Too Many Requests";
+  case REQUEST_HEADER_FIELDS_TOO_LARGE:
+    return "431 Request Header Fields Too Large";
   default:
-    status_text = "400 Bad Request";
-    break;
+    return "400 Bad Request";
   }
+}
+
+char *construct_response_with_headers(StatusCode status_code,
+                                      const char *headers, const char *body)
+{
+  const char *status_text = get_status_text(status_code);
 
   const char *header_format =
       "HTTP/1.1 %s\r\n"
       "Content-Type: application/json\r\n"
       "Access-Control-Allow-Origin: *\r\n"
       "Access-Control-Allow-Methods: GET, POST, PATCH, DELETE, OPTIONS\r\n"
-      "Access-Control-Allow-Headers: Content-Type\r\n"
+      "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
+      "Access-Control-Expose-Headers: X-Next-Cursor\r\n"
+      "%s"
       "Content-Length: %zu\r\n"
       "\r\n";
 
-  size_t header_len =
-      strlen(header_format) + strlen(status_text) + strlen(body) + 20;
+  size_t header_len = strlen(header_format) + strlen(status_text) +
+                      strlen(headers) + strlen(body) + 20;
   char *response = malloc(header_len);
   if (!response) {
     fprintf(stderr, "ERROR: Memory allocation failed.\n");
     return NULL;
   }
 
-  sprintf(response, header_format, status_text, strlen(body));
+  sprintf(response, header_format, status_text, headers, strlen(body));
   strcat(response, body);
 
   return response;
 }
 
+// Set once the current request has put a chunked response on the wire
+static _Thread_local int response_streamed;
+
+// What the current request's connection turns into once its head is sent
+static _Thread_local StreamUpgrade stream_upgrade;
+
+// Head of an event stream. It has no length: the body is every event later
+// published to topic, written by the event loop until the client leaves.
+char *construct_stream_response(const char *topic)
+{
+  free(stream_upgrade.topic);
+  stream_upgrade.topic = strdup(topic);
+  if (!stream_upgrade.topic) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    return NULL;
+  }
+
+  char *response = malloc(512);
+  if (!response) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    return NULL;
+  }
+  snprintf(response, 512,
+           "HTTP/1.1 200 OK\r\n"
+           "Content-Type: text/event-stream\r\n"
+           "Cache-Control: no-cache\r\n"
+           "Access-Control-Allow-Origin: *\r\n"
+           "X-Accel-Buffering: no\r\n"
+           "\r\n"
+           "retry: %d\n\n",
+           STREAM_RETRY_MS);
+  return response;
+}
+
+// RFC 6455 opening handshake. The 101 is the last HTTP on the connection;
+// the event loop speaks frames from then on.
+char *construct_websocket_response(const char *request, long user_id)
+{
+  char *upgrade = get_header_value(request, "Upgrade");
+  char *key = get_header_value(request, "Sec-WebSocket-Key");
+  char *version = get_header_value(request, "Sec-WebSocket-Version");
+
+  char *response = NULL;
+  if (!upgrade || strcasecmp(upgrade, "websocket") != 0 || !key ||
+      strlen(key) != 24) {
+    response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Expected a WebSocket upgrade.\"}");
+  } else if (!version || strcmp(version, "13") != 0) {
+    response = construct_response_with_headers(
+        BAD_REQUEST, "Sec-WebSocket-Version: 13\r\n",
+        "{\"error\": \"Unsupported WebSocket version.\"}");
+  } else if ((response = malloc(256))) {
+    char accept[WEBSOCKET_ACCEPT_SIZE];
+    websocket_accept_key(key, accept);
+    snprintf(response, 256,
+             "HTTP/1.1 101 Switching Protocols\r\n"
+             "Upgrade: websocket\r\n"
+             "Connection: Upgrade\r\n"
+             "Sec-WebSocket-Accept: %s\r\n"
+             "\r\n",
+             accept);
+    stream_upgrade.websocket = 1;
+    stream_upgrade.user_id = user_id;
+  } else {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+  }
+
+  free(upgrade);
+  free(key);
+  free(version);
+  return response;
+}
+
+StreamUpgrade take_stream_upgrade(void)
+{
+  StreamUpgrade upgrade = stream_upgrade;
+  stream_upgrade = (StreamUpgrade){NULL, 0, -1};
+  return upgrade;
+}
+
+// Wait for a non-blocking socket to become ready, giving up after
+// timeout_ms without progress
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int wait_socket(int socket, short events, int timeout_ms)
+{
+  struct pollfd pfd = {.fd = socket, .events = events};
+  int rc;
+  do {
+    rc = poll(&pfd, 1, timeout_ms);
+  } while (rc < 0 && errno == EINTR);
+  return rc;
+}
+
+// Send the whole buffer. A full socket buffer stalls the caller here, which
+// is what throttles a streaming producer to the client's pace; a client that
+// stops reading for longer than the write timeout is dropped.
+int send_all(int socket, const char *data, size_t length)
+{
+  while (length > 0) {
+    ssize_t sent = send(socket, data, length, 0);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        int rc = wait_socket(socket, POLLOUT, config.write_timeout_ms);
+        if (rc == 0) {
+          metrics_add(METRIC_WRITE_TIMEOUTS, 1);
+          fprintf(stderr, "ERROR: Write timed out\n");
+        }
+        if (rc <= 0) {
+          return -1;
+        }
+        continue;
+      }
+      return -1;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return 0;
+}
+
+int chunked_begin(ChunkedWriter *writer, int socket, StatusCode status_code,
+                  const char *content_type)
+{
+  response_streamed = 1;
+  writer->socket = socket;
+  writer->length = 0;
+  writer->failed = 0;
+
+  char header[512];
+  int header_len = snprintf(
+      header, sizeof(header),
+      "HTTP/1.1 %s\r\n"
+      "Content-Type: %s\r\n"
+      "Access-Control-Allow-Origin: *\r\n"
+      "Access-Control-Allow-Methods: GET, POST, PATCH, DELETE, OPTIONS\r\n"
+      "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "\r\n",
+      get_status_text(status_code), content_type);
+
+  if (send_all(socket, header, header_len) < 0) {
+    writer->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+static int chunked_flush(ChunkedWriter *writer, int last)
+{
+  if (writer->failed) {
+    return -1;
+  }
+
+  char *data = writer->buffer + CHUNK_PREFIX_SIZE;
+  char *start = data;
+  size_t total = 0;
+  if (writer->length > 0) {
+    char size_line[CHUNK_PREFIX_SIZE + 1];
+    int size_len =
+        snprintf(size_line, sizeof(size_line), "%zx\r\n", writer->length);
+    start -= size_len;
+    memcpy(start, size_line, size_len);
+    memcpy(data + writer->length, "\r\n", 2);
+    total = size_len + writer->length + 2;
+  }
+  if (last) {
+    memcpy(start + total, "0\r\n\r\n", 5);
+    total += 5;
+  }
+
+  if (total > 0 && send_all(writer->socket, start, total) < 0) {
+    writer->failed = 1;
+    return -1;
+  }
+  writer->length = 0;
+  return 0;
+}
+
+int chunked_write(ChunkedWriter *writer, const char *data, size_t length)
+{
+  while (length > 0) {
+    size_t space = CHUNK_SIZE - writer->length;
+    size_t take = length < space ? length : space;
+    memcpy(writer->buffer + CHUNK_PREFIX_SIZE + writer->length, data, take);
+    writer->length += take;
+    data += take;
+    length -= take;
+
+    if (writer->length == CHUNK_SIZE && chunked_flush(writer, 0) < 0) {
+      return -1;
+    }
+  }
+  return writer->failed ? -1 : 0;
+}
+
+int chunked_end(ChunkedWriter *writer)
+{
+  return chunked_flush(writer, 1);
+}
+
+void stream_init(ResponseStream *stream, int socket)
+{
+  stream->socket = socket;
+  stream->streaming = 0;
+  stream->buffer = NULL;
+  stream->length = 0;
+  stream->capacity = 0;
+}
+
+static int stream_start_chunked(ResponseStream *stream)
+{
+  stream->streaming = 1;
+  int rc = chunked_begin(&stream->chunked, stream->socket, SUCCESS,
+                         "application/json");
+  if (rc == 0) {
+    rc = chunked_write(&stream->chunked, stream->buffer, stream->length);
+  }
+
+  free(stream->buffer);
+  stream->buffer = NULL;
+  stream->length = 0;
+  stream->capacity = 0;
+  return rc;
+}
+
+int stream_write(ResponseStream *stream, const char *data, size_t length)
+{
+  if (stream->streaming) {
+    return chunked_write(&stream->chunked, data, length);
+  }
+
+  if (stream->length + length + 1 > stream->capacity) {
+    size_t capacity = stream->capacity ? stream->capacity * 2 : CHUNK_SIZE;
+    while (capacity < stream->length + length + 1) {
+      capacity *= 2;
+    }
+    char *buffer = realloc(stream->buffer, capacity);
+    if (!buffer) {
+      return -1;
+    }
+    stream->buffer = buffer;
+    stream->capacity = capacity;
+  }
+  memcpy(stream->buffer + stream->length, data, length);
+  stream->length += length;
+  stream->buffer[stream->length] = '\0';
+
+  if (stream->length > STREAM_THRESHOLD) {
+    return stream_start_chunked(stream);
+  }
+  return 0;
+}
+
+// A body that stayed under the threshold goes out as a normal response;
+// otherwise the last chunk is flushed and there is nothing left to send
+void stream_finish(ResponseStream *stream, char **response)
+{
+  if (stream->streaming) {
+    chunked_end(&stream->chunked);
+  } else {
+    *response = construct_response(SUCCESS, stream->buffer ? stream->buffer
+                                                           : "");
+  }
+  free(stream->buffer);
+  stream->buffer = NULL;
+}
+
+// Once chunks are on the wire the status is already sent, so the body is
+// left unterminated and the client sees a truncated transfer
+void stream_fail(ResponseStream *stream, StatusCode status_code,
+                 const char *body, char **response)
+{
+  if (!stream->streaming) {
+    *response = construct_response(status_code, body);
+  }
+  free(stream->buffer);
+  stream->buffer = NULL;
+}
+
 char *extract_path(char *request)
 {
   const char *path_start = strchr(request, ' ') + 1;
@@ -152,6 +467,34 @@ char *extract_path_base(char *path)
   return base_path;
 }
 
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Decode %XX escapes and '+' in place
+static void url_decode(char *str)
+{
+  char *out = str;
+  for (char *in = str; *in; in++) {
+    if (*in == '+') {
+      *out++ = ' ';
+    } else if (*in == '%' && hex_value(in[1]) >= 0 && hex_value(in[2]) >= 0) {
+      *out++ = (char)(hex_value(in[1]) * 16 + hex_value(in[2]));
+      in += 2;
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out = '\0';
+}
+
 QueryParams extract_query(char *path)
 {
   QueryParams result = {NULL, NULL, 0};
@@ -217,6 +560,7 @@ QueryParams extract_query(char *path)
       if (result.values[index]) {
         strncpy(result.values[index], value_start, value_length);
         result.values[index][value_length] = '\0';
+        url_decode(result.values[index]);
       }
     } else {
       result.values[index] = NULL;
@@ -246,6 +590,25 @@ void free_query_params(QueryParams *params)
   params->count = 0;
 }
 
+char *get_query_value(QueryParams *params, const char *key)
+{
+  for (size_t i = 0; i < params->count; i++) {
+    if (params->keys[i] && strcmp(params->keys[i], key) == 0) {
+      return params->values[i];
+    }
+  }
+  return NULL;
+}
+
+long get_query_long(QueryParams *params, const char *key, long fallback)
+{
+  char *value = get_query_value(params, key);
+  if (!is_integer(value)) {
+    return fallback;
+  }
+  return strtol(value, NULL, 10);
+}
+
 char *extract_path_id(char *path)
 {
   const char *id_start = strrchr(path, '/') + 1;
@@ -269,6 +632,28 @@ char *extract_path_id(char *path)
   return id;
 }
 
+// First numeric segment of a path, for routes like /reviews/game/:id/summary
+char *extract_path_inner_id(char *path)
+{
+  const char *segment = path;
+  while ((segment = strchr(segment, '/'))) {
+    segment++;
+    size_t length = strspn(segment, "0123456789");
+    if (length > 0 &&
+        (segment[length] == '/' || segment[length] == '?' ||
+         segment[length] == '\0')) {
+      char *id = malloc(length + 1);
+      if (!id) {
+        return NULL;
+      }
+      strncpy(id, segment, length);
+      id[length] = '\0';
+      return id;
+    }
+  }
+  return NULL;
+}
+
 char *extract_method(char *request)
 {
   const char *method_end = strchr(request, ' ');
@@ -293,105 +678,350 @@ char *extract_body(char *request)
   return body;
 }
 
-void handle_request(sqlite3 *db, char **err_msg, int socket)
+// Header values are matched case-insensitively, as HTTP requires. The
+// returned copy has surrounding whitespace trimmed.
+char *get_header_value(const char *request, const char *name)
 {
-  char *buffer = malloc(MAX_REQUEST_SIZE);
-  if (!buffer) {
-    perror("ERROR: Memory allocation failed");
-    close(socket);
-    return;
-  }
+  size_t name_length = strlen(name);
+  const char *line = strstr(request, "\r\n");
 
-  size_t total_bytes_read = 0;
-  ssize_t bytes_read;
-  int request_complete = 0;
-  size_t content_length = 0;
+  while (line && line[2] != '\0' && line[2] != '\r') {
+    line += 2;
+    const char *line_end = strstr(line, "\r\n");
+    if (!line_end) {
+      break;
+    }
 
-  while ((bytes_read = read(socket, buffer + total_bytes_read, CHUNK_SIZE)) >
-         0) {
-    total_bytes_read += bytes_read;
+    if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+      const char *value = line + name_length + 1;
+      while (value < line_end && (*value == ' ' || *value == '\t')) {
+        value++;
+      }
+      const char *value_end = line_end;
+      while (value_end > value &&
+             (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+      }
 
-    // Ensure we do not exceed MAX_REQUEST_SIZE
-    if (total_bytes_read >= MAX_REQUEST_SIZE) {
-      fprintf(stderr, "ERROR: Request exceeds maximum allowed size\n");
-      free(buffer);
-      close(socket);
-      return;
+      char *copy = malloc(value_end - value + 1);
+      if (copy) {
+        memcpy(copy, value, value_end - value);
+        copy[value_end - value] = '\0';
+      }
+      return copy;
     }
+    line = line_end;
+  }
+  return NULL;
+}
 
-    // Null-terminate the buffer for string processing
-    buffer[total_bytes_read] = '\0';
+void body_reader_init(BodyReader *reader, int socket, const char *prefix,
+                      size_t prefix_length, size_t content_length)
+{
+  reader->socket = socket;
+  reader->deadline_ms = now_ms() + config.upload_timeout_ms;
+  reader->failed = 0;
+  reader->start = 0;
+  reader->end = prefix_length < content_length ? prefix_length : content_length;
+  reader->remaining = content_length - reader->end;
+  memcpy(reader->window, prefix, reader->end);
+}
 
-    // Check if headers are complete (find double CRLF)
-    if (!request_complete && strstr(buffer, "\r\n\r\n") != NULL) {
-      request_complete = 1;
+// Top up the window from the socket, never past the declared body length
+static int body_fill(BodyReader *reader)
+{
+  if (reader->start > 0) {
+    memmove(reader->window, reader->window + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
 
-      // Extract Content-Length from headers if it exists
-      char *content_length_str = strstr(buffer, "Content-Length:");
-      if (content_length_str) {
-        content_length_str += strlen("Content-Length:");
-        content_length = strtol(content_length_str, NULL, 10);
-      }
+  size_t space = BODY_WINDOW_SIZE - reader->end;
+  size_t wanted = reader->remaining < space ? reader->remaining : space;
+  if (wanted == 0) {
+    return 0;
+  }
+
+  // A body still arriving at the upload deadline counts as timed out, the
+  // same as one that stops arriving
+  ssize_t bytes_read = -1;
+  uint64_t now;
+  int timed_out = 0;
+  while (!(timed_out = (now = now_ms()) >= reader->deadline_ms) &&
+         (bytes_read = read(reader->socket, reader->window + reader->end,
+                            wanted)) < 0) {
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      break;
+    }
+
+    int timeout_ms = config.body_timeout_ms;
+    if (reader->deadline_ms - now < (uint64_t)timeout_ms) {
+      timeout_ms = (int)(reader->deadline_ms - now);
+    }
+    int rc = wait_socket(reader->socket, POLLIN, timeout_ms);
+    timed_out = rc == 0;
+    if (rc <= 0) {
+      break;
     }
+  }
+  if (timed_out) {
+    metrics_add(METRIC_BODY_TIMEOUTS, 1);
+    fprintf(stderr, "ERROR: Body read timed out\n");
+    bytes_read = -1;
+  }
 
-    // Check if the full body is read (if Content-Length is specified)
-    if (request_complete && content_length > 0) {
-      char *body_start = strstr(buffer, "\r\n\r\n") + 4;
-      size_t body_bytes_read = total_bytes_read - (body_start - buffer);
+  if (bytes_read <= 0) {
+    reader->failed = 1;
+    return -1;
+  }
+  reader->end += bytes_read;
+  reader->remaining -= bytes_read;
+  return (int)bytes_read;
+}
 
-      if (body_bytes_read >= content_length) {
-        break; // Full request (headers + body) received
+// Next newline-terminated line of the body, NUL-terminated in place. The
+// pointer is valid until the next call. NULL at the end of the body, or on
+// error with reader->failed set (including a line longer than the window).
+char *body_read_line(BodyReader *reader)
+{
+  size_t scanned = 0;
+  while (1) {
+    char *line = reader->window + reader->start;
+    char *newline = memchr(line + scanned, '\n',
+                           reader->end - reader->start - scanned);
+    if (newline) {
+      *newline = '\0';
+      reader->start = newline + 1 - reader->window;
+      return line;
+    }
+    scanned = reader->end - reader->start;
+
+    if (reader->remaining == 0) {
+      if (scanned == 0) {
+        return NULL;
       }
-    } else if (request_complete) {
-      break; // No body or body length unspecified
+      // Last line without a trailing newline
+      reader->window[reader->end] = '\0';
+      reader->start = reader->end;
+      return line;
+    }
+
+    if (reader->start == 0 && reader->end == BODY_WINDOW_SIZE) {
+      fprintf(stderr, "ERROR: Body line exceeds %d bytes\n", BODY_WINDOW_SIZE);
+      reader->failed = 1;
+      return NULL;
+    }
+    if (body_fill(reader) < 0) {
+      return NULL;
     }
   }
-  // read(socket, buffer, BUFFER_SIZE);
+}
 
-  printf("Total bytes read: %zu\n", total_bytes_read);
-  printf("Request:\n%s\n\n", buffer);
+static int is_streaming_body(const char *method, const char *path_base,
+                             const char *content_type)
+{
+  return strcmp(method, "POST") == 0 && content_type &&
+         strncasecmp(content_type, "application/x-ndjson",
+                     strlen("application/x-ndjson")) == 0 &&
+         (strcmp(path_base, "/games/bulk") == 0 ||
+          strcmp(path_base, "/achievements/bulk") == 0);
+}
+
+// Validate the request line and the headers that frame the body. On success
+// the head is NUL-terminated in place and NULL is returned; otherwise the
+// returned error response should be sent before closing the connection.
+char *parse_request_head(char *buffer, RequestHead *head)
+{
+  char *header_end = strstr(buffer, "\r\n\r\n");
+  const char *request_line_end = strstr(buffer, "\r\n");
+  const char *method_end = strchr(buffer, ' ');
+  const char *path_end = method_end ? strchr(method_end + 1, ' ') : NULL;
+  if (!header_end || !path_end || path_end > request_line_end ||
+      method_end[1] != '/') {
+    return construct_response(BAD_REQUEST, "{\"error\": \"Bad Request.\"}");
+  }
+
+  head->head_length = header_end + 4 - buffer;
+  // Keep the final CRLF so every header line ends with one
+  header_end[2] = '\0';
 
+  char *method = extract_method(buffer);
   char *path = extract_path(buffer);
   char *path_base = extract_path_base(path);
+  char *content_length_str = get_header_value(buffer, "Content-Length");
+  char *content_type = get_header_value(buffer, "Content-Type");
+  char *expect = get_header_value(buffer, "Expect");
+  char *connection = get_header_value(buffer, "Connection");
+
+  char *response = NULL;
+  head->content_length = 0;
+  if (content_length_str) {
+    char *endptr;
+    head->content_length = strtoull(content_length_str, &endptr, 10);
+    if (*endptr != '\0' || endptr == content_length_str ||
+        content_length_str[0] == '-') {
+      response =
+          construct_response(BAD_REQUEST, "{\"error\": \"Bad Content-Length.\"}");
+    }
+  }
+
+  // Bulk NDJSON imports are read line by line by their handler; every
+  // other body is buffered whole and capped at MAX_REQUEST_SIZE
+  head->stream_body = is_streaming_body(method, path_base, content_type);
+  size_t max_body = head->stream_body ? MAX_STREAM_BODY_SIZE : MAX_REQUEST_SIZE;
+  if (!response && head->content_length > max_body) {
+    fprintf(stderr, "ERROR: Request body of %zu bytes exceeds %zu\n",
+            head->content_length, max_body);
+    response = construct_response(
+        PAYLOAD_TOO_LARGE, "{\"error\": \"Request body too large.\"}");
+  }
+
+  // The client holds the body back until told to continue, so a rejected
+  // upload never gets sent at all
+  head->expect_continue = expect && strcasecmp(expect, "100-continue") == 0;
+
+  // HTTP/1.1 keeps the connection open unless told otherwise; 1.0 only
+  // when asked
+  int http_10 = strncmp(path_end + 1, "HTTP/1.0", strlen("HTTP/1.0")) == 0;
+  if (connection) {
+    head->keep_alive = http_10 ? strcasecmp(connection, "keep-alive") == 0
+                               : strcasecmp(connection, "close") != 0;
+  } else {
+    head->keep_alive = !http_10;
+  }
+
+  free(connection);
+  free(expect);
+  free(content_type);
+  free(content_length_str);
+  free(path_base);
+  free(path);
+  free(method);
+  return response;
+}
+
+// The token from an "Authorization: Bearer" header, or NULL
+static char *get_bearer_token(const char *request)
+{
+  char *authorization = get_header_value(request, "Authorization");
+  if (!authorization) {
+    return NULL;
+  }
+
+  char *token = NULL;
+  if (strncasecmp(authorization, "Bearer ", 7) == 0) {
+    token = strdup(authorization + 7);
+  }
+  free(authorization);
+  return token;
+}
+
+static int is_me_route(const char *path_base)
+{
+  return strcmp(path_base, "/me") == 0 || strncmp(path_base, "/me/", 4) == 0;
+}
+
+char *handle_request(sqlite3 *db, char **err_msg, int socket, char *head,
+                     char *body, BodyReader *reader)
+{
+  char *path = extract_path(head);
+  char *path_base = extract_path_base(path);
   char *path_id = extract_path_id(path);
   QueryParams query = extract_query(path);
-  char *method = extract_method(buffer);
-  char *body = extract_body(buffer);
+  char *method = extract_method(head);
+  char *token = get_bearer_token(head);
+  long user_id = -1;
 
-  printf("Path        : %s\n", path);
-  printf("Path base   : %s\n", path_base);
-  printf("Path id     : %s\n", path_id);
-  printf("Method      : %s\n", method);
-  printf("Query params:\n");
-  for (size_t i = 0; i < query.count; i++) {
-    printf("%zu: %s=%s\n", i, query.keys[i], query.values[i]);
-  }
-  printf("\n");
+  // Streaming handlers write to the socket themselves and leave this NULL
+  char *response = NULL;
+  response_streamed = 0;
+  free(take_stream_upgrade().topic);
 
-  char *response;
+  // Headers and the query string can carry session tokens, so only the
+  // method and route are logged
+  printf("LOG: %s %s\n", method, path_base);
 
   if (strcmp(method, "OPTIONS") == 0) {
     const char *options_response =
         "HTTP/1.1 204 No Content\r\n"
         "Access-Control-Allow-Origin: *\r\n"
         "Access-Control-Allow-Methods: GET, POST, PATCH, DELETE, OPTIONS\r\n"
-        "Access-Control-Allow-Headers: Content-Type\r\n"
+        "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
         "Content-Length: 0\r\n"
         "\r\n";
 
-    send(socket, options_response, strlen(options_response), 0);
-    printf("Preflight OPTIONS response sent.\n");
+    response = strdup(options_response);
+    printf("Preflight OPTIONS response built.\n");
   } else {
-    if (strcmp(path_base, "/games") == 0) {
+    if (is_me_route(path_base) &&
+        (user_id = token ? session_verify(token) : -1) < 0) {
+      // /me routes act on whoever the session token belongs to
+      response = construct_response(
+          UNAUTHORIZED, "{\"error\": \"Missing or invalid session token.\"}");
+    } else if (strcmp(path_base, "/ws") == 0 && strcmp(method, "GET") == 0) {
+      // GET /ws. Browsers cannot set headers on a WebSocket, so the token
+      // may also come as ?token=; without one the socket is anonymous.
+      char *ws_token = token ? token : get_query_value(&query, "token");
+      if (ws_token && (user_id = session_verify(ws_token)) < 0) {
+        response = construct_response(
+            UNAUTHORIZED, "{\"error\": \"Invalid session token.\"}");
+      } else {
+        response = construct_websocket_response(head, user_id);
+      }
+    } else if (strcmp(path_base, "/metrics") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /metrics
+      request_get_metrics(&response);
+    } else if (strcmp(path_base, "/games/search") == 0 &&
+        strcmp(method, "GET") == 0) {
+      // GET /games/search
+      request_search_games(db, &query, &response);
+    } else if (strcmp(path_base, "/games/autocomplete") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /games/autocomplete
+      request_get_autocomplete(&query, &response);
+    } else if (strcmp(path_base, "/games/facets") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /games/facets
+      request_get_facets(&query, &response);
+    } else if (strcmp(path_base, "/games/similar") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /games/:id/similar
+      char *game_id = extract_path_inner_id(path);
+      if (game_id) {
+        request_get_similar_games(game_id, &query, &response);
+        free(game_id);
+      }
+    } else if (strcmp(path_base, "/leaderboard") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /leaderboard?limit=&game_id=
+      request_get_leaderboard(&query, &response);
+    } else if (strncmp(path_base, "/export/", strlen("/export/")) == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /export/:table
+      request_get_export(db, path_id, &response, socket);
+    } else if (strcmp(path_base, "/games/bulk") == 0 &&
+               strcmp(method, "POST") == 0) {
+      // POST /games/bulk
+      request_post_games_bulk(db, body, reader, &response, socket);
+    } else if (strcmp(path_base, "/games") == 0) {
       if (strcmp(method, "GET") == 0 && is_integer(path_id)) {
         // GET /games/:id
         request_get_game_by_id(db, path_id, &response, err_msg);
+      } else if (strcmp(method, "GET") == 0 &&
+                 get_query_value(&query, "ids")) {
+        // GET /games?ids=1,2,3
+        request_get_games_by_ids(db, &query, &response);
       } else if (strcmp(method, "GET") == 0) {
         // GET /games
-        request_get_games(db, &query, &response, err_msg);
+        request_get_games(db, &query, &response, socket);
       } else if (strcmp(method, "POST") == 0) {
         // POST /games
-        request_post_game(db, body, &response, err_msg, socket);
+        request_post_game(db, body, &response, err_msg);
       } else if (strcmp(method, "DELETE") == 0 && is_integer(path_id)) {
         // DELETE /games/:id
         request_delete_game_by_id(db, path_id, &response, err_msg);
@@ -402,37 +1032,57 @@ void handle_request(sqlite3 *db, char **err_msg, int socket)
     } else if (strcmp(path_base, "/register") == 0 &&
                strcmp(method, "POST") == 0) {
       // POST /register
-      request_post_register(db, body, &response, err_msg, socket);
+      request_post_register(db, body, &response, err_msg);
     } else if (strcmp(path_base, "/login") == 0 &&
                strcmp(method, "POST") == 0) {
       // POST /login
-      request_post_login(db, body, &response, err_msg, socket);
+      request_post_login(db, body, &response);
+    } else if (strcmp(path_base, "/logout") == 0 &&
+               strcmp(method, "POST") == 0) {
+      // POST /logout
+      request_post_logout(token, &response);
+    } else if (strcmp(path_base, "/reviews/game/summary") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /reviews/game/:id/summary
+      char *game_id = extract_path_inner_id(path);
+      if (game_id) {
+        request_get_review_summary(db, game_id, &response);
+        free(game_id);
+      }
     } else if (strcmp(path_base, "/reviews/game") == 0) {
       if (strcmp(method, "GET") == 0 && is_integer(path_id)) {
         // GET /reviews/game/:id
-        request_get_reviews_by_game_id(db, path_id, &response, err_msg);
+        request_get_reviews_by_game_id(db, path_id, &query, &response);
       } else if (strcmp(method, "POST") == 0 && is_integer(path_id)) {
         // POST /reviews/game/:id
-        request_post_review(db, path_id, body, &response, err_msg, socket);
+        request_post_review(db, path_id, body, &response, err_msg);
       }
     } else if (strcmp(path_base, "/me/games") == 0) {
-      if (strcmp(method, "GET") == 0 && query.count > 0) {
+      if (strcmp(method, "GET") == 0) {
         // GET /me/games
-        request_get_my_games(db, &query, &response, err_msg, socket);
+        request_get_my_games(db, user_id, &response, socket);
       } else if (strcmp(method, "POST") == 0) {
         // POST /me/games
-        request_post_my_game(db, body, &response, err_msg, socket);
+        request_post_my_game(db, user_id, body, &response, err_msg);
       } else if (strcmp(method, "DELETE") == 0 && is_integer(path_id)) {
         // DELETE /me/games/:id
-        request_delete_my_game(db, path_id, &query, &response, err_msg, socket);
+        request_delete_my_game(db, path_id, user_id, &response, err_msg);
       }
+    } else if (strcmp(path_base, "/achievements/bulk") == 0 &&
+               strcmp(method, "POST") == 0) {
+      // POST /achievements/bulk
+      request_post_achievements_bulk(db, body, reader, &response, socket);
     } else if (strcmp(path_base, "/achievements") == 0) {
       if (strcmp(method, "GET") == 0 && is_integer(path_id)) {
         // GET /achievements/:id
         request_get_achievement_by_id(db, path_id, &response, err_msg);
+      } else if (strcmp(method, "GET") == 0 &&
+                 get_query_value(&query, "ids")) {
+        // GET /achievements?ids=1,2,3
+        request_get_achievements_by_ids(db, &query, &response);
       } else if (strcmp(method, "POST") == 0) {
         // POST /achievements
-        request_post_achievement(db, body, &response, err_msg, socket);
+        request_post_achievement(db, body, &response, err_msg);
       } else if (strcmp(method, "PATCH") == 0 && is_integer(path_id)) {
         // PATCH /achievements/:id
         request_patch_achievement_by_id(db, path_id, body, &response, err_msg);
@@ -443,37 +1093,62 @@ void handle_request(sqlite3 *db, char **err_msg, int socket)
     } else if (strcmp(path_base, "/achievements/game") == 0) {
       if (strcmp(method, "GET") == 0 && is_integer(path_id)) {
         // GET /achievements/game/:id
-        request_get_achievements_by_game_id(db, path_id, &response, err_msg);
+        request_get_achievements_by_game_id(db, path_id, &response, socket);
       }
     } else if (strcmp(path_base, "/me") == 0) {
       if (strcmp(method, "PATCH") == 0) {
         // PATCH /me
-        request_patch_user(db, &query, body, &response, err_msg, socket);
+        request_patch_user(db, user_id, body, &response, err_msg);
       }
     } else if (strcmp(path_base, "/me/achievements") == 0) {
       if (strcmp(method, "GET") == 0 && is_integer(path_id)) {
         // GET /me/achievements/:id
-        request_get_user_achievements_by_game_id(db, path_id, &query, &response,
-                                                 err_msg, socket);
+        request_get_user_achievements_by_game_id(db, path_id, user_id,
+                                                 &response, err_msg);
       } else if (strcmp(method, "GET") == 0) {
         // GET /me/achievements
-        request_get_user_achievements(db, &query, &response, err_msg, socket);
+        request_get_user_achievements(db, user_id, &response, socket);
       } else if (strcmp(method, "POST") == 0) {
         // POST /me/achievements
-        request_post_user_achievement(db, body, &response, err_msg, socket);
+        request_post_user_achievement(db, user_id, body, &response, err_msg);
       }
+    } else if (strcmp(path_base, "/me/achievements/stream") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /me/achievements/stream
+      request_get_achievement_stream(user_id, &response);
+    } else if (strcmp(path_base, "/me/recommendations") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /me/recommendations
+      request_get_recommendations(db, user_id, &query, &response);
+    } else if (strcmp(path_base, "/me/achievements/summary") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /me/achievements/summary
+      request_get_achievement_summary(db, user_id, &response);
     } else if (strcmp(path_base, "/me/posted-games") == 0) {
       if (strcmp(method, "GET") == 0) {
         // GET /me/posted-games
-        request_get_my_posted_games(db, &query, &response, err_msg, socket);
+        request_get_my_posted_games(db, user_id, &response, err_msg);
       }
+    } else if (strcmp(path_base, "/me/rank") == 0 &&
+               strcmp(method, "GET") == 0) {
+      // GET /me/rank?game_id=
+      request_get_my_rank(user_id, &query, &response);
     } else {
       printf("404 Not Found\n");
       response = construct_response(NOT_FOUND, "{\"error\": \"Not Found.\"}");
     }
+  }
 
-    free_query_params(&query);
-    send(socket, response, strlen(response), 0);
-    printf("Response sent.\n");
+  // A route that matched but had no handler for the method
+  if (!response && !response_streamed) {
+    response = construct_response(NOT_FOUND, "{\"error\": \"Not Found.\"}");
   }
+
+  free_query_params(&query);
+  free(token);
+  free(method);
+  free(path_id);
+  free(path_base);
+  free(path);
+  return response;
 }
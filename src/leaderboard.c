@@ -0,0 +1,648 @@
+#include "leaderboard.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEVEL 32
+
+// Each forward link also records its span: how many level-0 steps it
+// covers. Summing spans along a search path gives a node's rank.
+typedef struct RankNode {
+  long user_id;
+  long score;
+  long unlocked;
+  int level;
+  struct {
+    struct RankNode *next;
+    size_t span;
+  } links[];
+} RankNode;
+
+// Open-addressing map from id to pointer; entries are never removed
+typedef struct {
+  long *keys;
+  void **values;
+  size_t count;
+  size_t capacity;
+} IdMap;
+
+// A game's board also carries the totals its players' progress is measured
+// against
+typedef struct {
+  RankNode *head;
+  int level;
+  size_t length;
+  IdMap users;
+  long achievements;
+  long achievement_points;
+} Board;
+
+static Board global_board;
+static IdMap game_boards;
+static pthread_rwlock_t leaderboard_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t random_state = 0x2545F4914F6CDD1DULL;
+
+static size_t slot_of(long key, size_t capacity)
+{
+  return ((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 32 & (capacity - 1);
+}
+
+static void *id_map_get(const IdMap *map, long key)
+{
+  if (map->capacity == 0) {
+    return NULL;
+  }
+  for (size_t i = slot_of(key, map->capacity);; i = (i + 1) & (map->capacity - 1)) {
+    if (!map->values[i]) {
+      return NULL;
+    }
+    if (map->keys[i] == key) {
+      return map->values[i];
+    }
+  }
+}
+
+static int id_map_put(IdMap *map, long key, void *value)
+{
+  // Keep the load factor under one half so probes stay short
+  if ((map->count + 1) * 2 > map->capacity) {
+    size_t capacity = map->capacity ? map->capacity * 2 : 16;
+    long *keys = malloc(capacity * sizeof(*keys));
+    void **values = calloc(capacity, sizeof(*values));
+    if (!keys || !values) {
+      free(keys);
+      free(values);
+      return -1;
+    }
+    for (size_t i = 0; i < map->capacity; i++) {
+      if (map->values[i]) {
+        size_t j = slot_of(map->keys[i], capacity);
+        while (values[j]) {
+          j = (j + 1) & (capacity - 1);
+        }
+        keys[j] = map->keys[i];
+        values[j] = map->values[i];
+      }
+    }
+    free(map->keys);
+    free(map->values);
+    map->keys = keys;
+    map->values = values;
+    map->capacity = capacity;
+  }
+
+  size_t i = slot_of(key, map->capacity);
+  while (map->values[i] && map->keys[i] != key) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  if (!map->values[i]) {
+    map->count++;
+  }
+  map->keys[i] = key;
+  map->values[i] = value;
+  return 0;
+}
+
+static void id_map_free(IdMap *map)
+{
+  free(map->keys);
+  free(map->values);
+  memset(map, 0, sizeof(*map));
+}
+
+static RankNode *create_node(int level, long user_id, long score)
+{
+  RankNode *node =
+      malloc(sizeof(*node) + level * sizeof(node->links[0]));
+  if (!node) {
+    return NULL;
+  }
+  node->user_id = user_id;
+  node->score = score;
+  node->unlocked = 0;
+  node->level = level;
+  for (int i = 0; i < level; i++) {
+    node->links[i].next = NULL;
+    node->links[i].span = 0;
+  }
+  return node;
+}
+
+static int board_init(Board *board)
+{
+  memset(board, 0, sizeof(*board));
+  board->head = create_node(MAX_LEVEL, 0, 0);
+  board->level = 1;
+  return board->head ? 0 : -1;
+}
+
+static void board_free(Board *board)
+{
+  RankNode *node = board->head;
+  while (node) {
+    RankNode *next = node->links[0].next;
+    free(node);
+    node = next;
+  }
+  id_map_free(&board->users);
+}
+
+// Higher scores rank first; ties go to the lower user_id
+static int ranks_before(const RankNode *node, long score, long user_id)
+{
+  return node->score > score ||
+         (node->score == score && node->user_id < user_id);
+}
+
+static int random_level(void)
+{
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+
+  // Each level is kept with probability 1/4
+  int level = 1;
+  uint64_t bits = random_state;
+  while (level < MAX_LEVEL && (bits & 3) == 0) {
+    level++;
+    bits >>= 2;
+  }
+  return level;
+}
+
+static void unlink_node(Board *board, RankNode *node)
+{
+  RankNode *update[MAX_LEVEL];
+  RankNode *x = board->head;
+  for (int i = board->level - 1; i >= 0; i--) {
+    while (x->links[i].next &&
+           ranks_before(x->links[i].next, node->score, node->user_id)) {
+      x = x->links[i].next;
+    }
+    update[i] = x;
+  }
+
+  for (int i = 0; i < board->level; i++) {
+    if (update[i]->links[i].next == node) {
+      update[i]->links[i].span += node->links[i].span - 1;
+      update[i]->links[i].next = node->links[i].next;
+    } else {
+      update[i]->links[i].span--;
+    }
+  }
+  while (board->level > 1 && !board->head->links[board->level - 1].next) {
+    board->level--;
+  }
+  board->length--;
+}
+
+static void link_node(Board *board, RankNode *node)
+{
+  RankNode *update[MAX_LEVEL];
+  size_t rank[MAX_LEVEL];
+  RankNode *x = board->head;
+  for (int i = board->level - 1; i >= 0; i--) {
+    rank[i] = i == board->level - 1 ? 0 : rank[i + 1];
+    while (x->links[i].next &&
+           ranks_before(x->links[i].next, node->score, node->user_id)) {
+      rank[i] += x->links[i].span;
+      x = x->links[i].next;
+    }
+    update[i] = x;
+  }
+
+  if (node->level > board->level) {
+    for (int i = board->level; i < node->level; i++) {
+      rank[i] = 0;
+      update[i] = board->head;
+      update[i]->links[i].span = board->length;
+    }
+    board->level = node->level;
+  }
+
+  for (int i = 0; i < node->level; i++) {
+    node->links[i].next = update[i]->links[i].next;
+    update[i]->links[i].next = node;
+    node->links[i].span = update[i]->links[i].span - (rank[0] - rank[i]);
+    update[i]->links[i].span = rank[0] - rank[i] + 1;
+  }
+  for (int i = node->level; i < board->level; i++) {
+    update[i]->links[i].span++;
+  }
+  board->length++;
+}
+
+static void board_add(Board *board, long user_id, long points, long unlocked)
+{
+  RankNode *node = id_map_get(&board->users, user_id);
+  if (node) {
+    node->unlocked += unlocked;
+    if (points != 0) {
+      unlink_node(board, node);
+      node->score += points;
+      link_node(board, node);
+    }
+    return;
+  }
+
+  node = create_node(random_level(), user_id, points);
+  if (!node || id_map_put(&board->users, user_id, node) < 0) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    free(node);
+    return;
+  }
+  node->unlocked = unlocked;
+  link_node(board, node);
+}
+
+// 1-based position of a node on its board
+static size_t board_rank(const Board *board, const RankNode *node)
+{
+  size_t rank = 0;
+  const RankNode *x = board->head;
+  for (int i = board->level - 1; i >= 0; i--) {
+    while (x->links[i].next &&
+           (x->links[i].next == node ||
+            ranks_before(x->links[i].next, node->score, node->user_id))) {
+      rank += x->links[i].span;
+      x = x->links[i].next;
+    }
+    if (x == node) {
+      return rank;
+    }
+  }
+  return 0;
+}
+
+static Board *find_board(long game_id)
+{
+  return game_id < 0 ? &global_board : id_map_get(&game_boards, game_id);
+}
+
+static Board *get_game_board(long game_id)
+{
+  Board *board = id_map_get(&game_boards, game_id);
+  if (board) {
+    return board;
+  }
+
+  board = malloc(sizeof(*board));
+  if (!board || board_init(board) < 0 ||
+      id_map_put(&game_boards, game_id, board) < 0) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    if (board) {
+      free(board->head);
+    }
+    free(board);
+    return NULL;
+  }
+  return board;
+}
+
+static void add_points(long user_id, long game_id, long points, long unlocked)
+{
+  Board *board = get_game_board(game_id);
+  if (board) {
+    board_add(board, user_id, points, unlocked);
+  }
+  board_add(&global_board, user_id, points, unlocked);
+}
+
+static int delta_add(LeaderboardDelta *delta, long user_id, long game_id,
+                     long points, long count)
+{
+  if (delta->count == delta->capacity) {
+    size_t capacity = delta->capacity ? delta->capacity * 2 : 16;
+    LeaderboardChange *changes =
+        realloc(delta->changes, capacity * sizeof(*changes));
+    if (!changes) {
+      fprintf(stderr, "ERROR: Memory allocation failed.\n");
+      return -1;
+    }
+    delta->changes = changes;
+    delta->capacity = capacity;
+  }
+  delta->changes[delta->count++] =
+      (LeaderboardChange){user_id, game_id, points, count};
+  return 0;
+}
+
+int leaderboard_collect_unlock(sqlite3 *db, long user_id, long achievement_id,
+                               LeaderboardDelta *delta)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db,
+                         "SELECT game_id, points FROM Achievements "
+                         "WHERE achievement_id = ?1;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to load achievement: %s\n",
+            sqlite3_errmsg(db));
+    return -1;
+  }
+  sqlite3_bind_int64(stmt, 1, achievement_id);
+
+  int rc = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    rc = delta_add(delta, user_id, sqlite3_column_int64(stmt, 0),
+                   sqlite3_column_int64(stmt, 1), 1);
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+int leaderboard_collect_achievement(sqlite3 *db, long achievement_id, int sign,
+                                    LeaderboardDelta *delta)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db,
+                         "SELECT game_id, points FROM Achievements "
+                         "WHERE achievement_id = ?1;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to load achievement: %s\n",
+            sqlite3_errmsg(db));
+    return -1;
+  }
+  sqlite3_bind_int64(stmt, 1, achievement_id);
+
+  int rc = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    rc = delta_add(delta, 0, sqlite3_column_int64(stmt, 0),
+                   sign * sqlite3_column_int64(stmt, 1), sign);
+  }
+  sqlite3_finalize(stmt);
+  if (rc < 0) {
+    return -1;
+  }
+
+  if (sqlite3_prepare_v2(
+          db,
+          "SELECT User_Achievements.user_id, Achievements.game_id, "
+          "Achievements.points FROM User_Achievements "
+          "INNER JOIN Achievements ON Achievements.achievement_id = "
+          "User_Achievements.achievement_id "
+          "WHERE User_Achievements.achievement_id = ?1;",
+          -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to load achievement unlocks: %s\n",
+            sqlite3_errmsg(db));
+    return -1;
+  }
+  sqlite3_bind_int64(stmt, 1, achievement_id);
+
+  while (rc == 0 && sqlite3_step(stmt) == SQLITE_ROW) {
+    rc = delta_add(delta, sqlite3_column_int64(stmt, 0),
+                   sqlite3_column_int64(stmt, 1),
+                   sign * sqlite3_column_int64(stmt, 2), sign);
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+void leaderboard_apply(LeaderboardDelta *delta)
+{
+  pthread_rwlock_wrlock(&leaderboard_lock);
+  for (size_t i = 0; i < delta->count; i++) {
+    const LeaderboardChange *change = &delta->changes[i];
+    if (change->user_id == 0) {
+      Board *board = get_game_board(change->game_id);
+      if (board) {
+        board->achievements += change->count;
+        board->achievement_points += change->points;
+      }
+    } else {
+      add_points(change->user_id, change->game_id, change->points,
+                 change->count);
+    }
+  }
+  pthread_rwlock_unlock(&leaderboard_lock);
+  leaderboard_discard(delta);
+}
+
+void leaderboard_discard(LeaderboardDelta *delta)
+{
+  free(delta->changes);
+  memset(delta, 0, sizeof(*delta));
+}
+
+void leaderboard_unlock(sqlite3 *db, long user_id, long achievement_id)
+{
+  LeaderboardDelta delta = {0};
+  if (leaderboard_collect_unlock(db, user_id, achievement_id, &delta) < 0) {
+    leaderboard_discard(&delta);
+    return;
+  }
+  leaderboard_apply(&delta);
+}
+
+void leaderboard_apply_achievement(sqlite3 *db, long achievement_id, int sign)
+{
+  LeaderboardDelta delta = {0};
+  if (leaderboard_collect_achievement(db, achievement_id, sign, &delta) < 0) {
+    leaderboard_discard(&delta);
+    return;
+  }
+  leaderboard_apply(&delta);
+}
+
+static void free_boards(void)
+{
+  for (size_t i = 0; i < game_boards.capacity; i++) {
+    if (game_boards.values[i]) {
+      board_free(game_boards.values[i]);
+      free(game_boards.values[i]);
+    }
+  }
+  id_map_free(&game_boards);
+  board_free(&global_board);
+  memset(&global_board, 0, sizeof(global_board));
+}
+
+void leaderboard_free(void)
+{
+  pthread_rwlock_wrlock(&leaderboard_lock);
+  free_boards();
+  pthread_rwlock_unlock(&leaderboard_lock);
+}
+
+// Per-game achievement counts and point totals
+static void load_game_totals(sqlite3 *db)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db,
+                         "SELECT game_id, COUNT(*), SUM(points) "
+                         "FROM Achievements GROUP BY game_id;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to load achievement totals: %s\n",
+            sqlite3_errmsg(db));
+    return;
+  }
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    Board *board = get_game_board(sqlite3_column_int64(stmt, 0));
+    if (board) {
+      board->achievements = sqlite3_column_int64(stmt, 1);
+      board->achievement_points = sqlite3_column_int64(stmt, 2);
+    }
+  }
+  sqlite3_finalize(stmt);
+}
+
+void leaderboard_build(sqlite3 *db)
+{
+  const char *select_sql =
+      "SELECT User_Achievements.user_id, Achievements.game_id, "
+      "SUM(Achievements.points), COUNT(*) FROM User_Achievements "
+      "INNER JOIN Achievements ON Achievements.achievement_id = "
+      "User_Achievements.achievement_id "
+      "GROUP BY User_Achievements.user_id, Achievements.game_id;";
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to build leaderboard: %s\n",
+            sqlite3_errmsg(db));
+    return;
+  }
+
+  pthread_rwlock_wrlock(&leaderboard_lock);
+  free_boards();
+  if (board_init(&global_board) < 0) {
+    pthread_rwlock_unlock(&leaderboard_lock);
+    sqlite3_finalize(stmt);
+    return;
+  }
+  load_game_totals(db);
+
+  // Rows arrive grouped by user, so each user's total goes into the global
+  // board once instead of once per game
+  long rows = 0, user_id = -1, total = 0, total_unlocked = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    long row_user = sqlite3_column_int64(stmt, 0);
+    long points = sqlite3_column_int64(stmt, 2);
+    long unlocked = sqlite3_column_int64(stmt, 3);
+    if (row_user != user_id) {
+      if (user_id >= 0) {
+        board_add(&global_board, user_id, total, total_unlocked);
+      }
+      user_id = row_user;
+      total = 0;
+      total_unlocked = 0;
+    }
+    Board *board = get_game_board(sqlite3_column_int64(stmt, 1));
+    if (board) {
+      board_add(board, row_user, points, unlocked);
+    }
+    total += points;
+    total_unlocked += unlocked;
+    rows++;
+  }
+  if (user_id >= 0) {
+    board_add(&global_board, user_id, total, total_unlocked);
+  }
+  size_t players = global_board.length, games = game_boards.count;
+  pthread_rwlock_unlock(&leaderboard_lock);
+  sqlite3_finalize(stmt);
+
+  printf("LOG: Leaderboard built with %zu players over %zu games (%ld rows).\n",
+         players, games, rows);
+}
+
+static void add_entry(cJSON *json_array, const RankNode *node, size_t rank)
+{
+  cJSON *json_row = cJSON_CreateObject();
+  if (!json_row) {
+    return;
+  }
+  cJSON_AddNumberToObject(json_row, "rank", (double)rank);
+  cJSON_AddNumberToObject(json_row, "user_id", (double)node->user_id);
+  cJSON_AddNumberToObject(json_row, "points", (double)node->score);
+  cJSON_AddItemToArray(json_array, json_row);
+}
+
+cJSON *leaderboard_top(long game_id, size_t limit)
+{
+  cJSON *json = cJSON_CreateObject();
+  cJSON *json_array = cJSON_CreateArray();
+  if (!json || !json_array) {
+    cJSON_Delete(json);
+    cJSON_Delete(json_array);
+    return NULL;
+  }
+
+  pthread_rwlock_rdlock(&leaderboard_lock);
+  const Board *board = find_board(game_id);
+  size_t total = board ? board->length : 0;
+  if (board) {
+    const RankNode *node = board->head->links[0].next;
+    for (size_t rank = 1; node && rank <= limit; rank++) {
+      add_entry(json_array, node, rank);
+      node = node->links[0].next;
+    }
+  }
+  pthread_rwlock_unlock(&leaderboard_lock);
+
+  cJSON_AddNumberToObject(json, "total", (double)total);
+  cJSON_AddItemToObject(json, "entries", json_array);
+  return json;
+}
+
+cJSON *leaderboard_rank(long game_id, long user_id)
+{
+  pthread_rwlock_rdlock(&leaderboard_lock);
+  const Board *board = find_board(game_id);
+  const RankNode *node = board ? id_map_get(&board->users, user_id) : NULL;
+  cJSON *json = NULL;
+  if (node) {
+    json = cJSON_CreateObject();
+    if (json) {
+      cJSON_AddNumberToObject(json, "user_id", (double)user_id);
+      cJSON_AddNumberToObject(json, "rank", (double)board_rank(board, node));
+      cJSON_AddNumberToObject(json, "points", (double)node->score);
+      cJSON_AddNumberToObject(json, "total", (double)board->length);
+    }
+  }
+  pthread_rwlock_unlock(&leaderboard_lock);
+
+  return json;
+}
+
+typedef struct {
+  long user_id;
+  cJSON *json_array;
+} SummaryContext;
+
+static void add_game_summary(uint32_t game_id, void *data)
+{
+  SummaryContext *context = data;
+  const Board *board = id_map_get(&game_boards, game_id);
+  const RankNode *node =
+      board ? id_map_get(&board->users, context->user_id) : NULL;
+
+  cJSON *json_row = cJSON_CreateObject();
+  if (!json_row) {
+    return;
+  }
+  cJSON_AddNumberToObject(json_row, "game_id", game_id);
+  cJSON_AddNumberToObject(json_row, "unlocked",
+                          node ? (double)node->unlocked : 0);
+  cJSON_AddNumberToObject(json_row, "achievements",
+                          board ? (double)board->achievements : 0);
+  cJSON_AddNumberToObject(json_row, "points", node ? (double)node->score : 0);
+  cJSON_AddNumberToObject(json_row, "total_points",
+                          board ? (double)board->achievement_points : 0);
+  cJSON_AddItemToArray(context->json_array, json_row);
+}
+
+cJSON *leaderboard_summary(long user_id, const Bitmap *owned)
+{
+  SummaryContext context = {user_id, cJSON_CreateArray()};
+  if (!context.json_array) {
+    return NULL;
+  }
+
+  pthread_rwlock_rdlock(&leaderboard_lock);
+  bitmap_for_each(owned, add_game_summary, &context);
+  pthread_rwlock_unlock(&leaderboard_lock);
+
+  return context.json_array;
+}
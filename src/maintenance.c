@@ -0,0 +1,239 @@
+#include "maintenance.h"
+#include "config.h"
+#include "defines.h"
+#include "facets.h"
+#include "metrics.h"
+#include "ownership.h"
+#include "recommend.h"
+#include "scheduler.h"
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static int exec_task(sqlite3 *db, const char *sql, const char *description)
+{
+  char *err_msg = NULL;
+  if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: %s failed: %s\n", description, err_msg);
+    sqlite3_free(err_msg);
+    return -1;
+  }
+  return 0;
+}
+
+// Load the libraries of the most recent buyers into the ownership cache,
+// so the first catalog pages after a restart do not each go to the
+// database for them. A buyer seen twice is a cache hit the second time.
+// Not a snapshot task: a purchase committed after the snapshot was taken
+// would be missing from what it caches.
+static int warm_ownership(sqlite3 *db)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db,
+                         "SELECT user_id FROM Libraries "
+                         "ORDER BY library_id DESC LIMIT ?1;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to find recent buyers: %s\n",
+            sqlite3_errmsg(db));
+    return -1;
+  }
+  sqlite3_bind_int(stmt, 1, OWNERSHIP_WARM_PURCHASES);
+
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && !scheduler_over_budget()) {
+    Bitmap owned;
+    if (ownership_get(db, sqlite3_column_int64(stmt, 0), &owned) == 0) {
+      bitmap_free(&owned);
+    }
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? 0 : -1;
+}
+
+// analysis_limit makes ANALYZE sample each index instead of reading all of
+// it, so the write lock it takes is held for milliseconds
+static int analyze(sqlite3 *db, const char *pragma)
+{
+  char sql[96];
+  snprintf(sql, sizeof(sql), "PRAGMA analysis_limit = %d; %s",
+           ANALYSIS_LIMIT, pragma);
+  return exec_task(db, sql, pragma);
+}
+
+// Statistics for tables that have never been analyzed
+static int analyze_new_tables(sqlite3 *db)
+{
+  return analyze(db, "PRAGMA optimize = 0x10002;");
+}
+
+// Statistics for tables that have grown since they were last analyzed
+static int optimize(sqlite3 *db)
+{
+  return analyze(db, "PRAGMA optimize;");
+}
+
+// The search index takes every write as a new segment and leaves merging
+// them to this task. Each merge step is its own short transaction; a step
+// that changes fewer than two rows means nothing is left to merge.
+static int merge_search(sqlite3 *db)
+{
+  char sql[128];
+  snprintf(sql, sizeof(sql),
+           "INSERT INTO Games_Search(Games_Search, rank) "
+           "VALUES ('merge', %d);",
+           SEARCH_MERGE_PAGES);
+
+  do {
+    int changes = sqlite3_total_changes(db);
+    if (exec_task(db, sql, "Search index merge") < 0) {
+      return -1;
+    }
+    if (sqlite3_total_changes(db) - changes < 2) {
+      break;
+    }
+  } while (!scheduler_over_budget());
+  return 0;
+}
+
+// Facets are kept current by the game handlers; a periodic rebuild puts
+// back anything changed behind their backs. facets_build scans into a new
+// index and swaps it in, so requests keep the old one meanwhile. The scan
+// cannot stop part way; its budget instead stretches the interval when a
+// rebuild runs long.
+static int rebuild_facets(sqlite3 *db)
+{
+  facets_build(db);
+  return 0;
+}
+
+// 0 when done, 1 when readers or a writer kept it from finishing.
+// log_frames is set to the size of the log in frames.
+static int checkpoint(sqlite3 *db, int mode, int *log_frames)
+{
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int checkpointed;
+  int rc = sqlite3_wal_checkpoint_v2(db, NULL, mode, log_frames, &checkpointed);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  long elapsed_us = (end.tv_sec - start.tv_sec) * 1000000L +
+                    (end.tv_nsec - start.tv_nsec) / 1000;
+  metrics_add(METRIC_CHECKPOINTS, 1);
+  metrics_add(METRIC_CHECKPOINT_TIME_US, elapsed_us);
+  metrics_set(METRIC_CHECKPOINT_LAST_US, elapsed_us);
+
+  if (rc == SQLITE_BUSY) {
+    metrics_add(METRIC_CHECKPOINTS_BUSY, 1);
+    return 1;
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "ERROR: WAL checkpoint failed: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  if (*log_frames >= 0) {
+    metrics_set(METRIC_WAL_FRAMES, *log_frames);
+  }
+  return 0;
+}
+
+static long wal_size(sqlite3 *db)
+{
+  struct stat st;
+  const char *path = sqlite3_filename_wal(sqlite3_db_filename(db, "main"));
+  long size = path && stat(path, &st) == 0 ? (long)st.st_size : 0;
+  metrics_set(METRIC_WAL_BYTES, size);
+  return size;
+}
+
+static long page_size(sqlite3 *db)
+{
+  sqlite3_stmt *stmt;
+  long size = 4096;
+  if (sqlite3_prepare_v2(db, "PRAGMA page_size;", -1, &stmt, NULL) ==
+      SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      size = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  return size;
+}
+
+// A passive checkpoint copies what it can without waiting on anyone, and
+// writers go back to the start of the log once it has caught up and no
+// reader still needs the old frames. Readers that never all let go keep
+// that from happening, so the sizes measured after the passive pass decide
+// whether to wait for them: a log in use past the size limit gets a
+// RESTART, and a file far past it (which RESTART leaves at its size) a
+// TRUNCATE. Both hold the write lock while they work, so they wait on
+// readers for less than other tasks would and retry at the next tick.
+static int checkpoint_wal(sqlite3 *db)
+{
+  // A connection opens the WAL on its first read and until then its
+  // checkpoints do nothing; nothing else runs on this lane to do that read
+  if (exec_task(db, "SELECT 1 FROM sqlite_master LIMIT 1;", "WAL open") < 0) {
+    return -1;
+  }
+
+  int log_frames = -1;
+  if (checkpoint(db, SQLITE_CHECKPOINT_PASSIVE, &log_frames) < 0) {
+    return -1;
+  }
+
+  long limit = config.wal_size_limit_mb * 1024L * 1024L;
+  long file_bytes = wal_size(db);
+  long log_bytes = log_frames > 0 ? log_frames * page_size(db) : 0;
+
+  int mode;
+  Metric counter;
+  if (file_bytes > limit * WAL_TRUNCATE_FACTOR) {
+    mode = SQLITE_CHECKPOINT_TRUNCATE;
+    counter = METRIC_CHECKPOINT_TRUNCATES;
+  } else if (log_bytes > limit) {
+    mode = SQLITE_CHECKPOINT_RESTART;
+    counter = METRIC_CHECKPOINT_RESTARTS;
+  } else {
+    return 0;
+  }
+
+  sqlite3_busy_timeout(db, CHECKPOINT_BUSY_TIMEOUT_MS);
+  int rc = checkpoint(db, mode, &log_frames);
+  sqlite3_busy_timeout(db, SCHEDULER_BUSY_TIMEOUT_MS);
+  if (rc < 0) {
+    return -1;
+  }
+  if (rc == 0) {
+    metrics_add(counter, 1);
+    wal_size(db);
+  }
+  return 0;
+}
+
+// Checkpoints get a lane of their own, so a long index build never holds
+// up the next one
+int maintenance_schedule(void)
+{
+  if (scheduler_add("wal_checkpoint", SCHEDULER_LANE_CHECKPOINT,
+                    config.checkpoint_interval_ms,
+                    config.checkpoint_interval_ms, 0, 0, checkpoint_wal) < 0 ||
+      scheduler_add("warm_ownership", SCHEDULER_LANE_BACKGROUND, 0, 0,
+                    config.task_budget_ms, 0, warm_ownership) < 0 ||
+      scheduler_add("recommend_build", SCHEDULER_LANE_BACKGROUND, 0, 0, 0, 1,
+                    recommend_build) < 0 ||
+      scheduler_add("analyze", SCHEDULER_LANE_BACKGROUND, 0, 0, 0, 0,
+                    analyze_new_tables) < 0 ||
+      scheduler_add("optimize", SCHEDULER_LANE_BACKGROUND,
+                    config.optimize_interval_ms, config.optimize_interval_ms,
+                    config.task_budget_ms, 0, optimize) < 0 ||
+      scheduler_add("search_merge", SCHEDULER_LANE_BACKGROUND,
+                    config.search_merge_interval_ms,
+                    config.search_merge_interval_ms, config.task_budget_ms, 0,
+                    merge_search) < 0 ||
+      scheduler_add("facets_rebuild", SCHEDULER_LANE_BACKGROUND,
+                    config.facets_rebuild_interval_ms,
+                    config.facets_rebuild_interval_ms, config.task_budget_ms,
+                    1, rebuild_facets) < 0) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,75 @@
+#include "metrics.h"
+#include <stdatomic.h>
+
+// Process-wide counters and gauges; updates are relaxed atomics so any
+// thread can bump them without a lock
+static atomic_long values[METRIC_COUNT];
+
+static const char *const names[METRIC_COUNT] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = "connections_accepted",
+    [METRIC_CONNECTIONS_REJECTED] = "connections_rejected",
+    [METRIC_CONNECTIONS_OPEN] = "connections_open",
+    [METRIC_REQUESTS] = "requests",
+    [METRIC_HEADER_TIMEOUTS] = "header_timeouts",
+    [METRIC_BODY_TIMEOUTS] = "body_timeouts",
+    [METRIC_IDLE_TIMEOUTS] = "idle_timeouts",
+    [METRIC_WRITE_TIMEOUTS] = "write_timeouts",
+    [METRIC_QUEUED_READS] = "queued_reads",
+    [METRIC_QUEUED_WRITES] = "queued_writes",
+    [METRIC_QUEUED_AUTH] = "queued_auth",
+    [METRIC_QUEUED_SNAPSHOT] = "queued_snapshot",
+    [METRIC_SHED_QUEUE_FULL] = "shed_queue_full",
+    [METRIC_SHED_QUEUE_DELAY] = "shed_queue_delay",
+    [METRIC_SHED_DEADLINE] = "shed_deadline",
+    [METRIC_RATE_LIMITED] = "rate_limited",
+    [METRIC_RATE_LIMIT_ENTRIES] = "rate_limit_entries",
+    [METRIC_HASH_QUEUE_DEPTH] = "hash_queue_depth",
+    [METRIC_HASHES] = "hashes",
+    [METRIC_HASH_TIME_US] = "hash_time_us",
+    [METRIC_HASH_REJECTED] = "hash_rejected",
+    [METRIC_STREAMS_OPEN] = "streams_open",
+    [METRIC_STREAMS_DROPPED] = "streams_dropped",
+    [METRIC_SUBSCRIPTIONS] = "subscriptions",
+    [METRIC_EVENTS_PUBLISHED] = "events_published",
+    [METRIC_EVENTS_DELIVERED] = "events_delivered",
+    [METRIC_EVENTS_COALESCED] = "events_coalesced",
+    [METRIC_WEBSOCKETS_OPEN] = "websockets_open",
+    [METRIC_RECOMMEND_BYTES] = "recommend_bytes",
+    [METRIC_RECOMMEND_PAIRS] = "recommend_pairs",
+    [METRIC_WAL_BYTES] = "wal_bytes",
+    [METRIC_WAL_FRAMES] = "wal_frames",
+    [METRIC_CHECKPOINTS] = "checkpoints",
+    [METRIC_CHECKPOINTS_BUSY] = "checkpoints_busy",
+    [METRIC_CHECKPOINT_RESTARTS] = "checkpoint_restarts",
+    [METRIC_CHECKPOINT_TRUNCATES] = "checkpoint_truncates",
+    [METRIC_CHECKPOINT_TIME_US] = "checkpoint_time_us",
+    [METRIC_CHECKPOINT_LAST_US] = "checkpoint_last_us",
+};
+
+void metrics_add(Metric metric, long delta)
+{
+  atomic_fetch_add_explicit(&values[metric], delta, memory_order_relaxed);
+}
+
+void metrics_set(Metric metric, long value)
+{
+  atomic_store_explicit(&values[metric], value, memory_order_relaxed);
+}
+
+long metrics_get(Metric metric)
+{
+  return atomic_load_explicit(&values[metric], memory_order_relaxed);
+}
+
+cJSON *metrics_to_json(void)
+{
+  cJSON *json = cJSON_CreateObject();
+  if (!json) {
+    return NULL;
+  }
+
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    cJSON_AddNumberToObject(json, names[i], (double)metrics_get(i));
+  }
+  return json;
+}
@@ -0,0 +1,175 @@
+#include "ownership.h"
+#include "defines.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Per-user set of owned game_ids, loaded from Libraries on first use and
+// evicted least-recently-used once OWNERSHIP_CACHE_USERS are cached.
+typedef struct OwnershipEntry {
+  long user_id;
+  Bitmap games;
+  struct OwnershipEntry *hash_next;
+  struct OwnershipEntry *lru_prev;
+  struct OwnershipEntry *lru_next;
+} OwnershipEntry;
+
+#define BUCKET_COUNT (OWNERSHIP_CACHE_USERS * 2)
+
+static OwnershipEntry *buckets[BUCKET_COUNT];
+static OwnershipEntry *lru_head = NULL;
+static OwnershipEntry *lru_tail = NULL;
+static size_t cached_users = 0;
+
+// Guards the table and the LRU list; callers only ever see copies, so an
+// entry can be evicted while another thread is still using its games
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t bucket_of(long user_id)
+{
+  return ((uint64_t)user_id * 0x9E3779B97F4A7C15ULL) % BUCKET_COUNT;
+}
+
+static void lru_unlink(OwnershipEntry *entry)
+{
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    lru_head = entry->lru_next;
+  }
+  if (entry->lru_next) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    lru_tail = entry->lru_prev;
+  }
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(OwnershipEntry *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = lru_head;
+  if (lru_head) {
+    lru_head->lru_prev = entry;
+  }
+  lru_head = entry;
+  if (!lru_tail) {
+    lru_tail = entry;
+  }
+}
+
+static OwnershipEntry *find_entry(long user_id)
+{
+  for (OwnershipEntry *entry = buckets[bucket_of(user_id)]; entry;
+       entry = entry->hash_next) {
+    if (entry->user_id == user_id) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void evict_entry(OwnershipEntry *entry)
+{
+  OwnershipEntry **link = &buckets[bucket_of(entry->user_id)];
+  while (*link != entry) {
+    link = &(*link)->hash_next;
+  }
+  *link = entry->hash_next;
+
+  lru_unlink(entry);
+  bitmap_free(&entry->games);
+  free(entry);
+  cached_users--;
+}
+
+static OwnershipEntry *load_entry(sqlite3 *db, long user_id)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db,
+                         "SELECT game_id FROM Libraries WHERE user_id = ?1;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to load library: %s\n", sqlite3_errmsg(db));
+    return NULL;
+  }
+  sqlite3_bind_int64(stmt, 1, user_id);
+
+  OwnershipEntry *entry = calloc(1, sizeof(*entry));
+  if (!entry) {
+    sqlite3_finalize(stmt);
+    return NULL;
+  }
+  entry->user_id = user_id;
+  bitmap_init(&entry->games);
+
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    bitmap_add(&entry->games, (uint32_t)sqlite3_column_int64(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    bitmap_free(&entry->games);
+    free(entry);
+    return NULL;
+  }
+
+  if (cached_users >= OWNERSHIP_CACHE_USERS && lru_tail) {
+    evict_entry(lru_tail);
+  }
+
+  size_t bucket = bucket_of(user_id);
+  entry->hash_next = buckets[bucket];
+  buckets[bucket] = entry;
+  lru_push_front(entry);
+  cached_users++;
+
+  return entry;
+}
+
+int ownership_get(sqlite3 *db, long user_id, Bitmap *owned)
+{
+  pthread_mutex_lock(&cache_lock);
+  OwnershipEntry *entry = find_entry(user_id);
+  if (entry) {
+    lru_unlink(entry);
+    lru_push_front(entry);
+  } else {
+    entry = load_entry(db, user_id);
+  }
+  int copied = entry && bitmap_copy(&entry->games, owned);
+  pthread_mutex_unlock(&cache_lock);
+
+  return copied ? 0 : -1;
+}
+
+// Writes only touch users that are already cached; others load fresh later
+void ownership_add(long user_id, long game_id)
+{
+  pthread_mutex_lock(&cache_lock);
+  OwnershipEntry *entry = find_entry(user_id);
+  if (entry) {
+    bitmap_add(&entry->games, (uint32_t)game_id);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void ownership_remove(long user_id, long game_id)
+{
+  pthread_mutex_lock(&cache_lock);
+  OwnershipEntry *entry = find_entry(user_id);
+  if (entry) {
+    bitmap_remove(&entry->games, (uint32_t)game_id);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void ownership_free(void)
+{
+  pthread_mutex_lock(&cache_lock);
+  while (lru_tail) {
+    evict_entry(lru_tail);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
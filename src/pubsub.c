@@ -0,0 +1,306 @@
+#include "pubsub.h"
+#include "defines.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Topic {
+  char *name;
+  uint64_t hash;
+  Subscription *subscribers;
+  struct Topic *next;
+} Topic;
+
+// Linked into its topic's subscriber list and into its owner's list, so a
+// closing connection drops all of its topics without a search
+struct Subscription {
+  Topic *topic;
+  void *owner;
+  Subscription *next;
+  Subscription **pprev;
+  Subscription *next_owned;
+};
+
+// Published but not yet fanned out by the loop, oldest first
+typedef struct Publication {
+  struct Publication *next;
+  Message *message;
+  char topic[];
+} Publication;
+
+static Topic *topics[PUBSUB_TOPIC_BUCKETS];
+static Publication *pending_head = NULL;
+static Publication *pending_tail = NULL;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static void (*wake_loop)(void) = NULL;
+
+static uint64_t hash_topic(const char *name)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *name; name++) {
+    hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// The extra byte leaves room for the terminator snprintf writes
+static Message *allocate_message(size_t length, size_t frame_length)
+{
+  Message *message = malloc(sizeof(*message) + length + frame_length + 1);
+  if (!message) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    return NULL;
+  }
+  atomic_init(&message->references, 1);
+  message->key = 0;
+  message->length = length;
+  message->frame_length = frame_length;
+  return message;
+}
+
+Message *message_create(const char *text, size_t length, const char *frame,
+                        size_t frame_length)
+{
+  Message *message = allocate_message(length, frame_length);
+  if (message) {
+    memcpy(message->data, text, length);
+    memcpy(message_frame(message), frame, frame_length);
+  }
+  return message;
+}
+
+Message *message_websocket(WebSocketOpcode opcode, const char *payload,
+                           size_t length)
+{
+  uint8_t header[WEBSOCKET_MAX_HEADER];
+  size_t header_length = websocket_frame_header(opcode, length, header);
+
+  Message *message = allocate_message(0, header_length + length);
+  if (message) {
+    memcpy(message->data, header, header_length);
+    memcpy(message->data + header_length, payload, length);
+  }
+  return message;
+}
+
+Message *message_event(const char *topic, const char *event, const char *data,
+                       int replaceable)
+{
+  size_t text_length =
+      strlen("event: \ndata: \n\n") + strlen(event) + strlen(data);
+  size_t payload_length =
+      strlen("{\"topic\":\"\",\"event\":\"\",\"data\":}") + strlen(topic) +
+      strlen(event) + strlen(data);
+  uint8_t header[WEBSOCKET_MAX_HEADER];
+  size_t header_length =
+      websocket_frame_header(WEBSOCKET_TEXT, payload_length, header);
+
+  Message *message =
+      allocate_message(text_length, header_length + payload_length);
+  if (!message) {
+    return NULL;
+  }
+
+  // Each snprintf writes a terminator past its text; the next part, or the
+  // spare byte at the end, takes it
+  char *out = message->data;
+  snprintf(out, text_length + 1, "event: %s\ndata: %s\n\n", event, data);
+  out += text_length;
+  memcpy(out, header, header_length);
+  out += header_length;
+  snprintf(out, payload_length + 1, "{\"topic\":\"%s\",\"event\":\"%s\",\"data\":%s}",
+           topic, event, data);
+
+  if (replaceable) {
+    message->key = hash_topic(topic) ^ (hash_topic(event) * 31);
+  }
+  return message;
+}
+
+Message *message_retain(Message *message)
+{
+  atomic_fetch_add_explicit(&message->references, 1, memory_order_relaxed);
+  return message;
+}
+
+void message_release(Message *message)
+{
+  if (message &&
+      atomic_fetch_sub_explicit(&message->references, 1,
+                                memory_order_acq_rel) == 1) {
+    free(message);
+  }
+}
+
+static Topic *find_topic(const char *name, uint64_t hash)
+{
+  Topic *topic = topics[hash % PUBSUB_TOPIC_BUCKETS];
+  while (topic && (topic->hash != hash || strcmp(topic->name, name) != 0)) {
+    topic = topic->next;
+  }
+  return topic;
+}
+
+static void remove_topic(Topic *topic)
+{
+  Topic **link = &topics[topic->hash % PUBSUB_TOPIC_BUCKETS];
+  while (*link != topic) {
+    link = &(*link)->next;
+  }
+  *link = topic->next;
+  free(topic->name);
+  free(topic);
+}
+
+void pubsub_init(void (*wake)(void))
+{
+  wake_loop = wake;
+}
+
+static Subscription **find_owned(Subscription **owned, const char *name)
+{
+  while (*owned && strcmp((*owned)->topic->name, name) != 0) {
+    owned = &(*owned)->next_owned;
+  }
+  return owned;
+}
+
+int pubsub_subscribe(Subscription **owned, const char *name, void *owner)
+{
+  if (*find_owned(owned, name)) {
+    return 0;
+  }
+
+  uint64_t hash = hash_topic(name);
+  Topic *topic = find_topic(name, hash);
+  if (!topic) {
+    topic = calloc(1, sizeof(*topic));
+    if (!topic || !(topic->name = strdup(name))) {
+      fprintf(stderr, "ERROR: Memory allocation failed.\n");
+      free(topic);
+      return -1;
+    }
+    topic->hash = hash;
+    topic->next = topics[hash % PUBSUB_TOPIC_BUCKETS];
+    topics[hash % PUBSUB_TOPIC_BUCKETS] = topic;
+  }
+
+  Subscription *subscription = malloc(sizeof(*subscription));
+  if (!subscription) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    if (!topic->subscribers) {
+      remove_topic(topic);
+    }
+    return -1;
+  }
+  subscription->topic = topic;
+  subscription->owner = owner;
+  subscription->next = topic->subscribers;
+  subscription->pprev = &topic->subscribers;
+  if (topic->subscribers) {
+    topic->subscribers->pprev = &subscription->next;
+  }
+  topic->subscribers = subscription;
+
+  subscription->next_owned = *owned;
+  *owned = subscription;
+  metrics_add(METRIC_SUBSCRIPTIONS, 1);
+  return 1;
+}
+
+// Unlink the subscription at *link from its owner and its topic
+static void unsubscribe(Subscription **link)
+{
+  Subscription *subscription = *link;
+  *link = subscription->next_owned;
+
+  *subscription->pprev = subscription->next;
+  if (subscription->next) {
+    subscription->next->pprev = subscription->pprev;
+  }
+  if (!subscription->topic->subscribers) {
+    remove_topic(subscription->topic);
+  }
+  free(subscription);
+  metrics_add(METRIC_SUBSCRIPTIONS, -1);
+}
+
+int pubsub_unsubscribe(Subscription **owned, const char *name)
+{
+  Subscription **link = find_owned(owned, name);
+  if (!*link) {
+    return 0;
+  }
+  unsubscribe(link);
+  return 1;
+}
+
+void pubsub_unsubscribe_all(Subscription **owned)
+{
+  while (*owned) {
+    unsubscribe(owned);
+  }
+}
+
+void pubsub_publish(const char *topic, Message *message)
+{
+  if (!message) {
+    return;
+  }
+
+  size_t length = strlen(topic);
+  Publication *publication = malloc(sizeof(*publication) + length + 1);
+  if (!publication) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    message_release(message);
+    return;
+  }
+  publication->next = NULL;
+  publication->message = message;
+  memcpy(publication->topic, topic, length + 1);
+
+  pthread_mutex_lock(&pending_lock);
+  int was_empty = pending_head == NULL;
+  if (pending_tail) {
+    pending_tail->next = publication;
+  } else {
+    pending_head = publication;
+  }
+  pending_tail = publication;
+  pthread_mutex_unlock(&pending_lock);
+
+  metrics_add(METRIC_EVENTS_PUBLISHED, 1);
+  if (was_empty && wake_loop) {
+    wake_loop();
+  }
+}
+
+// Runs on the loop thread. deliver may drop the subscriber it is handed,
+// so the next one is read first.
+void pubsub_deliver(void (*deliver)(void *owner, Message *message))
+{
+  pthread_mutex_lock(&pending_lock);
+  Publication *publication = pending_head;
+  pending_head = NULL;
+  pending_tail = NULL;
+  pthread_mutex_unlock(&pending_lock);
+
+  while (publication) {
+    Publication *next = publication->next;
+    Topic *topic =
+        find_topic(publication->topic, hash_topic(publication->topic));
+    Subscription *subscription = topic ? topic->subscribers : NULL;
+    while (subscription) {
+      Subscription *next_subscription = subscription->next;
+      deliver(subscription->owner, message_retain(publication->message));
+      subscription = next_subscription;
+    }
+
+    message_release(publication->message);
+    free(publication);
+    publication = next;
+  }
+}
@@ -0,0 +1,315 @@
+#include "rate_limit.h"
+#include "config.h"
+#include "defines.h"
+#include "metrics.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_RATE_ROUTES 32
+#define SHARD_BUCKETS 1024
+#define SHARD_CAPACITY (RATE_LIMIT_ENTRIES / RATE_LIMIT_SHARDS)
+#define SWEEP_INTERVAL_MS 10000
+
+typedef enum { KEY_PEER, KEY_USER } KeyKind;
+
+typedef struct {
+  char method[8];
+  char path[64];
+  size_t path_length;
+  int prefix;
+  double rate;
+  double burst;
+} RateRoute;
+
+// One token bucket per (route, peer) and (route, user_id). A bucket that
+// has refilled completely is indistinguishable from a new one, so idle
+// entries can be dropped at any time. Each shard keeps its entries in
+// least-recently-charged order, so the idle ones collect at the tail.
+typedef struct RateEntry {
+  struct RateEntry *next;
+  struct RateEntry *lru_prev;
+  struct RateEntry *lru_next;
+  uint64_t id;
+  uint16_t route;
+  uint8_t kind;
+  double tokens;
+  uint64_t updated_ms;
+} RateEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  RateEntry *buckets[SHARD_BUCKETS];
+  RateEntry *lru_head;
+  RateEntry *lru_tail;
+  size_t count;
+  uint64_t swept_ms;
+} RateShard;
+
+static RateRoute routes[MAX_RATE_ROUTES];
+static int route_count = 0;
+static RateShard shards[RATE_LIMIT_SHARDS];
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int parse_route(const char *spec, RateRoute *route)
+{
+  if (sscanf(spec, " %7s %63[^=]=%lf:%lf", route->method, route->path,
+             &route->rate, &route->burst) != 4 ||
+      route->rate <= 0 || route->burst < 1) {
+    return -1;
+  }
+
+  route->path_length = strlen(route->path);
+  while (route->path_length > 0 &&
+         isspace((unsigned char)route->path[route->path_length - 1])) {
+    route->path[--route->path_length] = '\0';
+  }
+  route->prefix = route->path_length > 0 &&
+                  route->path[route->path_length - 1] == '*';
+  if (route->prefix) {
+    route->path[--route->path_length] = '\0';
+  }
+  return 0;
+}
+
+int rate_limit_init(void)
+{
+  for (int i = 0; i < RATE_LIMIT_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+
+  char *specs = strdup(config.rate_limits);
+  if (!specs) {
+    return -1;
+  }
+
+  char *saveptr;
+  for (char *spec = strtok_r(specs, ";", &saveptr); spec;
+       spec = strtok_r(NULL, ";", &saveptr)) {
+    if (route_count == MAX_RATE_ROUTES) {
+      fprintf(stderr, "ERROR: Too many rate limits, ignoring the rest\n");
+      break;
+    }
+    if (parse_route(spec, &routes[route_count]) < 0) {
+      fprintf(stderr, "ERROR: Ignoring invalid rate limit: %s\n", spec);
+      continue;
+    }
+    printf("LOG: Rate limit %s %s%s: %.2f/s, burst %.0f\n",
+           routes[route_count].method, routes[route_count].path,
+           routes[route_count].prefix ? "*" : "", routes[route_count].rate,
+           routes[route_count].burst);
+    route_count++;
+  }
+
+  free(specs);
+  return 0;
+}
+
+static int find_route(const char *request)
+{
+  const char *method_end = strchr(request, ' ');
+  if (!method_end) {
+    return -1;
+  }
+  const char *path = method_end + 1;
+  size_t method_length = method_end - request;
+  size_t path_length = strcspn(path, "? \r\n");
+
+  for (int i = 0; i < route_count; i++) {
+    const RateRoute *route = &routes[i];
+    if (strlen(route->method) != method_length ||
+        strncmp(route->method, request, method_length) != 0) {
+      continue;
+    }
+    if (route->prefix ? path_length >= route->path_length &&
+                            strncmp(path, route->path, route->path_length) == 0
+                      : path_length == route->path_length &&
+                            strncmp(path, route->path, path_length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// user_id from the query string of the request line, or -1
+static long find_user_id(const char *request)
+{
+  const char *line_end = strpbrk(request, "\r\n");
+  const char *query = strchr(request, '?');
+  if (!query || (line_end && query > line_end)) {
+    return -1;
+  }
+
+  for (const char *p = query; p && (!line_end || p < line_end);
+       p = strchr(p + 1, '&')) {
+    if (strncmp(p + 1, "user_id=", 8) == 0 && isdigit((unsigned char)p[9])) {
+      return strtol(p + 9, NULL, 10);
+    }
+  }
+  return -1;
+}
+
+static int is_idle(const RateEntry *entry, uint64_t now)
+{
+  const RateRoute *route = &routes[entry->route];
+  return entry->tokens + (now - entry->updated_ms) * route->rate / 1000 >=
+         route->burst;
+}
+
+static size_t bucket_of(uint64_t hash)
+{
+  return hash % SHARD_BUCKETS;
+}
+
+static uint64_t hash_key(KeyKind kind, int route, uint64_t id)
+{
+  return (id ^ ((uint64_t)route << 1 | kind) << 48) * 0x9E3779B97F4A7C15ULL;
+}
+
+static void lru_unlink(RateShard *shard, RateEntry *entry)
+{
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    shard->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    shard->lru_tail = entry->lru_prev;
+  }
+}
+
+static void lru_push_front(RateShard *shard, RateEntry *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = shard->lru_head;
+  if (shard->lru_head) {
+    shard->lru_head->lru_prev = entry;
+  }
+  shard->lru_head = entry;
+  if (!shard->lru_tail) {
+    shard->lru_tail = entry;
+  }
+}
+
+static void evict_entry(RateShard *shard, RateEntry *entry)
+{
+  RateEntry **link = &shard->buckets[bucket_of(
+      hash_key(entry->kind, entry->route, entry->id))];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+
+  lru_unlink(shard, entry);
+  free(entry);
+  shard->count--;
+  metrics_add(METRIC_RATE_LIMIT_ENTRIES, -1);
+}
+
+// Drop idle entries from the cold end; when making room and the coldest
+// entry is still busy, drop it anyway
+static void sweep_shard(RateShard *shard, uint64_t now, int make_room)
+{
+  while (shard->lru_tail && is_idle(shard->lru_tail, now)) {
+    evict_entry(shard, shard->lru_tail);
+  }
+  if (make_room && shard->count >= SHARD_CAPACITY && shard->lru_tail) {
+    evict_entry(shard, shard->lru_tail);
+  }
+  shard->swept_ms = now;
+}
+
+static int take_token(KeyKind kind, int route_index, uint64_t id, uint64_t now)
+{
+  const RateRoute *route = &routes[route_index];
+  uint64_t hash = hash_key(kind, route_index, id);
+  RateShard *shard = &shards[(hash >> 32) % RATE_LIMIT_SHARDS];
+  RateEntry **head = &shard->buckets[bucket_of(hash)];
+
+  pthread_mutex_lock(&shard->lock);
+  if (now - shard->swept_ms >= SWEEP_INTERVAL_MS) {
+    sweep_shard(shard, now, 0);
+  }
+
+  RateEntry *entry = *head;
+  while (entry && (entry->id != id || entry->route != route_index ||
+                   entry->kind != kind)) {
+    entry = entry->next;
+  }
+
+  if (!entry) {
+    if (shard->count >= SHARD_CAPACITY) {
+      sweep_shard(shard, now, 1);
+    }
+    entry = malloc(sizeof(*entry));
+    if (!entry) {
+      // Fail open: a missing bucket must not lock clients out
+      pthread_mutex_unlock(&shard->lock);
+      return 0;
+    }
+    entry->id = id;
+    entry->route = route_index;
+    entry->kind = kind;
+    entry->tokens = route->burst;
+    entry->updated_ms = now;
+    entry->next = *head;
+    *head = entry;
+    lru_push_front(shard, entry);
+    shard->count++;
+    metrics_add(METRIC_RATE_LIMIT_ENTRIES, 1);
+  } else if (shard->lru_head != entry) {
+    lru_unlink(shard, entry);
+    lru_push_front(shard, entry);
+  }
+
+  entry->tokens += (now - entry->updated_ms) * route->rate / 1000;
+  if (entry->tokens > route->burst) {
+    entry->tokens = route->burst;
+  }
+  entry->updated_ms = now;
+
+  int retry_after = 0;
+  if (entry->tokens >= 1) {
+    entry->tokens -= 1;
+  } else {
+    double wait = (1 - entry->tokens) / route->rate;
+    retry_after = (int)wait;
+    if (retry_after < wait) {
+      retry_after++;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return retry_after;
+}
+
+int rate_limit_check(uint32_t peer, const char *request)
+{
+  int route = find_route(request);
+  if (route < 0) {
+    return 0;
+  }
+
+  uint64_t now = now_ms();
+  int retry_after = take_token(KEY_PEER, route, peer, now);
+  long user_id = find_user_id(request);
+  if (!retry_after && user_id >= 0) {
+    retry_after = take_token(KEY_USER, route, (uint64_t)user_id, now);
+  }
+
+  if (retry_after) {
+    metrics_add(METRIC_RATE_LIMITED, 1);
+  }
+  return retry_after;
+}
@@ -0,0 +1,623 @@
+#include "recommend.h"
+#include "defines.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// A game and a count: how many players own it together with the game whose
+// row it sits in. Game ids start at 1, so an id of 0 marks an empty slot.
+typedef struct {
+  uint32_t id;
+  uint32_t count;
+} Pair;
+
+// Open-addressing map of pairs by id; a pair that drops to zero keeps its
+// slot, since the same two games tend to be co-owned again
+typedef struct {
+  Pair *slots;
+  uint32_t used;
+  uint32_t capacity;
+} PairMap;
+
+// One row of the matrix, with its best pairs kept sorted
+typedef struct {
+  uint32_t id;
+  uint32_t owners;
+  PairMap partners;
+  uint32_t top_length;
+  Pair top[RECOMMEND_TOP_K];
+} CoGame;
+
+// A library change that arrived while the index was still being built
+typedef struct PendingUpdate {
+  uint32_t game_id;
+  int sign;
+  uint32_t *library;
+  size_t length;
+  struct PendingUpdate *next;
+} PendingUpdate;
+
+// Rows by game id, open addressing on the CoGame structs themselves
+static CoGame *games = NULL;
+static size_t game_count = 0;
+static size_t game_capacity = 0;
+
+static int ready = 0;
+static PendingUpdate *pending_head = NULL;
+static PendingUpdate **pending_tail = &pending_head;
+static pthread_rwlock_t recommend_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static size_t slot_of(uint32_t id, size_t capacity)
+{
+  return ((uint64_t)id * 0x9E3779B97F4A7C15ULL) >> 32 & (capacity - 1);
+}
+
+static Pair *pair_map_find(const PairMap *map, uint32_t id)
+{
+  if (map->capacity == 0) {
+    return NULL;
+  }
+  for (size_t i = slot_of(id, map->capacity);; i = (i + 1) & (map->capacity - 1)) {
+    if (map->slots[i].id == id) {
+      return &map->slots[i];
+    }
+    if (map->slots[i].id == 0) {
+      return NULL;
+    }
+  }
+}
+
+// The pair for id, added with a count of zero if it is new
+static Pair *pair_map_get(PairMap *map, uint32_t id)
+{
+  Pair *pair = pair_map_find(map, id);
+  if (pair) {
+    return pair;
+  }
+
+  // Rows are the bulk of the index, so they run fuller than the id maps
+  // elsewhere: grow at three quarters
+  if ((map->used + 1) * 4 > map->capacity * 3) {
+    uint32_t capacity = map->capacity ? map->capacity * 2 : 8;
+    Pair *slots = calloc(capacity, sizeof(*slots));
+    if (!slots) {
+      return NULL;
+    }
+    for (uint32_t i = 0; i < map->capacity; i++) {
+      if (map->slots[i].id) {
+        size_t j = slot_of(map->slots[i].id, capacity);
+        while (slots[j].id) {
+          j = (j + 1) & (capacity - 1);
+        }
+        slots[j] = map->slots[i];
+      }
+    }
+    metrics_add(METRIC_RECOMMEND_BYTES,
+                (long)(capacity - map->capacity) * (long)sizeof(Pair));
+    free(map->slots);
+    map->slots = slots;
+    map->capacity = capacity;
+  }
+
+  size_t i = slot_of(id, map->capacity);
+  while (map->slots[i].id) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  map->slots[i].id = id;
+  map->used++;
+  return &map->slots[i];
+}
+
+static CoGame *find_game(uint32_t id)
+{
+  if (game_capacity == 0) {
+    return NULL;
+  }
+  for (size_t i = slot_of(id, game_capacity);; i = (i + 1) & (game_capacity - 1)) {
+    if (games[i].id == id) {
+      return &games[i];
+    }
+    if (games[i].id == 0) {
+      return NULL;
+    }
+  }
+}
+
+// The row for id, created if it is new. Creating one may move every other
+// row, so no CoGame pointer survives a call.
+static CoGame *add_game(uint32_t id)
+{
+  CoGame *game = find_game(id);
+  if (game) {
+    return game;
+  }
+
+  if ((game_count + 1) * 2 > game_capacity) {
+    size_t capacity = game_capacity ? game_capacity * 2 : 1024;
+    CoGame *table = calloc(capacity, sizeof(*table));
+    if (!table) {
+      return NULL;
+    }
+    for (size_t i = 0; i < game_capacity; i++) {
+      if (games[i].id) {
+        size_t j = slot_of(games[i].id, capacity);
+        while (table[j].id) {
+          j = (j + 1) & (capacity - 1);
+        }
+        table[j] = games[i];
+      }
+    }
+    metrics_add(METRIC_RECOMMEND_BYTES,
+                (long)(capacity - game_capacity) * (long)sizeof(CoGame));
+    free(games);
+    games = table;
+    game_capacity = capacity;
+  }
+
+  size_t i = slot_of(id, game_capacity);
+  while (games[i].id) {
+    i = (i + 1) & (game_capacity - 1);
+  }
+  games[i].id = id;
+  game_count++;
+  return &games[i];
+}
+
+static int ranks_before(Pair a, Pair b)
+{
+  return a.count > b.count || (a.count == b.count && a.id < b.id);
+}
+
+// Place pair in the sorted top if it ranks, pushing out the last when full
+static void insert_top(CoGame *game, Pair pair)
+{
+  uint32_t i = game->top_length;
+  if (i == RECOMMEND_TOP_K) {
+    if (!ranks_before(pair, game->top[i - 1])) {
+      return;
+    }
+    i--;
+  } else {
+    game->top_length++;
+  }
+  while (i > 0 && ranks_before(pair, game->top[i - 1])) {
+    game->top[i] = game->top[i - 1];
+    i--;
+  }
+  game->top[i] = pair;
+}
+
+static void refresh_top(CoGame *game)
+{
+  game->top_length = 0;
+  for (uint32_t i = 0; i < game->partners.capacity; i++) {
+    if (game->partners.slots[i].count > 0) {
+      insert_top(game, game->partners.slots[i]);
+    }
+  }
+}
+
+// Keep the top in step with one pair that just moved by sign
+static void update_top(CoGame *game, Pair pair, int sign)
+{
+  uint32_t i = 0;
+  while (i < game->top_length && game->top[i].id != pair.id) {
+    i++;
+  }
+
+  if (i == game->top_length) {
+    // A pair outside a full top can only get in by growing; while the top
+    // is not full it holds every pair there is
+    if (sign > 0) {
+      insert_top(game, pair);
+    }
+    return;
+  }
+
+  if (sign < 0 && game->top_length == RECOMMEND_TOP_K) {
+    // A pair outside may now outrank it, and only a scan can tell
+    refresh_top(game);
+    return;
+  }
+
+  memmove(&game->top[i], &game->top[i + 1],
+          (game->top_length - i - 1) * sizeof(Pair));
+  game->top_length--;
+  if (pair.count > 0) {
+    insert_top(game, pair);
+  }
+}
+
+static void count_pair(CoGame *game, uint32_t partner, int sign)
+{
+  Pair *pair = sign > 0 ? pair_map_get(&game->partners, partner)
+                        : pair_map_find(&game->partners, partner);
+  if (!pair || (sign < 0 && pair->count == 0)) {
+    return;
+  }
+
+  pair->count += sign;
+  if (pair->count == (sign > 0 ? 1u : 0u)) {
+    metrics_add(METRIC_RECOMMEND_PAIRS, sign);
+  }
+  // While building, tops are ranked once at the end instead
+  if (ready) {
+    update_top(game, *pair, sign);
+  }
+}
+
+// Count game_id as gained or lost by an owner of library, in its own row
+// and in the row of every other game in library
+static void apply_update(uint32_t game_id, const uint32_t *library,
+                         size_t length, int sign)
+{
+  if (sign > 0) {
+    for (size_t i = 0; i < length; i++) {
+      if (!add_game(library[i])) {
+        return;
+      }
+    }
+  }
+  CoGame *game = sign > 0 ? add_game(game_id) : find_game(game_id);
+  if (!game) {
+    return;
+  }
+
+  if (sign > 0 || game->owners > 0) {
+    game->owners += sign;
+  }
+  for (size_t i = 0; i < length; i++) {
+    if (library[i] == game_id) {
+      continue;
+    }
+    count_pair(game, library[i], sign);
+    CoGame *other = find_game(library[i]);
+    if (other) {
+      count_pair(other, game_id, sign);
+    }
+  }
+}
+
+static void remove_game(uint32_t game_id)
+{
+  CoGame *game = find_game(game_id);
+  if (!game) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < game->partners.capacity; i++) {
+    Pair *pair = &game->partners.slots[i];
+    if (pair->count == 0) {
+      continue;
+    }
+    CoGame *other = find_game(pair->id);
+    Pair *back = other ? pair_map_find(&other->partners, game_id) : NULL;
+    if (back && back->count > 0) {
+      back->count = 0;
+      metrics_add(METRIC_RECOMMEND_PAIRS, -1);
+      if (ready) {
+        update_top(other, *back, -1);
+      }
+    }
+    metrics_add(METRIC_RECOMMEND_PAIRS, -1);
+  }
+
+  metrics_add(METRIC_RECOMMEND_BYTES,
+              -(long)game->partners.capacity * (long)sizeof(Pair));
+  free(game->partners.slots);
+  memset(&game->partners, 0, sizeof(game->partners));
+  game->owners = 0;
+  game->top_length = 0;
+}
+
+typedef struct {
+  uint32_t *ids;
+  size_t length;
+  uint32_t skip;
+} IdList;
+
+static void collect_id(uint32_t id, void *data)
+{
+  IdList *list = data;
+  if (id != list->skip) {
+    list->ids[list->length++] = id;
+  }
+}
+
+// Hold on to an update that has to wait for the build; sign 0 is a removed
+// game. Call with the lock held.
+static void defer_update(uint32_t game_id, int sign, uint32_t *library,
+                         size_t length)
+{
+  PendingUpdate *update = malloc(sizeof(*update));
+  if (!update) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    free(library);
+    return;
+  }
+  update->game_id = game_id;
+  update->sign = sign;
+  update->library = library;
+  update->length = length;
+  update->next = NULL;
+  *pending_tail = update;
+  pending_tail = &update->next;
+}
+
+void recommend_update(long game_id, const Bitmap *library, int sign)
+{
+  IdList list = {malloc((bitmap_cardinality(library) + 1) * sizeof(uint32_t)),
+                 0, (uint32_t)game_id};
+  if (!list.ids) {
+    fprintf(stderr, "ERROR: Memory allocation failed.\n");
+    return;
+  }
+  bitmap_for_each(library, collect_id, &list);
+
+  pthread_rwlock_wrlock(&recommend_lock);
+  if (ready) {
+    apply_update((uint32_t)game_id, list.ids, list.length, sign);
+    free(list.ids);
+  } else {
+    defer_update((uint32_t)game_id, sign, list.ids, list.length);
+  }
+  pthread_rwlock_unlock(&recommend_lock);
+}
+
+void recommend_remove_game(long game_id)
+{
+  pthread_rwlock_wrlock(&recommend_lock);
+  if (ready) {
+    remove_game((uint32_t)game_id);
+  } else {
+    defer_update((uint32_t)game_id, 0, NULL, 0);
+  }
+  pthread_rwlock_unlock(&recommend_lock);
+}
+
+// Add every pair within one library; rows only, tops come later
+static int count_library(const uint32_t *library, size_t length)
+{
+  for (size_t i = 0; i < length; i++) {
+    if (!add_game(library[i])) {
+      return -1;
+    }
+  }
+  for (size_t i = 0; i < length; i++) {
+    CoGame *game = find_game(library[i]);
+    game->owners++;
+    for (size_t j = 0; j < length; j++) {
+      if (j != i) {
+        count_pair(game, library[j], 1);
+      }
+    }
+  }
+  return 0;
+}
+
+// Rows are only ever touched by this thread until ready is set
+static int build_index(sqlite3 *db)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db,
+                         "SELECT user_id, game_id FROM Libraries "
+                         "ORDER BY user_id;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to load libraries: %s\n",
+            sqlite3_errmsg(db));
+    return -1;
+  }
+
+  uint32_t *library = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  long current_user = -1;
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    long user_id = sqlite3_column_int64(stmt, 0);
+    if (user_id != current_user) {
+      if (count_library(library, length) < 0) {
+        break;
+      }
+      current_user = user_id;
+      length = 0;
+    }
+    if (length == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      uint32_t *grown = realloc(library, capacity * sizeof(*library));
+      if (!grown) {
+        break;
+      }
+      library = grown;
+    }
+    library[length++] = (uint32_t)sqlite3_column_int64(stmt, 1);
+  }
+  if (rc == SQLITE_DONE) {
+    rc = count_library(library, length) < 0 ? SQLITE_NOMEM : SQLITE_DONE;
+  }
+  sqlite3_finalize(stmt);
+  free(library);
+
+  return rc == SQLITE_DONE ? 0 : -1;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int recommend_build(sqlite3 *db)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int rc = build_index(db);
+  if (rc < 0) {
+    fprintf(stderr, "ERROR: Failed to build the recommendation index\n");
+  }
+
+  // Changes made while the scan ran are replayed on top of it. One that
+  // committed just before the scan began is counted twice; the counts are
+  // a popularity signal, and that much drift does not change a ranking.
+  pthread_rwlock_wrlock(&recommend_lock);
+  size_t replayed = 0;
+  while (pending_head) {
+    PendingUpdate *update = pending_head;
+    pending_head = update->next;
+    if (update->sign == 0) {
+      remove_game(update->game_id);
+    } else {
+      apply_update(update->game_id, update->library, update->length,
+                   update->sign);
+    }
+    free(update->library);
+    free(update);
+    replayed++;
+  }
+  pending_tail = &pending_head;
+
+  for (size_t i = 0; i < game_capacity; i++) {
+    if (games[i].id) {
+      refresh_top(&games[i]);
+    }
+  }
+  ready = 1;
+  pthread_rwlock_unlock(&recommend_lock);
+
+  printf("LOG: Recommendation index built in %.1f s: %zu games, %ld pairs, "
+         "%ld KB, %zu updates replayed\n",
+         seconds_since(&start), game_count,
+         metrics_get(METRIC_RECOMMEND_PAIRS),
+         metrics_get(METRIC_RECOMMEND_BYTES) / 1024, replayed);
+  return rc;
+}
+
+int recommend_ready(void)
+{
+  pthread_rwlock_rdlock(&recommend_lock);
+  int is_ready = ready;
+  pthread_rwlock_unlock(&recommend_lock);
+  return is_ready;
+}
+
+void recommend_free(void)
+{
+  pthread_rwlock_wrlock(&recommend_lock);
+  for (size_t i = 0; i < game_capacity; i++) {
+    free(games[i].partners.slots);
+  }
+  free(games);
+  games = NULL;
+  game_count = 0;
+  game_capacity = 0;
+  metrics_set(METRIC_RECOMMEND_BYTES, 0);
+  metrics_set(METRIC_RECOMMEND_PAIRS, 0);
+  pthread_rwlock_unlock(&recommend_lock);
+}
+
+cJSON *recommend_similar(long game_id, size_t limit)
+{
+  cJSON *json = cJSON_CreateObject();
+  cJSON *similar = cJSON_CreateArray();
+  if (!json || !similar) {
+    cJSON_Delete(json);
+    cJSON_Delete(similar);
+    return NULL;
+  }
+
+  pthread_rwlock_rdlock(&recommend_lock);
+  CoGame *game = find_game((uint32_t)game_id);
+  cJSON_AddNumberToObject(json, "game_id", game_id);
+  cJSON_AddNumberToObject(json, "owners", game ? game->owners : 0);
+  for (uint32_t i = 0; game && i < game->top_length && i < limit; i++) {
+    cJSON *entry = cJSON_CreateObject();
+    cJSON_AddNumberToObject(entry, "game_id", game->top[i].id);
+    cJSON_AddNumberToObject(entry, "co_owners", game->top[i].count);
+    cJSON_AddItemToArray(similar, entry);
+  }
+  pthread_rwlock_unlock(&recommend_lock);
+
+  cJSON_AddItemToObject(json, "similar", similar);
+  return json;
+}
+
+typedef struct {
+  const Bitmap *owned;
+  Pair *candidates;
+  size_t length;
+} Candidates;
+
+// Every unowned game in the top of one owned game is a candidate
+static void collect_candidates(uint32_t id, void *data)
+{
+  Candidates *candidates = data;
+  CoGame *game = find_game(id);
+  for (uint32_t i = 0; game && i < game->top_length; i++) {
+    if (!bitmap_contains(candidates->owned, game->top[i].id)) {
+      candidates->candidates[candidates->length++] = game->top[i];
+    }
+  }
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+  uint32_t x = ((const Pair *)a)->id;
+  uint32_t y = ((const Pair *)b)->id;
+  return (x > y) - (x < y);
+}
+
+static int compare_ranks(const void *a, const void *b)
+{
+  Pair x = *(const Pair *)a;
+  Pair y = *(const Pair *)b;
+  return ranks_before(x, y) ? -1 : ranks_before(y, x);
+}
+
+cJSON *recommend_for_user(const Bitmap *owned, size_t limit)
+{
+  // Candidates come only from the tops of owned games, which bounds the
+  // work by the size of the library rather than the catalog
+  Candidates candidates = {
+      owned,
+      malloc((bitmap_cardinality(owned) * RECOMMEND_TOP_K + 1) * sizeof(Pair)),
+      0};
+  cJSON *json = cJSON_CreateArray();
+  if (!candidates.candidates || !json) {
+    free(candidates.candidates);
+    cJSON_Delete(json);
+    return NULL;
+  }
+
+  pthread_rwlock_rdlock(&recommend_lock);
+  bitmap_for_each(owned, collect_candidates, &candidates);
+  pthread_rwlock_unlock(&recommend_lock);
+
+  // Sum each candidate's counts across the owned games it appeared for
+  Pair *pairs = candidates.candidates;
+  size_t length = 0;
+  qsort(pairs, candidates.length, sizeof(Pair), compare_ids);
+  for (size_t i = 0; i < candidates.length; i++) {
+    if (length > 0 && pairs[length - 1].id == pairs[i].id) {
+      pairs[length - 1].count += pairs[i].count;
+    } else {
+      pairs[length++] = pairs[i];
+    }
+  }
+  qsort(pairs, length, sizeof(Pair), compare_ranks);
+
+  for (size_t i = 0; i < length && i < limit; i++) {
+    cJSON *entry = cJSON_CreateObject();
+    cJSON_AddNumberToObject(entry, "game_id", pairs[i].id);
+    cJSON_AddNumberToObject(entry, "score", pairs[i].count);
+    cJSON_AddItemToArray(json, entry);
+  }
+
+  free(pairs);
+  return json;
+}
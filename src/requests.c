@@ -1,23 +1,45 @@
 #include "requests.h"
+#include "autocomplete.h"
 #include "cJSON.h"
+#include "config.h"
 #include "db.h"
+#include "facets.h"
+#include "hash_pool.h"
 #include "http.h"
+#include "leaderboard.h"
+#include "metrics.h"
+#include "ownership.h"
+#include "pubsub.h"
+#include "recommend.h"
+#include "scheduler.h"
+#include "session.h"
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-cJSON *get_required_field(cJSON *json, const char *field_name, char **response,
-                          int socket)
+// The API's view of a game: price_cents is derived for filtering only, and
+// its position differs between fresh and migrated databases
+#define GAME_COLUMNS                                                           \
+  "Games.game_id, Games.added_by, Games.title, Games.description, "            \
+  "Games.price, Games.genre, Games.cover_image, Games.icon_image, "            \
+  "Games.release_date, Games.developer"
+
+cJSON *get_required_field(cJSON *json, const char *field_name, char **response)
 {
   cJSON *field = cJSON_GetObjectItem(json, field_name);
   if (!field) {
     char error_message[256];
     sprintf(error_message, "{\"error\": \"Missing required field: %s.\"}",
             field_name);
-    *response = construct_response(BAD_REQUEST, error_message);
-    send(socket, *response, strlen(*response), 0);
+    // handle_request sends *response, so the first missing field is reported
+    if (!*response) {
+      *response = construct_response(BAD_REQUEST, error_message);
+    }
     return NULL;
   }
   return field;
@@ -55,12 +77,27 @@ char *format_sql_query(const char *temp, ...)
   return query;
 }
 
-void handle_error(const char *message, char **response, int socket)
+void handle_error(const char *message, char **response)
 {
   fprintf(stderr, "ERROR: %s\n", message);
+  free(*response);
   *response = construct_response(
       INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
-  send(socket, *response, strlen(*response), 0);
+}
+
+// Hashes on the hash pool; on failure *response says why
+static int hash_password(const char *password, const char *setting,
+                         char *hashed, size_t size, char **response)
+{
+  int rc = hash_pool_hash(password, setting, hashed, size);
+  if (rc == HASH_POOL_BUSY) {
+    *response = construct_response_with_headers(
+        SERVICE_UNAVAILABLE, "Retry-After: 1\r\n",
+        "{\"error\": \"Server is busy, try again later.\"}");
+  } else if (rc < 0) {
+    handle_error("Failed to hash password.", response);
+  }
+  return rc;
 }
 
 void construct_json_response(cJSON *json, int code, char **response)
@@ -75,54 +112,792 @@ void construct_json_response(cJSON *json, int code, char **response)
   }
 }
 
+// Serialize json once for every subscriber of topic. A replaceable event
+// carries the latest state, so a newer one may overtake it in a send queue.
+static void publish_json(const char *topic, const char *event, cJSON *json,
+                         int replaceable)
+{
+  char *data = json ? cJSON_PrintUnformatted(json) : NULL;
+  if (data) {
+    pubsub_publish(topic, message_event(topic, event, data, replaceable));
+  }
+  free(data);
+}
+
+// Publish the row select_sql finds for id
+static void publish_row(sqlite3 *db, const char *select_sql, long id,
+                        const char *topic, const char *event, int replaceable)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to load %s event: %s\n", event,
+            sqlite3_errmsg(db));
+    return;
+  }
+  sqlite3_bind_int64(stmt, 1, id);
+
+  cJSON *json =
+      sqlite3_step(stmt) == SQLITE_ROW ? db_row_to_object(stmt) : NULL;
+  sqlite3_finalize(stmt);
+  publish_json(topic, event, json, replaceable);
+  cJSON_Delete(json);
+}
+
+// Parse a decimal price such as "9.99" into cents
+static int parse_price_cents(const char *str, long *cents)
+{
+  if (!str || *str == '\0') {
+    return 0;
+  }
+
+  char *endptr;
+  double price = strtod(str, &endptr);
+  if (*endptr != '\0' || !isfinite(price) || price < 0 ||
+      price >= (double)LONG_MAX / 100) {
+    return 0;
+  }
+
+  *cents = (long)(price * 100 + 0.5);
+  return 1;
+}
+
+static void append_filter(char *sql, const char *value, const char *condition,
+                          int *has_filters)
+{
+  if (!value) {
+    return;
+  }
+  strcat(sql, *has_filters ? " AND " : " WHERE ");
+  strcat(sql, condition);
+  (*has_filters)++;
+}
+
+static void bind_text_param(sqlite3_stmt *stmt, const char *name,
+                            const char *value)
+{
+  int index = sqlite3_bind_parameter_index(stmt, name);
+  if (index > 0) {
+    sqlite3_bind_text(stmt, index, value, -1, SQLITE_STATIC);
+  }
+}
+
+static void bind_int_param(sqlite3_stmt *stmt, const char *name, long value)
+{
+  int index = sqlite3_bind_parameter_index(stmt, name);
+  if (index > 0) {
+    sqlite3_bind_int64(stmt, index, value);
+  }
+}
+
+// Write the rows of stmt as a JSON array into the stream, one row at a time.
+// decorate, if given, can add fields to each row before it is serialized.
+static int stream_json_rows(sqlite3_stmt *stmt, ResponseStream *stream,
+                            void (*decorate)(cJSON *, sqlite3_stmt *, void *),
+                            void *data, long *rows)
+{
+  *rows = 0;
+  if (stream_write(stream, "[", 1) < 0) {
+    return SQLITE_IOERR;
+  }
+
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    cJSON *json_row = db_row_to_object(stmt);
+    if (!json_row) {
+      return SQLITE_NOMEM;
+    }
+    if (decorate) {
+      decorate(json_row, stmt, data);
+    }
+
+    char *json_string = cJSON_PrintUnformatted(json_row);
+    cJSON_Delete(json_row);
+    if (!json_string) {
+      return SQLITE_NOMEM;
+    }
+
+    int failed = (*rows > 0 && stream_write(stream, ",", 1) < 0) ||
+                 stream_write(stream, json_string, strlen(json_string)) < 0;
+    free(json_string);
+    if (failed) {
+      return SQLITE_IOERR;
+    }
+    (*rows)++;
+  }
+
+  if (rc == SQLITE_DONE && stream_write(stream, "]", 1) < 0) {
+    return SQLITE_IOERR;
+  }
+  return rc;
+}
+
+static void add_has_game(cJSON *json_row, sqlite3_stmt *stmt, void *owned)
+{
+  uint32_t game_id = (uint32_t)sqlite3_column_int64(stmt, 0);
+  cJSON_AddStringToObject(json_row, "has_game",
+                          bitmap_contains(owned, game_id) ? "1" : "0");
+}
+
 void request_get_games(sqlite3 *db, QueryParams *query, char **response,
-                       char **err_msg)
-{
-  char *select_sql = malloc(1024);
-  strcpy(select_sql, "SELECT * FROM Games;");
-
-  if (query->count > 0) {
-    char *user_id = query->values[0];
-    if (user_id && strcmp(query->keys[0], "user_id") == 0) {
-      printf("User ID: %s\n", user_id);
-      sprintf(select_sql,
-              "SELECT Games.*, "
-              "CASE WHEN Libraries.library_id IS NOT NULL THEN 1 ELSE 0 END "
-              "AS has_game "
-              "FROM Games "
-              "LEFT JOIN Libraries ON Games.game_id = Libraries.game_id AND "
-              "Libraries.user_id = '%s';",
-              user_id);
+                       int socket)
+{
+  char *user_id = get_query_value(query, "user_id");
+  char *genre = get_query_value(query, "genre");
+  char *developer = get_query_value(query, "developer");
+  char *min_price = get_query_value(query, "min_price");
+  char *max_price = get_query_value(query, "max_price");
+  char *released_after = get_query_value(query, "released_after");
+
+  long min_price_cents = 0, max_price_cents = 0;
+  if ((min_price && !parse_price_cents(min_price, &min_price_cents)) ||
+      (max_price && !parse_price_cents(max_price, &max_price_cents))) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid price filter.\"}");
+    return;
+  }
+
+  // has_game is answered from the cached library instead of a join
+  Bitmap owned;
+  bitmap_init(&owned);
+  if (user_id) {
+    printf("User ID: %s\n", user_id);
+    if (ownership_get(db, strtol(user_id, NULL, 10), &owned) < 0) {
+      *response = construct_response(
+          INTERNAL_SERVER_ERROR,
+          "{\"error\": \"An internal error occurred.\"}");
+      return;
+    }
+  }
+
+  char select_sql[1024];
+  strcpy(select_sql, "SELECT " GAME_COLUMNS " FROM Games");
+
+  int has_filters = 0;
+  append_filter(select_sql, genre, "Games.genre = :genre", &has_filters);
+  append_filter(select_sql, developer, "Games.developer = :developer",
+                &has_filters);
+  append_filter(select_sql, min_price, "Games.price_cents >= :min_price",
+                &has_filters);
+  append_filter(select_sql, max_price, "Games.price_cents <= :max_price",
+                &has_filters);
+  append_filter(select_sql, released_after,
+                "Games.release_date > :released_after", &has_filters);
+  strcat(select_sql, ";");
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to prepare games query: %s\n",
+            sqlite3_errmsg(db));
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    bitmap_free(&owned);
+    return;
+  }
+
+  bind_text_param(stmt, ":genre", genre);
+  bind_text_param(stmt, ":developer", developer);
+  bind_int_param(stmt, ":min_price", min_price_cents);
+  bind_int_param(stmt, ":max_price", max_price_cents);
+  bind_text_param(stmt, ":released_after", released_after);
+
+  ResponseStream stream;
+  stream_init(&stream, socket);
+
+  long rows;
+  int rc = stream_json_rows(stmt, &stream, user_id ? add_has_game : NULL,
+                            &owned, &rows);
+  if (rc == SQLITE_DONE) {
+    printf("LOG: Fetched %ld games\n", rows);
+    stream_finish(&stream, response);
+  } else {
+    fprintf(stderr, "ERROR: Failed to fetch games: %s\n", sqlite3_errmsg(db));
+    stream_fail(&stream, INTERNAL_SERVER_ERROR,
+                "{\"error\": \"An internal error occurred.\"}", response);
+  }
+
+  sqlite3_finalize(stmt);
+  bitmap_free(&owned);
+}
+
+// Turn free text into an FTS5 query: every word becomes a quoted prefix term
+static char *build_search_match(const char *text)
+{
+  size_t text_length = strlen(text);
+  char *match = malloc(text_length * 4 + 1);
+  if (!match) {
+    return NULL;
+  }
+
+  size_t match_length = 0;
+  const unsigned char *p = (const unsigned char *)text;
+  while (*p) {
+    while (*p && !isalnum(*p) && *p < 0x80) {
+      p++;
+    }
+    if (!*p) {
+      break;
+    }
+
+    if (match_length > 0) {
+      match[match_length++] = ' ';
     }
+    match[match_length++] = '"';
+    while (*p && (isalnum(*p) || *p >= 0x80)) {
+      match[match_length++] = *p++;
+    }
+    match[match_length++] = '"';
+    match[match_length++] = '*';
+  }
+  match[match_length] = '\0';
+
+  if (match_length == 0) {
+    free(match);
+    return NULL;
+  }
+  return match;
+}
+
+void request_search_games(sqlite3 *db, QueryParams *query, char **response)
+{
+  char *text = get_query_value(query, "q");
+  char *match = text ? build_search_match(text) : NULL;
+  if (!match) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Missing required query: q.\"}");
+    return;
   }
 
+  long limit = get_query_long(query, "limit", SEARCH_DEFAULT_LIMIT);
+  if (limit < 1) {
+    free(match);
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid search limit.\"}");
+    return;
+  }
+  if (limit > SEARCH_MAX_LIMIT) {
+    limit = SEARCH_MAX_LIMIT;
+  }
+
+  // bm25 weights: title, description, developer, genre
+  const char *select_sql =
+      "SELECT " GAME_COLUMNS " FROM Games_Search "
+      "INNER JOIN Games ON Games.game_id = Games_Search.rowid "
+      "WHERE Games_Search MATCH ?1 "
+      "ORDER BY bm25(Games_Search, 10.0, 1.0, 4.0, 2.0) "
+      "LIMIT ?2;";
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to prepare search: %s\n",
+            sqlite3_errmsg(db));
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    free(match);
+    return;
+  }
+
+  sqlite3_bind_text(stmt, 1, match, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, limit);
+
   cJSON *json_array = cJSON_CreateArray();
   if (!json_array) {
     fprintf(stderr, "ERROR: Failed to create JSON array.\n");
+    sqlite3_finalize(stmt);
+    free(match);
     return;
   }
 
-  db_request(db, select_sql, callback_array, json_array, err_msg,
-             "Fetched all games");
+  if (db_step_array(stmt, json_array) == SQLITE_OK) {
+    printf("LOG: Searched games for %s\n", match);
+    construct_json_response(json_array, SUCCESS, response);
+  } else {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+  }
 
-  char *json_string = cJSON_PrintUnformatted(json_array);
+  cJSON_Delete(json_array);
+  sqlite3_finalize(stmt);
+  free(match);
+}
 
-  if (json_string) {
-    *response = construct_response(SUCCESS, json_string);
-    free(json_string);
+void request_get_autocomplete(QueryParams *query, char **response)
+{
+  char *prefix = get_query_value(query, "prefix");
+  if (!prefix) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Missing required query: prefix.\"}");
+    return;
+  }
+
+  long limit = get_query_long(query, "limit", AUTOCOMPLETE_DEFAULT_LIMIT);
+  if (limit < 1) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid autocomplete limit.\"}");
+    return;
+  }
+  if (limit > AUTOCOMPLETE_MAX_LIMIT) {
+    limit = AUTOCOMPLETE_MAX_LIMIT;
+  }
+
+  cJSON *json_array = autocomplete_query(prefix, limit);
+  if (!json_array) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  construct_json_response(json_array, SUCCESS, response);
+  cJSON_Delete(json_array);
+}
+
+void request_get_facets(QueryParams *query, char **response)
+{
+  cJSON *json = facets_query(get_query_value(query, "genre"),
+                             get_query_value(query, "developer"),
+                             get_query_value(query, "price"));
+  if (!json) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  construct_json_response(json, SUCCESS, response);
+  cJSON_Delete(json);
+}
+
+// Query parameters shared by the leaderboard routes; a missing game_id
+// selects the global board
+// game_id query parameter: -1 for the global board when absent, 0 if invalid
+static long leaderboard_game_id(QueryParams *query)
+{
+  const char *game_id = get_query_value(query, "game_id");
+  if (!game_id) {
+    return -1;
+  }
+  if (!is_integer(game_id)) {
+    return 0;
+  }
+  long value = strtol(game_id, NULL, 10);
+  return value > 0 && value < LONG_MAX ? value : 0;
+}
+
+void request_get_leaderboard(QueryParams *query, char **response)
+{
+  long limit = LEADERBOARD_DEFAULT_LIMIT;
+  const char *limit_value = get_query_value(query, "limit");
+  if (limit_value) {
+    limit = strtol(limit_value, NULL, 10);
+  }
+  if (limit <= 0 || limit > LEADERBOARD_MAX_LIMIT) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid leaderboard limit.\"}");
+    return;
+  }
+
+  long game_id = leaderboard_game_id(query);
+  if (!game_id) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid leaderboard game_id.\"}");
+    return;
+  }
+
+  cJSON *json = leaderboard_top(game_id, (size_t)limit);
+  if (!json) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  construct_json_response(json, SUCCESS, response);
+  cJSON_Delete(json);
+}
+
+void request_get_my_rank(long user_id, QueryParams *query, char **response)
+{
+  long game_id = leaderboard_game_id(query);
+  if (!game_id) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid leaderboard game_id.\"}");
+    return;
+  }
+
+  cJSON *json = leaderboard_rank(game_id, user_id);
+  if (!json) {
+    *response = construct_response(
+        NOT_FOUND, "{\"error\": \"User is not ranked.\"}");
+    return;
+  }
+
+  construct_json_response(json, SUCCESS, response);
+  cJSON_Delete(json);
+}
+
+// limit query parameter for the recommendation routes, or 0 if invalid
+static long recommend_limit(QueryParams *query)
+{
+  long limit = RECOMMEND_DEFAULT_LIMIT;
+  const char *limit_value = get_query_value(query, "limit");
+  if (limit_value) {
+    limit = strtol(limit_value, NULL, 10);
+  }
+  return limit > 0 && limit <= RECOMMEND_TOP_K ? limit : 0;
+}
+
+static int check_recommend_ready(char **response)
+{
+  if (recommend_ready()) {
+    return 1;
+  }
+  *response = construct_response_with_headers(
+      SERVICE_UNAVAILABLE, "Retry-After: 5\r\n",
+      "{\"error\": \"Recommendations are still being built.\"}");
+  return 0;
+}
+
+void request_get_similar_games(char *id, QueryParams *query, char **response)
+{
+  long limit = recommend_limit(query);
+  if (!limit) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid recommendation limit.\"}");
+    return;
+  }
+  if (!check_recommend_ready(response)) {
+    return;
+  }
+
+  cJSON *json = recommend_similar(strtol(id, NULL, 10), (size_t)limit);
+  if (!json) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  construct_json_response(json, SUCCESS, response);
+  cJSON_Delete(json);
+}
+
+void request_get_recommendations(sqlite3 *db, long user_id, QueryParams *query,
+                                 char **response)
+{
+  long limit = recommend_limit(query);
+  if (!limit) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid recommendation limit.\"}");
+    return;
+  }
+  if (!check_recommend_ready(response)) {
+    return;
+  }
+
+  Bitmap owned;
+  if (ownership_get(db, user_id, &owned) < 0) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+  cJSON *json = recommend_for_user(&owned, (size_t)limit);
+  bitmap_free(&owned);
+  if (!json) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  construct_json_response(json, SUCCESS, response);
+  cJSON_Delete(json);
+}
+
+void request_get_achievement_summary(sqlite3 *db, long user_id,
+                                     char **response)
+{
+  Bitmap owned;
+  if (ownership_get(db, user_id, &owned) < 0) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  cJSON *json_array = leaderboard_summary(user_id, &owned);
+  bitmap_free(&owned);
+  if (!json_array) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  construct_json_response(json_array, SUCCESS, response);
+  cJSON_Delete(json_array);
+}
+
+void request_get_metrics(char **response)
+{
+  cJSON *json = metrics_to_json();
+  cJSON *tasks = json ? scheduler_stats() : NULL;
+  if (!tasks) {
+    cJSON_Delete(json);
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+  cJSON_AddItemToObject(json, "tasks", tasks);
+
+  construct_json_response(json, SUCCESS, response);
+  cJSON_Delete(json);
+}
+
+// Stream a whole table as NDJSON over chunked encoding. Rows are stepped one
+// at a time on the read-only snapshot connection the route is served on, so
+// memory stays at one row plus the chunk buffer no matter how large the
+// table is.
+void request_get_export(sqlite3 *db, char *table, char **response, int socket)
+{
+  static const char *const tables[][3] = {
+      {"games", "Games", "SELECT " GAME_COLUMNS " FROM Games;"},
+      {"reviews", "Reviews", "SELECT * FROM Reviews;"},
+      {"libraries", "Libraries", "SELECT * FROM Libraries;"},
+      {"achievements", "Achievements", "SELECT * FROM Achievements;"},
+  };
+
+  const char *table_name = NULL;
+  const char *select_sql = NULL;
+  for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+    if (table && strcmp(table, tables[i][0]) == 0) {
+      table_name = tables[i][1];
+      select_sql = tables[i][2];
+      break;
+    }
+  }
+  if (!table_name) {
+    *response = construct_response(NOT_FOUND,
+                                   "{\"error\": \"Unknown export table.\"}");
+    return;
+  }
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to prepare export: %s\n",
+            sqlite3_errmsg(db));
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  ChunkedWriter writer;
+  long rows = 0;
+  int rc = SQLITE_DONE;
+  if (chunked_begin(&writer, socket, SUCCESS, "application/x-ndjson") == 0) {
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      cJSON *json_row = db_row_to_object(stmt);
+      char *line = json_row ? cJSON_PrintUnformatted(json_row) : NULL;
+      cJSON_Delete(json_row);
+      if (!line) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+
+      int failed = chunked_write(&writer, line, strlen(line)) < 0 ||
+                   chunked_write(&writer, "\n", 1) < 0;
+      free(line);
+      if (failed) {
+        break;
+      }
+      rows++;
+    }
+
+    // Ending the stream cleanly would tell the client the export is whole;
+    // on a database error the connection is dropped without the last chunk
+    if (rc == SQLITE_DONE) {
+      chunked_end(&writer);
+    }
+  }
+
+  if (writer.failed) {
+    fprintf(stderr, "ERROR: Client went away during %s export\n", table_name);
+  } else if (rc != SQLITE_DONE) {
+    fprintf(stderr, "ERROR: Failed to export %s: %s\n", table_name,
+            sqlite3_errmsg(db));
   } else {
+    printf("LOG: Exported %ld rows from %s\n", rows, table_name);
+  }
+
+  sqlite3_finalize(stmt);
+}
+
+// Turn "1,2,3" into the JSON array "[1,2,3]" for json_each; NULL if the
+// list is malformed, empty or longer than MAX_BATCH_IDS.
+static char *parse_id_list(const char *ids)
+{
+  size_t length = strlen(ids);
+  char *json_ids = malloc(length + 3);
+  if (!json_ids) {
+    return NULL;
+  }
+
+  size_t count = 0, out = 0;
+  const char *p = ids;
+  json_ids[out++] = '[';
+  while (*p) {
+    size_t digits = strspn(p, "0123456789");
+    if (digits == 0 || digits > 18 || ++count > MAX_BATCH_IDS ||
+        (p[digits] != ',' && p[digits] != '\0')) {
+      free(json_ids);
+      return NULL;
+    }
+    if (count > 1) {
+      json_ids[out++] = ',';
+    }
+    memcpy(json_ids + out, p, digits);
+    out += digits;
+    p += digits;
+    if (*p == ',') {
+      p++;
+      if (*p == '\0') {
+        free(json_ids);
+        return NULL;
+      }
+    }
+  }
+  json_ids[out++] = ']';
+  json_ids[out] = '\0';
+
+  if (count == 0) {
+    free(json_ids);
+    return NULL;
+  }
+  return json_ids;
+}
+
+// Resolve every id in one statement; rows come back in request order and a
+// missing id leaves a null in its slot.
+static void get_rows_by_ids(sqlite3 *db, const char *table,
+                            const char *id_column, QueryParams *query,
+                            char **response)
+{
+  char *json_ids = parse_id_list(get_query_value(query, "ids"));
+  if (!json_ids) {
+    char error_message[128];
+    snprintf(error_message, sizeof(error_message),
+             "{\"error\": \"ids must be 1 to %d comma-separated integers.\"}",
+             MAX_BATCH_IDS);
+    *response = construct_response(BAD_REQUEST, error_message);
+    return;
+  }
+
+  char *select_sql = format_sql_query(
+      "SELECT %s.* FROM json_each(?1) AS ids "
+      "LEFT JOIN %s ON %s.%s = ids.value "
+      "ORDER BY ids.key;",
+      table, table, table, id_column);
+
+  sqlite3_stmt *stmt;
+  if (!select_sql ||
+      sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to prepare batch lookup: %s\n",
+            sqlite3_errmsg(db));
     *response = construct_response(
-        INTERNAL_SERVER_ERROR, "{\"error\": \"Failed to serialize JSON.\"}");
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    free(select_sql);
+    free(json_ids);
+    return;
+  }
+  sqlite3_bind_text(stmt, 1, json_ids, -1, SQLITE_STATIC);
+
+  cJSON *json_array = cJSON_CreateArray();
+  if (!json_array) {
+    fprintf(stderr, "ERROR: Failed to create JSON array.\n");
+    sqlite3_finalize(stmt);
+    free(select_sql);
+    free(json_ids);
+    return;
+  }
+
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    cJSON *json_row = sqlite3_column_type(stmt, 0) == SQLITE_NULL
+                          ? cJSON_CreateNull()
+                          : db_row_to_object(stmt);
+    if (!json_row) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    cJSON_AddItemToArray(json_array, json_row);
+  }
+
+  if (rc == SQLITE_DONE) {
+    printf("LOG: Fetched %s by ids\n", table);
+    construct_json_response(json_array, SUCCESS, response);
+  } else {
+    fprintf(stderr, "ERROR: Failed to fetch %s: %s\n", table,
+            sqlite3_errmsg(db));
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
   }
 
   cJSON_Delete(json_array);
+  sqlite3_finalize(stmt);
+  free(select_sql);
+  free(json_ids);
+}
+
+void request_get_games_by_ids(sqlite3 *db, QueryParams *query, char **response)
+{
+  get_rows_by_ids(db, "Games", "game_id", query, response);
+}
+
+// Read the precomputed aggregates; reviews themselves are never scanned here
+static cJSON *get_review_summary(sqlite3 *db, const char *game_id)
+{
+  const char *select_sql =
+      "SELECT review_count, rating_sum, rating_1, rating_2, rating_3, "
+      "rating_4, rating_5 FROM Review_Stats WHERE game_id = ?1;";
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to prepare review summary: %s\n",
+            sqlite3_errmsg(db));
+    return NULL;
+  }
+  sqlite3_bind_text(stmt, 1, game_id, -1, SQLITE_STATIC);
+
+  long stats[7] = {0};
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    for (int i = 0; i < 7; i++) {
+      stats[i] = sqlite3_column_int64(stmt, i);
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    return NULL;
+  }
+
+  cJSON *summary = cJSON_CreateObject();
+  cJSON *histogram = cJSON_CreateObject();
+  if (!summary || !histogram) {
+    cJSON_Delete(summary);
+    cJSON_Delete(histogram);
+    return NULL;
+  }
+
+  cJSON_AddNumberToObject(summary, "review_count", stats[0]);
+  cJSON_AddNumberToObject(summary, "average_rating",
+                          stats[0] ? (double)stats[1] / stats[0] : 0);
+  for (int rating = 1; rating <= 5; rating++) {
+    char key[2] = {(char)('0' + rating), '\0'};
+    cJSON_AddNumberToObject(histogram, key, stats[rating + 1]);
+  }
+  cJSON_AddItemToObject(summary, "histogram", histogram);
+
+  return summary;
 }
 
 void request_get_game_by_id(sqlite3 *db, char *id, char **response,
                             char **err_msg)
 {
   char *select_sql =
-      format_sql_query("SELECT * FROM Games WHERE game_id = %s;", id);
+      format_sql_query(
+          "SELECT " GAME_COLUMNS " FROM Games WHERE game_id = %s;", id);
 
   cJSON *json = cJSON_CreateObject();
   if (!json) {
@@ -136,24 +911,307 @@ void request_get_game_by_id(sqlite3 *db, char *id, char **response,
   if (cJSON_GetArraySize(json) == 0) {
     response_code = NOT_FOUND;
     cJSON_AddStringToObject(json, "error", "Game not found.");
+  } else {
+    cJSON *summary = get_review_summary(db, id);
+    if (summary) {
+      cJSON_AddItemToObject(json, "review_summary", summary);
+    }
+  }
+
+  char *json_string = cJSON_PrintUnformatted(json);
+
+  if (json_string) {
+    *response = construct_response(response_code, json_string);
+    free(json_string);
+  } else {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"Failed to serialize JSON.\"}");
+  }
+
+  cJSON_Delete(json);
+  free(select_sql);
+}
+
+typedef struct {
+  const char *name;
+  int is_integer;
+} BulkField;
+
+// Validate one array element against the field list and bind it in order
+static const char *bind_bulk_item(sqlite3_stmt *stmt, cJSON *item,
+                                  const BulkField *fields, int field_count)
+{
+  if (!cJSON_IsObject(item)) {
+    return "Item is not an object.";
+  }
+
+  for (int i = 0; i < field_count; i++) {
+    cJSON *value = cJSON_GetObjectItem(item, fields[i].name);
+    if (fields[i].is_integer && cJSON_IsNumber(value)) {
+      sqlite3_bind_int64(stmt, i + 1, (sqlite3_int64)value->valuedouble);
+    } else if (!fields[i].is_integer && cJSON_IsString(value)) {
+      sqlite3_bind_text(stmt, i + 1, value->valuestring, -1, SQLITE_STATIC);
+    } else {
+      return fields[i].name;
+    }
+  }
+  return NULL;
+}
+
+// Bulk items come either from a parsed JSON array or one per line from an
+// NDJSON body that is still arriving
+typedef struct {
+  cJSON *items;
+  BodyReader *reader;
+} BulkSource;
+
+// 1 with the next item in *item (NULL if the line was not valid JSON), 0 at
+// the end of the input, -1 if the body could not be read
+static int bulk_next(BulkSource *source, cJSON **item)
+{
+  if (source->items) {
+    if (!source->items->child) {
+      return 0;
+    }
+    *item = cJSON_DetachItemViaPointer(source->items, source->items->child);
+    return 1;
+  }
+
+  char *line;
+  while ((line = body_read_line(source->reader))) {
+    line += strspn(line, " \t\r");
+    if (*line != '\0') {
+      *item = cJSON_Parse(line);
+      return 1;
+    }
+  }
+  return source->reader->failed ? -1 : 0;
+}
+
+// Insert one batch in its own transaction with a single prepared statement.
+// Each item gets its own result entry; items that fail validation or
+// constraints are skipped without aborting the batch. Returns 0 once the
+// batch is committed, -1 if it was rolled back.
+static int insert_bulk_batch(sqlite3 *db, sqlite3_stmt *stmt, cJSON **batch,
+                             int count, long first_index,
+                             const BulkField *fields, int field_count,
+                             void (*on_inserted)(sqlite3 *, long),
+                             cJSON *results, long *inserted)
+{
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, NULL) != SQLITE_OK) {
+    return -1;
+  }
+
+  // Index updates wait for COMMIT, so only the new ids are kept meanwhile
+  long *inserted_ids = on_inserted ? malloc(count * sizeof(long)) : NULL;
+  int failed = on_inserted && !inserted_ids;
+  int batch_inserted = 0;
+  for (int i = 0; i < count && !failed; i++) {
+    cJSON *item = batch[i];
+    cJSON *result = cJSON_CreateObject();
+    cJSON_AddNumberToObject(result, "index", first_index + i);
+
+    const char *invalid = item ? bind_bulk_item(stmt, item, fields, field_count)
+                               : "Invalid JSON.";
+    if (invalid) {
+      char error_message[96];
+      if (cJSON_IsObject(item)) {
+        snprintf(error_message, sizeof(error_message),
+                 "Missing or invalid field: %s", invalid);
+        invalid = error_message;
+      }
+      cJSON_AddStringToObject(result, "error", invalid);
+    } else if (sqlite3_step(stmt) == SQLITE_DONE) {
+      long id = (long)sqlite3_last_insert_rowid(db);
+      cJSON_AddNumberToObject(result, "id", (double)id);
+      if (inserted_ids) {
+        inserted_ids[batch_inserted] = id;
+      }
+      batch_inserted++;
+    } else {
+      cJSON_AddStringToObject(result, "error", sqlite3_errmsg(db));
+    }
+    cJSON_AddItemToArray(results, result);
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  }
+
+  if (failed || sqlite3_exec(db, "COMMIT;", 0, 0, NULL) != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+    free(inserted_ids);
+    return -1;
+  }
+
+  for (int i = 0; inserted_ids && i < batch_inserted; i++) {
+    on_inserted(db, inserted_ids[i]);
+  }
+  free(inserted_ids);
+  *inserted += batch_inserted;
+  return 0;
+}
+
+// Write the collected result entries, comma separated after any already
+// written
+static int write_bulk_results(ResponseStream *stream, cJSON *results,
+                              long written)
+{
+  cJSON *result;
+  cJSON_ArrayForEach(result, results)
+  {
+    char *json_string = cJSON_PrintUnformatted(result);
+    int failed = !json_string ||
+                 (written > 0 && stream_write(stream, ",", 1) < 0) ||
+                 stream_write(stream, json_string, strlen(json_string)) < 0;
+    free(json_string);
+    if (failed) {
+      return -1;
+    }
+    written++;
+  }
+  return 0;
+}
+
+// A JSON array body is already in memory and commits as one batch. An NDJSON
+// body is read BULK_BATCH_ITEMS lines at a time with no transaction open, so
+// a slow upload never holds the write lock; each batch commits on its own
+// and its results are written only after that COMMIT. If a later batch
+// fails, the batches before it stay committed and the error reports how
+// many rows were inserted.
+static void request_post_bulk(sqlite3 *db, char *body, BodyReader *reader,
+                              char **response, int socket,
+                              const char *insert_sql, const BulkField *fields,
+                              int field_count,
+                              void (*on_inserted)(sqlite3 *, long))
+{
+  BulkSource source = {NULL, reader};
+  int batch_size = BULK_BATCH_ITEMS;
+  if (body) {
+    source.items = cJSON_Parse(body);
+    if (!cJSON_IsArray(source.items)) {
+      *response = construct_response(
+          BAD_REQUEST, "{\"error\": \"Request body must be a JSON array.\"}");
+      cJSON_Delete(source.items);
+      return;
+    }
+
+    batch_size = cJSON_GetArraySize(source.items);
+    if (batch_size == 0 || batch_size > MAX_BULK_ITEMS) {
+      char error_message[96];
+      snprintf(error_message, sizeof(error_message),
+               "{\"error\": \"Expected 1 to %d items.\"}", MAX_BULK_ITEMS);
+      *response = construct_response(BAD_REQUEST, error_message);
+      cJSON_Delete(source.items);
+      return;
+    }
+  }
+
+  sqlite3_stmt *stmt;
+  cJSON **batch = malloc(batch_size * sizeof(cJSON *));
+  if (!batch ||
+      sqlite3_prepare_v2(db, insert_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to start bulk insert: %s\n",
+            sqlite3_errmsg(db));
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    free(batch);
+    cJSON_Delete(source.items);
+    return;
+  }
+
+  ResponseStream stream;
+  stream_init(&stream, socket);
+  int failed = stream_write(&stream, "{\"results\":[", 12) < 0;
+
+  long index = 0, inserted = 0;
+  int status = 1;
+  while (!failed && status > 0) {
+    int count = 0;
+    while (count < batch_size &&
+           (status = bulk_next(&source, &batch[count])) > 0) {
+      count++;
+    }
+    if (status < 0 || count == 0) {
+      break;
+    }
+
+    cJSON *results = cJSON_CreateArray();
+    failed = !results ||
+             insert_bulk_batch(db, stmt, batch, count, index, fields,
+                               field_count, on_inserted, results,
+                               &inserted) < 0 ||
+             write_bulk_results(&stream, results, index) < 0;
+    cJSON_Delete(results);
+    for (int i = 0; i < count; i++) {
+      cJSON_Delete(batch[i]);
+    }
+    index += count;
+  }
+  sqlite3_finalize(stmt);
+  free(batch);
+  cJSON_Delete(source.items);
+
+  if (failed || status < 0) {
+    fprintf(stderr, "ERROR: Bulk insert aborted after %ld items: %s\n", index,
+            status < 0 ? "unreadable request body" : sqlite3_errmsg(db));
+    char error_message[96];
+    snprintf(error_message, sizeof(error_message),
+             "{\"error\": \"%s\", \"inserted\": %ld}",
+             status < 0 ? "Malformed request body."
+                        : "An internal error occurred.",
+             inserted);
+    stream_fail(&stream, status < 0 ? BAD_REQUEST : INTERNAL_SERVER_ERROR,
+                error_message, response);
+    return;
   }
 
-  char *json_string = cJSON_PrintUnformatted(json);
+  printf("LOG: Bulk inserted %ld of %ld rows\n", inserted, index);
 
-  if (json_string) {
-    *response = construct_response(response_code, json_string);
-    free(json_string);
-  } else {
-    *response = construct_response(
-        INTERNAL_SERVER_ERROR, "{\"error\": \"Failed to serialize JSON.\"}");
+  char summary[96];
+  snprintf(summary, sizeof(summary), "],\"inserted\":%ld,\"failed\":%ld}",
+           inserted, index - inserted);
+  if (stream_write(&stream, summary, strlen(summary)) < 0) {
+    stream_fail(&stream, INTERNAL_SERVER_ERROR,
+                "{\"error\": \"An internal error occurred.\"}", response);
+    return;
   }
+  stream_finish(&stream, response);
+}
 
-  cJSON_Delete(json);
-  free(select_sql);
+static void on_game_inserted(sqlite3 *db, long game_id)
+{
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, "SELECT title FROM Games WHERE game_id = ?1;", -1,
+                         &stmt, NULL) != SQLITE_OK) {
+    return;
+  }
+  sqlite3_bind_int64(stmt, 1, game_id);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    autocomplete_insert(game_id, (const char *)sqlite3_column_text(stmt, 0),
+                        0);
+    facets_load_game(db, game_id);
+  }
+  sqlite3_finalize(stmt);
 }
 
-void request_post_game(sqlite3 *db, char *body, char **response, char **err_msg,
-                       int socket)
+void request_post_games_bulk(sqlite3 *db, char *body, BodyReader *reader,
+                             char **response, int socket)
+{
+  static const BulkField fields[] = {
+      {"added_by", 1},   {"title", 0},      {"description", 0},
+      {"price", 0},      {"genre", 0},      {"cover_image", 0},
+      {"icon_image", 0}, {"developer", 0},
+  };
+
+  request_post_bulk(db, body, reader, response, socket,
+                    "INSERT INTO Games (added_by, title, description, price, "
+                    "genre, cover_image, icon_image, developer) "
+                    "VALUES (?, ?, ?, ?, ?, ?, ?, ?);",
+                    fields, sizeof(fields) / sizeof(fields[0]),
+                    on_game_inserted);
+}
+
+void request_post_game(sqlite3 *db, char *body, char **response, char **err_msg)
 {
   cJSON *json = cJSON_Parse(body);
   if (!json) {
@@ -162,16 +1220,14 @@ void request_post_game(sqlite3 *db, char *body, char **response, char **err_msg,
     return;
   }
 
-  cJSON *added_by = get_required_field(json, "added_by", response, socket);
-  cJSON *title = get_required_field(json, "title", response, socket);
-  cJSON *description =
-      get_required_field(json, "description", response, socket);
-  cJSON *price = get_required_field(json, "price", response, socket);
-  cJSON *genre = get_required_field(json, "genre", response, socket);
-  cJSON *cover_image =
-      get_required_field(json, "cover_image", response, socket);
-  cJSON *icon_image = get_required_field(json, "icon_image", response, socket);
-  cJSON *developer = get_required_field(json, "developer", response, socket);
+  cJSON *added_by = get_required_field(json, "added_by", response);
+  cJSON *title = get_required_field(json, "title", response);
+  cJSON *description = get_required_field(json, "description", response);
+  cJSON *price = get_required_field(json, "price", response);
+  cJSON *genre = get_required_field(json, "genre", response);
+  cJSON *cover_image = get_required_field(json, "cover_image", response);
+  cJSON *icon_image = get_required_field(json, "icon_image", response);
+  cJSON *developer = get_required_field(json, "developer", response);
 
   if (!added_by || !title || !genre || !cover_image || !icon_image ||
       !developer) {
@@ -189,12 +1245,19 @@ void request_post_game(sqlite3 *db, char *body, char **response, char **err_msg,
       icon_image->valuestring, developer->valuestring);
 
   if (!insert_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+    handle_error("Failed to format SQL query.", response);
     cJSON_Delete(json);
     return;
   }
 
-  db_request(db, insert_sql, 0, 0, err_msg, "Inserted game");
+  if (db_request(db, insert_sql, 0, 0, err_msg, "Inserted game") ==
+      SQLITE_OK) {
+    long game_id = sqlite3_last_insert_rowid(db);
+    autocomplete_insert(game_id, title->valuestring, 0);
+    facets_load_game(db, game_id);
+    publish_row(db, "SELECT " GAME_COLUMNS " FROM Games WHERE game_id = ?1;",
+                game_id, "catalog", "release", 0);
+  }
 
   *response = construct_response(SUCCESS, "{\"message\": \"Game inserted.\"}");
 
@@ -208,7 +1271,13 @@ void request_delete_game_by_id(sqlite3 *db, char *id, char **response,
   char *delete_sql =
       format_sql_query("DELETE FROM Games WHERE game_id = %s;", id);
 
-  db_request(db, delete_sql, 0, 0, err_msg, "Deleted game by id");
+  if (db_request(db, delete_sql, 0, 0, err_msg, "Deleted game by id") ==
+          SQLITE_OK &&
+      sqlite3_changes(db) > 0) {
+    autocomplete_remove(strtol(id, NULL, 10));
+    facets_remove_game(strtol(id, NULL, 10));
+    recommend_remove_game(strtol(id, NULL, 10));
+  }
 
   *response = construct_response(SUCCESS, "{\"message\": \"Game deleted.\"}");
   free(delete_sql);
@@ -224,8 +1293,9 @@ void request_patch_game_by_id(sqlite3 *db, char *id, char *body,
     return;
   }
 
-  const char *fields[] = {"title",      "genre",        "cover_image",
-                          "icon_image", "release_date", "developer"};
+  const char *fields[] = {"title",       "price",      "genre",
+                          "cover_image", "icon_image", "release_date",
+                          "developer"};
   char *sql = malloc(1024);
   strcpy(sql, "UPDATE Games SET ");
 
@@ -252,6 +1322,20 @@ void request_patch_game_by_id(sqlite3 *db, char *id, char *body,
         construct_response(INTERNAL_SERVER_ERROR,
                            "{\"error\": \"Failed to execute SQL update.\"}");
   } else {
+    cJSON *title = cJSON_GetObjectItem(json, "title");
+    if (sqlite3_changes(db) > 0) {
+      long game_id = strtol(id, NULL, 10);
+      if (cJSON_IsString(title)) {
+        autocomplete_rename(game_id, title->valuestring);
+      }
+      facets_load_game(db, game_id);
+
+      char topic[32];
+      snprintf(topic, sizeof(topic), "game:%ld", game_id);
+      publish_row(db,
+                  "SELECT " GAME_COLUMNS " FROM Games WHERE game_id = ?1;",
+                  game_id, topic, "game", 1);
+    }
     *response = construct_response(SUCCESS, "{\"message\": \"Game updated.\"}");
   }
 
@@ -260,7 +1344,7 @@ void request_patch_game_by_id(sqlite3 *db, char *id, char *body,
 }
 
 void request_post_register(sqlite3 *db, char *body, char **response,
-                           char **err_msg, int socket)
+                           char **err_msg)
 {
   cJSON *json = cJSON_Parse(body);
   if (!json) {
@@ -269,18 +1353,29 @@ void request_post_register(sqlite3 *db, char *body, char **response,
     return;
   }
 
-  cJSON *username = get_required_field(json, "username", response, socket);
-  cJSON *email = get_required_field(json, "email", response, socket);
-  cJSON *password = get_required_field(json, "password", response, socket);
-  cJSON *profile_image =
-      get_required_field(json, "profile_image", response, socket);
+  cJSON *username = get_required_field(json, "username", response);
+  cJSON *email = get_required_field(json, "email", response);
+  cJSON *password = get_required_field(json, "password", response);
+  cJSON *profile_image = get_required_field(json, "profile_image", response);
 
   if (!username || !email || !password || !profile_image) {
     cJSON_Delete(json);
     return;
   }
 
-  char *hashed_password = crypt(password->valuestring, "salt");
+  char setting[64];
+  if (hash_pool_new_setting(setting, sizeof(setting)) < 0) {
+    handle_error("Failed to generate a password salt.", response);
+    cJSON_Delete(json);
+    return;
+  }
+
+  char hashed_password[256];
+  if (hash_password(password->valuestring, setting, hashed_password,
+                    sizeof(hashed_password), response) < 0) {
+    cJSON_Delete(json);
+    return;
+  }
 
   char *insert_sql = format_sql_query(
       "INSERT INTO Users (username, email, password, profile_image) "
@@ -289,7 +1384,7 @@ void request_post_register(sqlite3 *db, char *body, char **response,
       profile_image->valuestring);
 
   if (!insert_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+    handle_error("Failed to format SQL query.", response);
     cJSON_Delete(json);
     return;
   }
@@ -301,7 +1396,7 @@ void request_post_register(sqlite3 *db, char *body, char **response,
       username->valuestring, hashed_password);
 
   if (!login_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+    handle_error("Failed to format SQL query.", response);
     cJSON_Delete(json);
     return;
   }
@@ -338,8 +1433,7 @@ void request_post_register(sqlite3 *db, char *body, char **response,
   free(insert_sql);
 }
 
-void request_post_login(sqlite3 *db, char *body, char **response,
-                        char **err_msg, int socket)
+void request_post_login(sqlite3 *db, char *body, char **response)
 {
   cJSON *json = cJSON_Parse(body);
   if (!json) {
@@ -348,39 +1442,91 @@ void request_post_login(sqlite3 *db, char *body, char **response,
     return;
   }
 
-  cJSON *username = get_required_field(json, "username", response, socket);
-  cJSON *password = get_required_field(json, "password", response, socket);
+  cJSON *username = get_required_field(json, "username", response);
+  cJSON *password = get_required_field(json, "password", response);
 
   if (!username || !password) {
     cJSON_Delete(json);
     return;
   }
 
-  char *hashed_password = crypt(password->valuestring, "salt");
-
-  char *login_sql = format_sql_query(
-      "SELECT * FROM Users WHERE username = '%s' AND password = '%s';",
-      username->valuestring, hashed_password);
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, "SELECT * FROM Users WHERE username = ?1;", -1,
+                         &stmt, NULL) != SQLITE_OK) {
+    handle_error("Failed to prepare login query.", response);
+    cJSON_Delete(json);
+    return;
+  }
+  sqlite3_bind_text(stmt, 1, username->valuestring, -1, SQLITE_TRANSIENT);
 
-  if (!login_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+  cJSON *json_response = NULL;
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    json_response = db_row_to_object(stmt);
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    handle_error("Failed to fetch user.", response);
     cJSON_Delete(json);
     return;
   }
 
-  cJSON *json_response = cJSON_CreateObject();
-  if (!json_response) {
-    fprintf(stderr, "ERROR: Failed to create JSON object.\n");
+  // The stored hash carries its own salt and rounds. Unknown users still pay
+  // for a hash so response times do not reveal which usernames exist.
+  cJSON *stored = cJSON_GetObjectItem(json_response, "password");
+  char setting[256];
+  if (cJSON_IsString(stored)) {
+    snprintf(setting, sizeof(setting), "%s", stored->valuestring);
+  } else {
+    snprintf(setting, sizeof(setting), "$6$rounds=%d$nosuchuser$",
+             config.hash_rounds);
+  }
+  char hashed_password[256] = {0};
+  if (hash_password(password->valuestring, setting, hashed_password,
+                    sizeof(hashed_password), response) < 0) {
+    cJSON_Delete(json);
+    cJSON_Delete(json_response);
     return;
   }
 
-  db_request(db, login_sql, callback_object, json_response, err_msg,
-             "Fetched user by username and password");
+  // Compare the zero-padded buffers in full so timing does not reveal how
+  // much of the hash matched
+  char expected[sizeof(hashed_password)] = {0};
+  int matched = cJSON_IsString(stored) &&
+                strlen(stored->valuestring) < sizeof(expected);
+  if (matched) {
+    strcpy(expected, stored->valuestring);
+  }
+  unsigned char diff = 0;
+  for (size_t i = 0; i < sizeof(expected); i++) {
+    diff |= (unsigned char)(expected[i] ^ hashed_password[i]);
+  }
+  matched = matched && diff == 0;
 
   int response_code = SUCCESS;
-  if (cJSON_GetArraySize(json_response) == 0) {
+  if (!matched) {
     response_code = NOT_FOUND;
+    cJSON_Delete(json_response);
+    json_response = cJSON_CreateObject();
+    if (!json_response) {
+      handle_error("Failed to create JSON object.", response);
+      cJSON_Delete(json);
+      return;
+    }
     cJSON_AddStringToObject(json_response, "error", "User not found.");
+  } else {
+    cJSON *user_id = cJSON_GetObjectItem(json_response, "user_id");
+    char *token = cJSON_IsString(user_id)
+                      ? session_issue(strtol(user_id->valuestring, NULL, 10))
+                      : NULL;
+    if (!token) {
+      handle_error("Failed to issue session token.", response);
+      cJSON_Delete(json);
+      cJSON_Delete(json_response);
+      return;
+    }
+    cJSON_AddStringToObject(json_response, "token", token);
+    free(token);
   }
 
   cJSON_DeleteItemFromObject(json_response, "password");
@@ -397,31 +1543,116 @@ void request_post_login(sqlite3 *db, char *body, char **response,
 
   cJSON_Delete(json);
   cJSON_Delete(json_response);
-  free(login_sql);
 }
 
-void request_get_reviews_by_game_id(sqlite3 *db, char *id, char **response,
-                                    char **err_msg)
+void request_post_logout(const char *token, char **response)
 {
-  char *select_sql = format_sql_query(
-      "SELECT Reviews.review_id, Reviews.game_id, Reviews.rating, "
-      "Reviews.review_text, Reviews.created_at, Users.username "
-      "FROM Reviews "
-      "INNER JOIN Users ON Reviews.user_id = Users.user_id "
-      "WHERE Reviews.game_id = %s;",
-      id);
+  if (!token || session_revoke(token) < 0) {
+    *response = construct_response(
+        UNAUTHORIZED, "{\"error\": \"Invalid session token.\"}");
+    return;
+  }
+
+  *response = construct_response(SUCCESS, "{\"message\": \"Logged out.\"}");
+}
+
+// Keyset pagination: the cursor is the review_id of the last row returned,
+// and the next page seeks past that row's sort key in the matching index.
+void request_get_reviews_by_game_id(sqlite3 *db, char *id, QueryParams *query,
+                                    char **response)
+{
+  char *sort = get_query_value(query, "sort");
+  char *cursor = get_query_value(query, "cursor");
+  long limit = get_query_long(query, "limit", REVIEWS_DEFAULT_LIMIT);
+  long min_rating = get_query_long(query, "min_rating", 1);
+
+  int by_rating = sort && strcmp(sort, "rating") == 0;
+  if ((sort && !by_rating && strcmp(sort, "newest") != 0) ||
+      (cursor && !is_integer(cursor))) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid sort or cursor.\"}");
+    return;
+  }
+  if (limit < 1) {
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Invalid review limit.\"}");
+    return;
+  }
+  if (limit > REVIEWS_MAX_LIMIT) {
+    limit = REVIEWS_MAX_LIMIT;
+  }
+
+  char select_sql[1024];
+  strcpy(select_sql,
+         "SELECT Reviews.review_id, Reviews.game_id, Reviews.rating, "
+         "Reviews.review_text, Reviews.created_at, Users.username "
+         "FROM Reviews "
+         "INNER JOIN Users ON Reviews.user_id = Users.user_id "
+         "WHERE Reviews.game_id = :game_id AND Reviews.rating >= :min_rating");
+
+  if (by_rating) {
+    if (cursor) {
+      strcat(select_sql,
+             " AND (Reviews.rating, Reviews.created_at, Reviews.review_id) < "
+             "(SELECT rating, created_at, review_id FROM Reviews "
+             "WHERE review_id = :cursor)");
+    }
+    strcat(select_sql, " ORDER BY Reviews.rating DESC, Reviews.created_at "
+                       "DESC, Reviews.review_id DESC");
+  } else {
+    if (cursor) {
+      strcat(select_sql,
+             " AND (Reviews.created_at, Reviews.review_id) < "
+             "(SELECT created_at, review_id FROM Reviews "
+             "WHERE review_id = :cursor)");
+    }
+    strcat(select_sql,
+           " ORDER BY Reviews.created_at DESC, Reviews.review_id DESC");
+  }
+  strcat(select_sql, " LIMIT :limit;");
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to prepare reviews query: %s\n",
+            sqlite3_errmsg(db));
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  bind_text_param(stmt, ":game_id", id);
+  bind_int_param(stmt, ":min_rating", min_rating);
+  bind_text_param(stmt, ":cursor", cursor);
+  // One extra row tells whether another page exists
+  bind_int_param(stmt, ":limit", limit + 1);
 
   cJSON *json = cJSON_CreateArray();
   if (!json) {
     fprintf(stderr, "ERROR: Failed to create JSON object.\n");
+    sqlite3_finalize(stmt);
     return;
   }
 
-  db_request(db, select_sql, callback_array, json, err_msg,
-             "Fetched review by id");
+  if (db_step_array(stmt, json) != SQLITE_OK) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    cJSON_Delete(json);
+    sqlite3_finalize(stmt);
+    return;
+  }
+  sqlite3_finalize(stmt);
+  printf("LOG: Fetched review by id\n");
+
+  char headers[64] = "";
+  if (cJSON_GetArraySize(json) > limit) {
+    cJSON_DeleteItemFromArray(json, (int)limit);
+    cJSON *last = cJSON_GetArrayItem(json, (int)limit - 1);
+    snprintf(headers, sizeof(headers), "X-Next-Cursor: %s\r\n",
+             cJSON_GetObjectItem(last, "review_id")->valuestring);
+  }
 
   int response_code = SUCCESS;
-  if (cJSON_GetArraySize(json) == 0) {
+  if (cJSON_GetArraySize(json) == 0 && !cursor) {
     response_code = NOT_FOUND;
     cJSON_AddStringToObject(json, "error", "Review not found.");
   }
@@ -429,7 +1660,8 @@ void request_get_reviews_by_game_id(sqlite3 *db, char *id, char **response,
   char *json_string = cJSON_PrintUnformatted(json);
 
   if (json_string) {
-    *response = construct_response(response_code, json_string);
+    *response =
+        construct_response_with_headers(response_code, headers, json_string);
     free(json_string);
   } else {
     *response = construct_response(
@@ -437,11 +1669,24 @@ void request_get_reviews_by_game_id(sqlite3 *db, char *id, char **response,
   }
 
   cJSON_Delete(json);
-  free(select_sql);
+}
+
+void request_get_review_summary(sqlite3 *db, char *id, char **response)
+{
+  cJSON *summary = get_review_summary(db, id);
+  if (!summary) {
+    *response = construct_response(
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
+    return;
+  }
+
+  cJSON_AddStringToObject(summary, "game_id", id);
+  construct_json_response(summary, SUCCESS, response);
+  cJSON_Delete(summary);
 }
 
 void request_post_review(sqlite3 *db, char *id, char *body, char **response,
-                         char **err_msg, int socket)
+                         char **err_msg)
 {
   cJSON *json = cJSON_Parse(body);
   if (!json) {
@@ -450,10 +1695,14 @@ void request_post_review(sqlite3 *db, char *id, char *body, char **response,
     return;
   }
 
-  cJSON *user_id = get_required_field(json, "user_id", response, socket);
-  cJSON *rating = get_required_field(json, "rating", response, socket);
-  cJSON *review_text =
-      get_required_field(json, "review_text", response, socket);
+  cJSON *user_id = get_required_field(json, "user_id", response);
+  cJSON *rating = get_required_field(json, "rating", response);
+  cJSON *review_text = get_required_field(json, "review_text", response);
+
+  if (!user_id || !rating || !review_text) {
+    cJSON_Delete(json);
+    return;
+  }
 
   char *insert_sql = format_sql_query("INSERT INTO Reviews (user_id, game_id, "
                                       "rating, review_text) "
@@ -461,72 +1710,108 @@ void request_post_review(sqlite3 *db, char *id, char *body, char **response,
                                       user_id->valueint, id, rating->valueint,
                                       review_text->valuestring);
 
-  if (!insert_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+  int r = rating->valueint;
+  char *stats_sql = format_sql_query(
+      "INSERT INTO Review_Stats (game_id, review_count, rating_sum, rating_1, "
+      "rating_2, rating_3, rating_4, rating_5) "
+      "VALUES (%s, 1, %d, %d, %d, %d, %d, %d) "
+      "ON CONFLICT(game_id) DO UPDATE SET "
+      "review_count = review_count + 1, "
+      "rating_sum = rating_sum + excluded.rating_sum, "
+      "rating_1 = rating_1 + excluded.rating_1, "
+      "rating_2 = rating_2 + excluded.rating_2, "
+      "rating_3 = rating_3 + excluded.rating_3, "
+      "rating_4 = rating_4 + excluded.rating_4, "
+      "rating_5 = rating_5 + excluded.rating_5;",
+      id, r, r == 1, r == 2, r == 3, r == 4, r == 5);
+
+  if (!insert_sql || !stats_sql) {
+    handle_error("Failed to format SQL query.", response);
+    free(insert_sql);
+    free(stats_sql);
     cJSON_Delete(json);
     return;
   }
 
-  db_request(db, insert_sql, 0, 0, err_msg, "Inserted review");
+  // The review and its aggregate are committed together
+  if (db_request(db, "BEGIN IMMEDIATE;", 0, 0, err_msg,
+                 "Began review transaction") != SQLITE_OK) {
+    handle_error("Failed to begin review transaction.", response);
+  } else if (db_request(db, insert_sql, 0, 0, err_msg, "Inserted review") !=
+                 SQLITE_OK ||
+             db_request(db, stats_sql, 0, 0, err_msg,
+                        "Updated review stats") != SQLITE_OK) {
+    db_request(db, "ROLLBACK;", 0, 0, err_msg, "Rolled back review");
+    *response = construct_response(
+        BAD_REQUEST, "{\"error\": \"Failed to insert review.\"}");
+  } else if (db_request(db, "COMMIT;", 0, 0, err_msg, "Committed review") !=
+             SQLITE_OK) {
+    db_request(db, "ROLLBACK;", 0, 0, err_msg, "Rolled back review");
+    handle_error("Failed to commit review.", response);
+  } else {
+    *response =
+        construct_response(SUCCESS, "{\"message\": \"Review inserted.\"}");
 
-  *response =
-      construct_response(SUCCESS, "{\"message\": \"Review inserted.\"}");
+    char topic[32];
+    snprintf(topic, sizeof(topic), "game:%ld", strtol(id, NULL, 10));
+    cJSON *summary = get_review_summary(db, id);
+    publish_json(topic, "reviews", summary, 1);
+    cJSON_Delete(summary);
+  }
 
   cJSON_Delete(json);
   free(insert_sql);
+  free(stats_sql);
 }
 
-void request_get_my_games(sqlite3 *db, QueryParams *query, char **response,
-                          char **err_msg, int socket)
-
+void request_get_my_games(sqlite3 *db, long user_id, char **response,
+                          int socket)
 {
-
-  char *user_id = query->values[0];
-  if (!user_id || strcmp(query->keys[0], "user_id") != 0) {
+  const char *select_sql = "SELECT " GAME_COLUMNS " "
+                           "FROM Libraries "
+                           "INNER JOIN Games ON Libraries.game_id = "
+                           "Games.game_id "
+                           "WHERE Libraries.user_id = ?1;";
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to prepare library query: %s\n",
+            sqlite3_errmsg(db));
     *response = construct_response(
-        BAD_REQUEST, "{\"error\": \"Missing required query: user_id.\"}");
-    send(socket, response, strlen(*response), 0);
-    return;
-  }
-
-  char *select_sql =
-      format_sql_query("SELECT Games.* "
-                       "FROM Libraries "
-                       "INNER JOIN Games ON Libraries.game_id = Games.game_id "
-                       "WHERE Libraries.user_id = %s;",
-                       user_id);
-
-  if (!select_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
-    return;
-  }
-
-  cJSON *json_array = cJSON_CreateArray();
-  if (!json_array) {
-    fprintf(stderr, "ERROR: Failed to create JSON array.\n");
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
     return;
   }
+  sqlite3_bind_int64(stmt, 1, user_id);
 
-  db_request(db, select_sql, callback_array, json_array, err_msg,
-             "Fetched library games");
-
-  char *json_string = cJSON_PrintUnformatted(json_array);
+  ResponseStream stream;
+  stream_init(&stream, socket);
 
-  if (json_string) {
-    *response = construct_response(SUCCESS, json_string);
-    free(json_string);
+  long rows;
+  if (stream_json_rows(stmt, &stream, NULL, NULL, &rows) == SQLITE_DONE) {
+    printf("LOG: Fetched %ld library games\n", rows);
+    stream_finish(&stream, response);
   } else {
-    *response = construct_response(
-        INTERNAL_SERVER_ERROR, "{\"error\": \"Failed to serialize JSON.\"}");
+    fprintf(stderr, "ERROR: Failed to fetch library: %s\n",
+            sqlite3_errmsg(db));
+    stream_fail(&stream, INTERNAL_SERVER_ERROR,
+                "{\"error\": \"An internal error occurred.\"}", response);
   }
 
-  cJSON_Delete(json_array);
-  free(select_sql);
+  sqlite3_finalize(stmt);
 }
 
-void request_post_my_game(sqlite3 *db, char *body, char **response,
-                          char **err_msg, int socket)
+// Pair the game with the rest of the library it just joined or left
+static void update_recommendations(sqlite3 *db, long user_id, long game_id,
+                                   int sign)
+{
+  Bitmap library;
+  if (ownership_get(db, user_id, &library) == 0) {
+    recommend_update(game_id, &library, sign);
+    bitmap_free(&library);
+  }
+}
 
+void request_post_my_game(sqlite3 *db, long user_id, char *body,
+                          char **response, char **err_msg)
 {
   cJSON *json = cJSON_Parse(body);
   if (!json) {
@@ -535,27 +1820,30 @@ void request_post_my_game(sqlite3 *db, char *body, char **response,
     return;
   }
 
-  cJSON *user_id = get_required_field(json, "user_id", response, socket);
-  cJSON *game_id = get_required_field(json, "game_id", response, socket);
+  cJSON *game_id = get_required_field(json, "game_id", response);
 
-  if (!user_id || !game_id) {
+  if (!game_id) {
     cJSON_Delete(json);
     return;
   }
 
   char *insert_sql =
       format_sql_query("INSERT INTO Libraries (user_id, game_id) "
-                       "VALUES ('%d', '%d');",
-                       user_id->valueint, game_id->valueint);
+                       "VALUES ('%ld', '%d');",
+                       user_id, game_id->valueint);
 
   if (!insert_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+    handle_error("Failed to format SQL query.", response);
     cJSON_Delete(json);
     return;
   }
 
-  db_request(db, insert_sql, callback_array, 0, err_msg,
-             "Inserted game into library");
+  if (db_request(db, insert_sql, callback_array, 0, err_msg,
+                 "Inserted game into library") == SQLITE_OK) {
+    autocomplete_add_popularity(game_id->valueint, 1);
+    ownership_add(user_id, game_id->valueint);
+    update_recommendations(db, user_id, game_id->valueint, 1);
+  }
 
   *response = construct_response(
       SUCCESS, "{\"message\": \"Game inserted to library.\"}");
@@ -564,28 +1852,25 @@ void request_post_my_game(sqlite3 *db, char *body, char **response,
   free(insert_sql);
 }
 
-void request_delete_my_game(sqlite3 *db, char *id, QueryParams *query,
-                            char **response, char **err_msg, int socket)
+void request_delete_my_game(sqlite3 *db, char *id, long user_id,
+                            char **response, char **err_msg)
 {
-  char *user_id = query->values[0];
-  if (!user_id || strcmp(query->keys[0], "user_id") != 0) {
-    *response = construct_response(
-        BAD_REQUEST, "{\"error\": \"Missing required query: user_id.\"}");
-    send(socket, response, strlen(*response), 0);
-    return;
-  }
-
   char *delete_sql = format_sql_query(
-      "DELETE FROM Libraries WHERE game_id = %s AND user_id = %s;", id,
+      "DELETE FROM Libraries WHERE game_id = %s AND user_id = %ld;", id,
       user_id);
 
   if (!delete_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+    handle_error("Failed to format SQL query.", response);
     return;
   }
 
-  db_request(db, delete_sql, callback_array, 0, err_msg,
-             "Deleted game from library");
+  if (db_request(db, delete_sql, callback_array, 0, err_msg,
+                 "Deleted game from library") == SQLITE_OK &&
+      sqlite3_changes(db) > 0) {
+    autocomplete_add_popularity(strtol(id, NULL, 10), -1);
+    ownership_remove(user_id, strtol(id, NULL, 10));
+    update_recommendations(db, user_id, strtol(id, NULL, 10), -1);
+  }
 
   *response = construct_response(
       SUCCESS, "{\"message\": \"Game deleted from library.\"}");
@@ -628,24 +1913,16 @@ void request_get_achievement_by_id(sqlite3 *db, char *id, char **response,
   free(select_sql);
 }
 
-void request_get_my_posted_games(sqlite3 *db, QueryParams *query,
-                                 char **response, char **err_msg, int socket)
+void request_get_my_posted_games(sqlite3 *db, long user_id, char **response,
+                                 char **err_msg)
 {
-  char *user_id = query->values[0];
-  if (!user_id || strcmp(query->keys[0], "user_id") != 0) {
-    *response = construct_response(
-        BAD_REQUEST, "{\"error\": \"Missing required query: user_id.\"}");
-    send(socket, response, strlen(*response), 0);
-    return;
-  }
-
-  char *select_sql = format_sql_query("SELECT Games.* "
+  char *select_sql = format_sql_query("SELECT " GAME_COLUMNS " "
                                       "FROM Games "
-                                      "WHERE Games.added_by = %s;",
+                                      "WHERE Games.added_by = %ld;",
                                       user_id);
 
   if (!select_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+    handle_error("Failed to format SQL query.", response);
     return;
   }
 
@@ -672,8 +1949,19 @@ void request_get_my_posted_games(sqlite3 *db, QueryParams *query,
   free(select_sql);
 }
 
+void request_get_achievements_by_ids(sqlite3 *db, QueryParams *query,
+                                     char **response)
+{
+  get_rows_by_ids(db, "Achievements", "achievement_id", query, response);
+}
+
+static void add_achievement_totals(sqlite3 *db, long achievement_id)
+{
+  leaderboard_apply_achievement(db, achievement_id, 1);
+}
+
 void request_post_achievement(sqlite3 *db, char *body, char **response,
-                              char **err_msg, int socket)
+                              char **err_msg)
 {
   cJSON *json = cJSON_Parse(body);
   if (!json) {
@@ -682,11 +1970,10 @@ void request_post_achievement(sqlite3 *db, char *body, char **response,
     return;
   }
 
-  cJSON *game_id = get_required_field(json, "game_id", response, socket);
-  cJSON *name = get_required_field(json, "name", response, socket);
-  cJSON *description =
-      get_required_field(json, "description", response, socket);
-  cJSON *points = get_required_field(json, "points", response, socket);
+  cJSON *game_id = get_required_field(json, "game_id", response);
+  cJSON *name = get_required_field(json, "name", response);
+  cJSON *description = get_required_field(json, "description", response);
+  cJSON *points = get_required_field(json, "points", response);
 
   if (!game_id || !name || !description || !points) {
     cJSON_Delete(json);
@@ -701,12 +1988,15 @@ void request_post_achievement(sqlite3 *db, char *body, char **response,
                        description->valuestring, points->valueint);
 
   if (!insert_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+    handle_error("Failed to format SQL query.", response);
     cJSON_Delete(json);
     return;
   }
 
-  db_request(db, insert_sql, 0, 0, err_msg, "Inserted achievement");
+  if (db_request(db, insert_sql, 0, 0, err_msg, "Inserted achievement") ==
+      SQLITE_OK) {
+    add_achievement_totals(db, (long)sqlite3_last_insert_rowid(db));
+  }
 
   *response =
       construct_response(SUCCESS, "{\"message\": \"Achievement inserted.\"}");
@@ -715,6 +2005,24 @@ void request_post_achievement(sqlite3 *db, char *body, char **response,
   free(insert_sql);
 }
 
+void request_post_achievements_bulk(sqlite3 *db, char *body,
+                                    BodyReader *reader, char **response,
+                                    int socket)
+{
+  static const BulkField fields[] = {
+      {"game_id", 1},
+      {"name", 0},
+      {"description", 0},
+      {"points", 1},
+  };
+
+  request_post_bulk(db, body, reader, response, socket,
+                    "INSERT INTO Achievements (game_id, name, description, "
+                    "points) VALUES (?, ?, ?, ?);",
+                    fields, sizeof(fields) / sizeof(fields[0]),
+                    add_achievement_totals);
+}
+
 void request_patch_achievement_by_id(sqlite3 *db, char *id, char *body,
                                      char **response, char **err_msg)
 {
@@ -747,11 +2055,27 @@ void request_patch_achievement_by_id(sqlite3 *db, char *id, char *body,
   strcat(sql, sqlite3_mprintf("%q", id));
   strcat(sql, ";");
 
-  if (sqlite3_exec(db, sql, NULL, NULL, err_msg) != SQLITE_OK) {
+  // A points change moves everyone who already unlocked the achievement. The
+  // old and new points are read in the write transaction, so concurrent
+  // unlocks never see half of it, and reach the boards only after COMMIT.
+  long achievement_id = strtol(id, NULL, 10);
+  int rescore = cJSON_GetObjectItem(json, "points") != NULL;
+  LeaderboardDelta delta = {0};
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+    handle_error("Failed to begin achievement update.", response);
+  } else if ((rescore && leaderboard_collect_achievement(db, achievement_id,
+                                                         -1, &delta) < 0) ||
+             sqlite3_exec(db, sql, NULL, NULL, err_msg) != SQLITE_OK ||
+             (rescore && leaderboard_collect_achievement(db, achievement_id,
+                                                         1, &delta) < 0) ||
+             sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    leaderboard_discard(&delta);
     *response =
         construct_response(INTERNAL_SERVER_ERROR,
                            "{\"error\": \"Failed to execute SQL update.\"}");
   } else {
+    leaderboard_apply(&delta);
     *response = construct_response(SUCCESS, "{\"message\": \"Game updated.\"}");
   }
 
@@ -765,103 +2089,105 @@ void request_delete_achievement_by_id(sqlite3 *db, char *id, char **response,
   char *delete_sql = format_sql_query(
       "DELETE FROM Achievements WHERE achievement_id = %s;", id);
 
-  db_request(db, delete_sql, 0, 0, err_msg, "Deleted achievement by id");
-
-  *response =
-      construct_response(SUCCESS, "{\"message\": \"Achievement deleted.\"}");
-
-  free(delete_sql);
-}
-
-void request_get_achievements_by_game_id(sqlite3 *db, char *id, char **response,
-                                         char **err_msg)
-{
-  char *select_sql =
-      format_sql_query("SELECT * FROM Achievements WHERE game_id = %s;", id);
-
-  cJSON *json = cJSON_CreateArray();
-  if (!json) {
-    fprintf(stderr, "ERROR: Failed to create JSON object.\n");
+  if (!delete_sql) {
+    handle_error("Failed to format SQL query.", response);
     return;
   }
 
-  db_request(db, select_sql, callback_array, json, err_msg,
-             "Fetched achievements by game id");
-
-  int response_code = SUCCESS;
-  if (cJSON_GetArraySize(json) == 0) {
-    response_code = NOT_FOUND;
-    cJSON_AddStringToObject(json, "error", "Achievements not found.");
-  }
-
-  char *json_string = cJSON_PrintUnformatted(json);
-
-  if (json_string) {
-    *response = construct_response(response_code, json_string);
-    free(json_string);
+  // The unlocks being removed are read before the DELETE and taken off the
+  // boards only once it has committed
+  LeaderboardDelta delta = {0};
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+    handle_error("Failed to begin achievement delete.", response);
+  } else if (leaderboard_collect_achievement(db, strtol(id, NULL, 10), -1,
+                                             &delta) < 0 ||
+             db_request(db, delete_sql, 0, 0, err_msg,
+                        "Deleted achievement by id") != SQLITE_OK ||
+             sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    leaderboard_discard(&delta);
+    handle_error("Failed to delete achievement.", response);
   } else {
+    leaderboard_apply(&delta);
     *response = construct_response(
-        INTERNAL_SERVER_ERROR, "{\"error\": \"Failed to serialize JSON.\"}");
+        SUCCESS, "{\"message\": \"Achievement deleted.\"}");
   }
 
-  cJSON_Delete(json);
-  free(select_sql);
+  free(delete_sql);
 }
 
-void request_get_user_achievements(sqlite3 *db, QueryParams *query,
-                                   char **response, char **err_msg, int socket)
+// Stream an achievements query; an empty result is a 404 as before
+static void stream_achievements(sqlite3 *db, const char *select_sql,
+                                sqlite3_int64 id, char **response, int socket)
 {
-  char *user_id = query->values[0];
-  if (!user_id || strcmp(query->keys[0], "user_id") != 0) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: Failed to prepare achievements query: %s\n",
+            sqlite3_errmsg(db));
     *response = construct_response(
-        BAD_REQUEST, "{\"error\": \"Missing required query: user_id.\"}");
-    send(socket, response, strlen(*response), 0);
+        INTERNAL_SERVER_ERROR, "{\"error\": \"An internal error occurred.\"}");
     return;
   }
+  sqlite3_bind_int64(stmt, 1, id);
 
-  char *select_sql = format_sql_query(
-      "SELECT Achievements.* "
-      "FROM Achievements "
-      "INNER JOIN User_Achievements ON Achievements.achievement_id = "
-      "User_Achievements.achievement_id "
-      "WHERE User_Achievements.user_id = %d;",
-      user_id);
+  ResponseStream stream;
+  stream_init(&stream, socket);
 
-  if (!select_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
-    return;
+  long rows;
+  if (stream_json_rows(stmt, &stream, NULL, NULL, &rows) != SQLITE_DONE) {
+    fprintf(stderr, "ERROR: Failed to fetch achievements: %s\n",
+            sqlite3_errmsg(db));
+    stream_fail(&stream, INTERNAL_SERVER_ERROR,
+                "{\"error\": \"An internal error occurred.\"}", response);
+  } else if (rows == 0) {
+    stream_fail(&stream, NOT_FOUND,
+                "{\"error\": \"Achievements not found.\"}", response);
+  } else {
+    printf("LOG: Fetched %ld achievements\n", rows);
+    stream_finish(&stream, response);
   }
 
-  cJSON *json = cJSON_CreateArray();
-  if (!json) {
-    fprintf(stderr, "ERROR: Failed to create JSON object.\n");
-    return;
-  }
-  db_request(db, select_sql, callback_array, json, err_msg,
-             "Fetched user achievements");
+  sqlite3_finalize(stmt);
+}
 
-  int response_code = SUCCESS;
-  if (cJSON_GetArraySize(json) == 0) {
-    response_code = NOT_FOUND;
-    cJSON_AddStringToObject(json, "error", "Achievements not found.");
-  }
+void request_get_achievements_by_game_id(sqlite3 *db, char *id, char **response,
+                                         int socket)
+{
+  stream_achievements(db, "SELECT * FROM Achievements WHERE game_id = ?1;",
+                      strtoll(id, NULL, 10), response, socket);
+}
 
-  char *json_string = cJSON_PrintUnformatted(json);
+void request_get_user_achievements(sqlite3 *db, long user_id, char **response,
+                                   int socket)
+{
+  stream_achievements(db,
+                      "SELECT Achievements.* "
+                      "FROM Achievements "
+                      "INNER JOIN User_Achievements ON "
+                      "Achievements.achievement_id = "
+                      "User_Achievements.achievement_id "
+                      "WHERE User_Achievements.user_id = ?1;",
+                      user_id, response, socket);
+}
 
-  if (json_string) {
-    *response = construct_response(response_code, json_string);
-    free(json_string);
-  } else {
-    *response = construct_response(
-        INTERNAL_SERVER_ERROR, "{\"error\": \"Failed to serialize JSON.\"}");
-  }
+// Push an unlock to the user's open achievement streams
+static void publish_unlock(sqlite3 *db, long user_id, long achievement_id)
+{
+  char topic[32];
+  snprintf(topic, sizeof(topic), "user:%ld", user_id);
+  publish_row(db, "SELECT * FROM Achievements WHERE achievement_id = ?1;",
+              achievement_id, topic, "achievement", 0);
+}
 
-  cJSON_Delete(json);
-  free(select_sql);
+void request_get_achievement_stream(long user_id, char **response)
+{
+  char topic[32];
+  snprintf(topic, sizeof(topic), "user:%ld", user_id);
+  *response = construct_stream_response(topic);
 }
 
-void request_post_user_achievement(sqlite3 *db, char *body, char **response,
-                                   char **err_msg, int socket)
+void request_post_user_achievement(sqlite3 *db, long user_id, char *body,
+                                   char **response, char **err_msg)
 {
   cJSON *json = cJSON_Parse(body);
   if (!json) {
@@ -870,38 +2196,72 @@ void request_post_user_achievement(sqlite3 *db, char *body, char **response,
     return;
   }
 
-  cJSON *user_id = get_required_field(json, "user_id", response, socket);
-  cJSON *achievement_id =
-      get_required_field(json, "achievement_id", response, socket);
+  cJSON *achievement_id = get_required_field(json, "achievement_id", response);
 
-  if (!user_id || !achievement_id) {
+  if (!achievement_id) {
     cJSON_Delete(json);
     return;
   }
 
   char *insert_sql =
-      format_sql_query("INSERT INTO User_Achievements (user_id, "
+      format_sql_query("INSERT OR IGNORE INTO User_Achievements (user_id, "
                        "achievement_id) "
-                       "VALUES ('%d', '%d');",
-                       user_id->valueint, achievement_id->valueint);
+                       "VALUES ('%ld', '%d');",
+                       user_id, achievement_id->valueint);
 
   if (!insert_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+    handle_error("Failed to format SQL query.", response);
     cJSON_Delete(json);
     return;
   }
 
-  db_request(db, insert_sql, 0, 0, err_msg, "Inserted user achievement");
-
-  *response = construct_response(
-      SUCCESS, "{\"message\": \"User achievement inserted.\"}");
+  // Read the achievement's points in the same write transaction as the
+  // insert so a concurrent points change is counted exactly once; the
+  // points are credited only after COMMIT. A repeated unlock is ignored by
+  // the unique index and credits nothing.
+  LeaderboardDelta delta = {0};
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+    handle_error("Failed to begin user achievement insert.", response);
+    cJSON_Delete(json);
+    free(insert_sql);
+    return;
+  }
+  if (db_request(db, insert_sql, 0, 0, err_msg,
+                 "Inserted user achievement") != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    handle_error("Failed to insert user achievement.", response);
+    cJSON_Delete(json);
+    free(insert_sql);
+    return;
+  }
+  int inserted = sqlite3_changes(db) > 0;
+  if ((inserted && leaderboard_collect_unlock(db, user_id,
+                                              achievement_id->valueint,
+                                              &delta) < 0) ||
+      sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    leaderboard_discard(&delta);
+    handle_error("Failed to commit user achievement.", response);
+    cJSON_Delete(json);
+    free(insert_sql);
+    return;
+  }
+  leaderboard_apply(&delta);
+  if (inserted) {
+    publish_unlock(db, user_id, achievement_id->valueint);
+    *response = construct_response(
+        SUCCESS, "{\"message\": \"User achievement inserted.\"}");
+  } else {
+    *response = construct_response(
+        SUCCESS, "{\"message\": \"User achievement already unlocked.\"}");
+  }
 
   cJSON_Delete(json);
   free(insert_sql);
 }
 
-void request_patch_user(sqlite3 *db, QueryParams *query, char *body,
-                        char **response, char **err_msg, int socket)
+void request_patch_user(sqlite3 *db, long user_id, char *body, char **response,
+                        char **err_msg)
 {
   cJSON *json = cJSON_Parse(body);
   if (!json) {
@@ -910,14 +2270,6 @@ void request_patch_user(sqlite3 *db, QueryParams *query, char *body,
     return;
   }
 
-  char *user_id = query->values[0];
-  if (!user_id || strcmp(query->keys[0], "user_id") != 0) {
-    *response = construct_response(
-        BAD_REQUEST, "{\"error\": \"Missing required query: user_id.\"}");
-    send(socket, response, strlen(*response), 0);
-    return;
-  }
-
   const char *fields[] = {"username", "email", "profile_image"};
   char *sql = malloc(1024);
   strcpy(sql, "UPDATE Users SET ");
@@ -936,9 +2288,7 @@ void request_patch_user(sqlite3 *db, QueryParams *query, char *body,
     return;
   }
 
-  strcat(sql, " WHERE user_id = ");
-  strcat(sql, sqlite3_mprintf("%q", user_id));
-  strcat(sql, ";");
+  sprintf(sql + strlen(sql), " WHERE user_id = %ld;", user_id);
 
   printf("SQL: %s\n", sql);
 
@@ -949,10 +2299,10 @@ void request_patch_user(sqlite3 *db, QueryParams *query, char *body,
   } else {
     // return user after patch
     char *select_sql =
-        format_sql_query("SELECT * FROM Users WHERE user_id = %s;", user_id);
+        format_sql_query("SELECT * FROM Users WHERE user_id = %ld;", user_id);
 
     if (!select_sql) {
-      handle_error("Failed to format SQL query.", response, socket);
+      handle_error("Failed to format SQL query.", response);
       cJSON_Delete(json);
       return;
     }
@@ -990,28 +2340,19 @@ void request_patch_user(sqlite3 *db, QueryParams *query, char *body,
 }
 
 void request_get_user_achievements_by_game_id(sqlite3 *db, char *id,
-                                              QueryParams *query,
-                                              char **response, char **err_msg,
-                                              int socket)
+                                              long user_id, char **response,
+                                              char **err_msg)
 {
-  char *user_id = query->values[0];
-  if (!user_id || strcmp(query->keys[0], "user_id") != 0) {
-    *response = construct_response(
-        BAD_REQUEST, "{\"error\": \"Missing required query: user_id.\"}");
-    send(socket, response, strlen(*response), 0);
-    return;
-  }
-
   char *select_sql = format_sql_query(
       "SELECT Achievements.* "
       "FROM Achievements "
       "INNER JOIN User_Achievements ON Achievements.achievement_id = "
       "User_Achievements.achievement_id "
-      "WHERE Achievements.game_id = %s AND User_Achievements.user_id = %s;",
+      "WHERE Achievements.game_id = %s AND User_Achievements.user_id = %ld;",
       id, user_id);
 
   if (!select_sql) {
-    handle_error("Failed to format SQL query.", response, socket);
+    handle_error("Failed to format SQL query.", response);
     return;
   }
 
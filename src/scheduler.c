@@ -0,0 +1,253 @@
+#include "scheduler.h"
+#include "db.h"
+#include "defines.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  const char *name;
+  SchedulerLane lane;
+  int interval_ms;
+  int budget_ms;
+  int snapshot;
+  int (*run)(sqlite3 *db);
+  uint64_t next_run_ms;
+  int done;
+  long runs;
+  long failures;
+  long over_budget;
+  uint64_t last_us;
+  uint64_t last_cpu_us;
+  uint64_t total_cpu_us;
+} Task;
+
+static Task tasks[SCHEDULER_MAX_TASKS];
+static int task_count = 0;
+
+// Guards the task table; a task runs without it
+static pthread_mutex_t scheduler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduler_wake;
+
+// The connections each lane's thread runs its tasks on
+typedef struct {
+  SchedulerLane lane;
+  sqlite3 *db;
+  sqlite3 *snapshot_db;
+} Lane;
+
+static Lane lanes[SCHEDULER_LANE_COUNT];
+
+// Per lane thread
+static _Thread_local Lane *current_lane = NULL;
+static _Thread_local uint64_t running_cpu_start_us = 0;
+static _Thread_local uint64_t running_budget_us = 0;
+
+static uint64_t clock_us(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int scheduler_add(const char *name, SchedulerLane lane, int delay_ms,
+                  int interval_ms, int budget_ms, int snapshot,
+                  int (*run)(sqlite3 *db))
+{
+  pthread_mutex_lock(&scheduler_lock);
+  if (task_count == SCHEDULER_MAX_TASKS) {
+    pthread_mutex_unlock(&scheduler_lock);
+    fprintf(stderr, "ERROR: Too many scheduled tasks, dropping %s\n", name);
+    return -1;
+  }
+
+  Task *task = &tasks[task_count++];
+  task->name = name;
+  task->lane = lane;
+  task->interval_ms = interval_ms;
+  task->budget_ms = budget_ms;
+  task->snapshot = snapshot;
+  task->run = run;
+  task->next_run_ms = clock_us(CLOCK_MONOTONIC) / 1000 + delay_ms;
+  pthread_cond_broadcast(&scheduler_wake);
+  pthread_mutex_unlock(&scheduler_lock);
+  return 0;
+}
+
+int scheduler_over_budget(void)
+{
+  return running_budget_us > 0 &&
+         clock_us(CLOCK_THREAD_CPUTIME_ID) - running_cpu_start_us >=
+             running_budget_us;
+}
+
+// The lane's task due first, or NULL when every one of them is done
+static Task *next_task(SchedulerLane lane)
+{
+  Task *next = NULL;
+  for (int i = 0; i < task_count; i++) {
+    if (tasks[i].lane == lane && !tasks[i].done &&
+        (!next || tasks[i].next_run_ms < next->next_run_ms)) {
+      next = &tasks[i];
+    }
+  }
+  return next;
+}
+
+static void run_task(Task *task)
+{
+  running_budget_us = (uint64_t)task->budget_ms * 1000;
+  running_cpu_start_us = clock_us(CLOCK_THREAD_CPUTIME_ID);
+  uint64_t started_us = clock_us(CLOCK_MONOTONIC);
+
+  int rc;
+  sqlite3 *snapshot_db = current_lane->snapshot_db;
+  if (task->snapshot) {
+    rc = db_begin_snapshot(snapshot_db) < 0 ? -1 : task->run(snapshot_db);
+    db_end_snapshot(snapshot_db);
+  } else {
+    rc = task->run(current_lane->db);
+  }
+
+  uint64_t cpu_us = clock_us(CLOCK_THREAD_CPUTIME_ID) - running_cpu_start_us;
+  uint64_t wall_us = clock_us(CLOCK_MONOTONIC) - started_us;
+  int over = running_budget_us > 0 && cpu_us > running_budget_us;
+  running_budget_us = 0;
+
+  pthread_mutex_lock(&scheduler_lock);
+  task->runs++;
+  task->failures += rc < 0;
+  task->over_budget += over;
+  task->last_us = wall_us;
+  task->last_cpu_us = cpu_us;
+  task->total_cpu_us += cpu_us;
+
+  if (task->interval_ms == 0) {
+    task->done = 1;
+  } else {
+    // Stretch the interval by the overrun so the task's share of the CPU
+    // stays near what its budget allows
+    uint64_t delay_ms = task->interval_ms;
+    if (over) {
+      delay_ms = delay_ms * cpu_us / (task->budget_ms * 1000ULL);
+      if (delay_ms > (uint64_t)task->interval_ms * SCHEDULER_MAX_BACKOFF) {
+        delay_ms = (uint64_t)task->interval_ms * SCHEDULER_MAX_BACKOFF;
+      }
+    }
+    task->next_run_ms = clock_us(CLOCK_MONOTONIC) / 1000 + delay_ms;
+  }
+  pthread_mutex_unlock(&scheduler_lock);
+
+  if (over) {
+    printf("LOG: Task %s used %llu ms of CPU, over its %d ms budget\n",
+           task->name, (unsigned long long)(cpu_us / 1000), task->budget_ms);
+  }
+}
+
+static void *scheduler_main(void *arg)
+{
+  current_lane = arg;
+
+  // Below the request workers, so on a busy machine maintenance waits
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), SCHEDULER_NICE);
+
+  pthread_mutex_lock(&scheduler_lock);
+  while (1) {
+    Task *task = next_task(current_lane->lane);
+    uint64_t now_ms = clock_us(CLOCK_MONOTONIC) / 1000;
+    if (!task) {
+      pthread_cond_wait(&scheduler_wake, &scheduler_lock);
+      continue;
+    }
+    if (task->next_run_ms > now_ms) {
+      struct timespec deadline;
+      deadline.tv_sec = task->next_run_ms / 1000;
+      deadline.tv_nsec = (task->next_run_ms % 1000) * 1000000;
+      pthread_cond_timedwait(&scheduler_wake, &scheduler_lock, &deadline);
+      continue;
+    }
+
+    pthread_mutex_unlock(&scheduler_lock);
+    run_task(task);
+    pthread_mutex_lock(&scheduler_lock);
+  }
+
+  return NULL;
+}
+
+int scheduler_start(void)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&scheduler_wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  for (int i = 0; i < SCHEDULER_LANE_COUNT; i++) {
+    Lane *lane = &lanes[i];
+    lane->lane = i;
+    lane->db = db_open();
+    lane->snapshot_db = db_open_snapshot();
+    if (!lane->db || !lane->snapshot_db) {
+      sqlite3_close(lane->db);
+      sqlite3_close(lane->snapshot_db);
+      return -1;
+    }
+    // A task that finds the database busy fails and waits for its next run
+    // rather than queueing for the write lock behind requests
+    sqlite3_busy_timeout(lane->db, SCHEDULER_BUSY_TIMEOUT_MS);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, scheduler_main, lane) != 0) {
+      fprintf(stderr, "ERROR: Failed to start scheduler thread\n");
+      sqlite3_close(lane->db);
+      sqlite3_close(lane->snapshot_db);
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+
+  printf("LOG: Started %d scheduler threads\n", SCHEDULER_LANE_COUNT);
+  return 0;
+}
+
+cJSON *scheduler_stats(void)
+{
+  cJSON *json = cJSON_CreateObject();
+  if (!json) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&scheduler_lock);
+  uint64_t now_ms = clock_us(CLOCK_MONOTONIC) / 1000;
+  for (int i = 0; i < task_count; i++) {
+    Task *task = &tasks[i];
+    cJSON *entry = cJSON_AddObjectToObject(json, task->name);
+    if (!entry) {
+      continue;
+    }
+    cJSON_AddNumberToObject(entry, "runs", task->runs);
+    cJSON_AddNumberToObject(entry, "failures", task->failures);
+    cJSON_AddNumberToObject(entry, "over_budget", task->over_budget);
+    cJSON_AddNumberToObject(entry, "budget_ms", task->budget_ms);
+    cJSON_AddNumberToObject(entry, "last_ms", task->last_us / 1000.0);
+    cJSON_AddNumberToObject(entry, "last_cpu_ms", task->last_cpu_us / 1000.0);
+    cJSON_AddNumberToObject(entry, "total_cpu_ms",
+                            task->total_cpu_us / 1000.0);
+    if (task->done) {
+      cJSON_AddNullToObject(entry, "next_run_ms");
+    } else {
+      cJSON_AddNumberToObject(entry, "next_run_ms",
+                              task->next_run_ms > now_ms
+                                  ? (double)(task->next_run_ms - now_ms)
+                                  : 0);
+    }
+  }
+  pthread_mutex_unlock(&scheduler_lock);
+
+  return json;
+}
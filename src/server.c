@@ -1,6 +1,16 @@
+#include "admission.h"
+#include "autocomplete.h"
+#include "config.h"
 #include "db.h"
+#include "event_loop.h"
+#include "facets.h"
+#include "hash_pool.h"
 #include "defines.h"
 #include "http.h"
+#include "leaderboard.h"
+#include "maintenance.h"
+#include "rate_limit.h"
+#include "scheduler.h"
 #include <arpa/inet.h>
 #include <sqlite3.h>
 #include <stdio.h>
@@ -24,7 +34,9 @@ int main()
   char *err_msg = 0;
   int rc;
 
-  rc = sqlite3_open("steam.db", &db);
+  config_load();
+
+  rc = sqlite3_open(DB_PATH, &db);
   if (rc) {
     fprintf(stderr, "ERROR: Can't open database: %s\n", sqlite3_errmsg(db));
     return 1;
@@ -32,12 +44,22 @@ int main()
   printf("LOG: Opened database successfully.\n");
 
   init_tables(db, &err_msg);
+  autocomplete_build(db);
+  facets_build(db);
+  leaderboard_build(db);
+
+  // Handlers run on the workers, each with a connection of its own
+  if (rate_limit_init() < 0 || hash_pool_start() < 0 ||
+      admission_start() < 0 || scheduler_start() < 0 ||
+      maintenance_schedule() < 0) {
+    return 1;
+  }
 
-  int new_socket;
   struct sockaddr_in address;
-  int addrlen = sizeof(address);
 
   signal(SIGINT, handle_sigint);
+  // A client hanging up mid-stream should fail the send, not kill the server
+  signal(SIGPIPE, SIG_IGN);
 
   server_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (server_fd == 0) {
@@ -45,6 +67,10 @@ int main()
     return 1;
   }
 
+  // Restarts should not wait out TIME_WAIT on the previous listener
+  int reuse = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
   address.sin_port = htons(PORT);
@@ -55,7 +81,7 @@ int main()
     return 1;
   }
 
-  if (listen(server_fd, 3) < 0) {
+  if (listen(server_fd, SOMAXCONN) < 0) {
     perror("ERROR: Listen failed");
     close(server_fd);
     return 1;
@@ -63,19 +89,9 @@ int main()
 
   printf("HTTP server is running on port %d\n", PORT);
 
-  while (1) {
-    new_socket =
-        accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-    if (new_socket < 0) {
-      perror("ERROR: Accept failed");
-      continue;
-    }
-
-    handle_request(db, &err_msg, new_socket);
-
-    close(new_socket);
-  }
+  event_loop_run(server_fd);
 
   close(server_fd);
+  sqlite3_close(db);
   return 0;
 }
@@ -0,0 +1,229 @@
+#include "session.h"
+#include "defines.h"
+#include "sha256.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#define TOKEN_MAX 128
+#define NONCE_SIZE 8
+
+// Verified tokens, direct-mapped by hash: a hit skips parsing and the HMAC
+typedef struct {
+  char token[TOKEN_MAX];
+  long user_id;
+  time_t expires;
+} CachedToken;
+
+// Signatures of logged-out tokens, kept until the token expires
+typedef struct RevokedToken {
+  uint8_t signature[SHA256_DIGEST_SIZE];
+  time_t expires;
+  struct RevokedToken *next;
+} RevokedToken;
+
+static CachedToken cache[SESSION_CACHE_SLOTS];
+static RevokedToken *revoked[SESSION_REVOKED_BUCKETS];
+static pthread_rwlock_t session_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint64_t hash_token(const char *token)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const unsigned char *p = (const unsigned char *)token; *p; p++) {
+    hash = (hash ^ *p) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static size_t revoked_bucket(const uint8_t *signature)
+{
+  uint32_t prefix;
+  memcpy(&prefix, signature, sizeof(prefix));
+  return prefix % SESSION_REVOKED_BUCKETS;
+}
+
+static void to_hex(const uint8_t *bytes, size_t length, char *out)
+{
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < length; i++) {
+    out[i * 2] = digits[bytes[i] >> 4];
+    out[i * 2 + 1] = digits[bytes[i] & 0xf];
+  }
+  out[length * 2] = '\0';
+}
+
+static int from_hex(const char *hex, uint8_t *out, size_t length)
+{
+  for (size_t i = 0; i < length * 2; i++) {
+    char c = hex[i];
+    int value = c >= '0' && c <= '9'   ? c - '0'
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                       : -1;
+    if (value < 0) {
+      return -1;
+    }
+    out[i / 2] = i % 2 ? out[i / 2] | value : value << 4;
+  }
+  return hex[length * 2] == '\0' ? 0 : -1;
+}
+
+static void sign(const char *payload, size_t length,
+                 uint8_t signature[SHA256_DIGEST_SIZE])
+{
+  hmac_sha256(SECRET, strlen(SECRET), payload, length, signature);
+}
+
+char *session_issue(long user_id)
+{
+  uint8_t nonce[NONCE_SIZE];
+  if (getrandom(nonce, sizeof(nonce), 0) != sizeof(nonce)) {
+    fprintf(stderr, "ERROR: Failed to generate session nonce\n");
+    return NULL;
+  }
+  char nonce_hex[NONCE_SIZE * 2 + 1];
+  to_hex(nonce, sizeof(nonce), nonce_hex);
+
+  char *token = malloc(TOKEN_MAX);
+  if (!token) {
+    return NULL;
+  }
+  int length = snprintf(token, TOKEN_MAX, "%ld.%ld.%s.", user_id,
+                        (long)(time(NULL) + SESSION_TTL_SECONDS), nonce_hex);
+
+  uint8_t signature[SHA256_DIGEST_SIZE];
+  sign(token, length - 1, signature);
+  to_hex(signature, sizeof(signature), token + length);
+  return token;
+}
+
+// Checks the signature and expiry; fills in the parts needed afterwards
+static int parse_token(const char *token, long *user_id, time_t *expires,
+                       uint8_t signature[SHA256_DIGEST_SIZE])
+{
+  const char *dot = strrchr(token, '.');
+  if (!dot || strlen(token) >= TOKEN_MAX ||
+      from_hex(dot + 1, signature, SHA256_DIGEST_SIZE) < 0) {
+    return -1;
+  }
+
+  uint8_t expected[SHA256_DIGEST_SIZE];
+  sign(token, dot - token, expected);
+
+  // Compare every byte so timing does not reveal how much matched
+  uint8_t diff = 0;
+  for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+    diff |= expected[i] ^ signature[i];
+  }
+  if (diff) {
+    return -1;
+  }
+
+  char *end;
+  *user_id = strtol(token, &end, 10);
+  if (*end != '.') {
+    return -1;
+  }
+  *expires = strtol(end + 1, &end, 10);
+  if (*end != '.' || *expires <= time(NULL)) {
+    return -1;
+  }
+  return 0;
+}
+
+static int is_revoked(const uint8_t *signature)
+{
+  for (RevokedToken *entry = revoked[revoked_bucket(signature)]; entry;
+       entry = entry->next) {
+    if (memcmp(entry->signature, signature, SHA256_DIGEST_SIZE) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Returns the user the token belongs to, or -1 when it is not valid
+long session_verify(const char *token)
+{
+  CachedToken *slot = &cache[hash_token(token) % SESSION_CACHE_SLOTS];
+  long user_id = -1;
+
+  pthread_rwlock_rdlock(&session_lock);
+  if (strcmp(slot->token, token) == 0 && slot->expires > time(NULL)) {
+    user_id = slot->user_id;
+  }
+  pthread_rwlock_unlock(&session_lock);
+  if (user_id >= 0) {
+    return user_id;
+  }
+
+  time_t expires;
+  uint8_t signature[SHA256_DIGEST_SIZE];
+  if (parse_token(token, &user_id, &expires, signature) < 0) {
+    return -1;
+  }
+
+  // Check and cache under one lock so a concurrent logout cannot be missed
+  pthread_rwlock_wrlock(&session_lock);
+  if (is_revoked(signature)) {
+    user_id = -1;
+  } else {
+    strcpy(slot->token, token);
+    slot->user_id = user_id;
+    slot->expires = expires;
+  }
+  pthread_rwlock_unlock(&session_lock);
+
+  return user_id;
+}
+
+static void drop_expired(RevokedToken **link, time_t now)
+{
+  while (*link) {
+    RevokedToken *entry = *link;
+    if (entry->expires <= now) {
+      *link = entry->next;
+      free(entry);
+    } else {
+      link = &entry->next;
+    }
+  }
+}
+
+int session_revoke(const char *token)
+{
+  long user_id;
+  time_t expires;
+  uint8_t signature[SHA256_DIGEST_SIZE];
+  if (parse_token(token, &user_id, &expires, signature) < 0) {
+    return -1;
+  }
+
+  RevokedToken *entry = malloc(sizeof(*entry));
+  if (!entry) {
+    return -1;
+  }
+  memcpy(entry->signature, signature, SHA256_DIGEST_SIZE);
+  entry->expires = expires;
+
+  pthread_rwlock_wrlock(&session_lock);
+  RevokedToken **head = &revoked[revoked_bucket(signature)];
+  drop_expired(head, time(NULL));
+  if (is_revoked(signature)) {
+    free(entry);
+  } else {
+    entry->next = *head;
+    *head = entry;
+  }
+
+  CachedToken *slot = &cache[hash_token(token) % SESSION_CACHE_SLOTS];
+  if (strcmp(slot->token, token) == 0) {
+    slot->token[0] = '\0';
+  }
+  pthread_rwlock_unlock(&session_lock);
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include "sha1.h"
+#include <string.h>
+
+// FIPS 180-4 SHA-1
+
+static uint32_t rotl(uint32_t x, int n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+static void compress(Sha1 *ctx, const uint8_t *block)
+{
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+           (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2],
+           d = ctx->state[3], e = ctx->state[4];
+
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+
+    uint32_t t = rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotl(b, 30);
+    b = a;
+    a = t;
+  }
+
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+  ctx->state[4] += e;
+}
+
+void sha1_init(Sha1 *ctx)
+{
+  static const uint32_t initial[5] = {0x67452301, 0xefcdab89, 0x98badcfe,
+                                      0x10325476, 0xc3d2e1f0};
+  memcpy(ctx->state, initial, sizeof(initial));
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+void sha1_update(Sha1 *ctx, const void *data, size_t length)
+{
+  const uint8_t *bytes = data;
+  ctx->length += length;
+
+  if (ctx->used > 0) {
+    size_t take = SHA1_BLOCK_SIZE - ctx->used;
+    if (take > length) {
+      take = length;
+    }
+    memcpy(ctx->block + ctx->used, bytes, take);
+    ctx->used += take;
+    bytes += take;
+    length -= take;
+    if (ctx->used < SHA1_BLOCK_SIZE) {
+      return;
+    }
+    compress(ctx, ctx->block);
+    ctx->used = 0;
+  }
+
+  while (length >= SHA1_BLOCK_SIZE) {
+    compress(ctx, bytes);
+    bytes += SHA1_BLOCK_SIZE;
+    length -= SHA1_BLOCK_SIZE;
+  }
+
+  memcpy(ctx->block, bytes, length);
+  ctx->used = length;
+}
+
+void sha1_final(Sha1 *ctx, uint8_t digest[SHA1_DIGEST_SIZE])
+{
+  uint64_t bits = ctx->length * 8;
+
+  ctx->block[ctx->used++] = 0x80;
+  if (ctx->used > SHA1_BLOCK_SIZE - 8) {
+    memset(ctx->block + ctx->used, 0, SHA1_BLOCK_SIZE - ctx->used);
+    compress(ctx, ctx->block);
+    ctx->used = 0;
+  }
+  memset(ctx->block + ctx->used, 0, SHA1_BLOCK_SIZE - 8 - ctx->used);
+  for (int i = 0; i < 8; i++) {
+    ctx->block[SHA1_BLOCK_SIZE - 1 - i] = (uint8_t)(bits >> (i * 8));
+  }
+  compress(ctx, ctx->block);
+
+  for (int i = 0; i < 5; i++) {
+    digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+  }
+}
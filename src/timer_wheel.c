@@ -0,0 +1,157 @@
+#include "timer_wheel.h"
+#include <string.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms)
+{
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->current = now_ms / TIMER_TICK_MS;
+}
+
+void timer_init(Timer *timer, void *data)
+{
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->data = data;
+}
+
+int timer_pending(const Timer *timer)
+{
+  return timer->pprev != NULL;
+}
+
+static void link_timer(TimerWheel *wheel, Timer *timer)
+{
+  uint64_t delta = timer->expires - wheel->current;
+
+  // Pick the lowest level whose span still reaches the deadline; anything
+  // beyond the top level parks in its last slot and is re-sorted later
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+
+  uint64_t expires = timer->expires;
+  uint64_t max_delta = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  if (delta > max_delta) {
+    expires = wheel->current + max_delta;
+  }
+  size_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+  Timer **head = &wheel->slots[level][slot];
+  timer->next = *head;
+  if (*head) {
+    (*head)->pprev = &timer->next;
+  }
+  *head = timer;
+  timer->pprev = head;
+}
+
+static void unlink_timer(Timer *timer)
+{
+  *timer->pprev = timer->next;
+  if (timer->next) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t expires_ms)
+{
+  if (timer_pending(timer)) {
+    timer_cancel(wheel, timer);
+  }
+
+  // Round up so a timer never fires before its deadline
+  timer->expires = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  if (timer->expires <= wheel->current) {
+    timer->expires = wheel->current + 1;
+  }
+
+  link_timer(wheel, timer);
+  wheel->count++;
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer)
+{
+  if (timer_pending(timer)) {
+    unlink_timer(timer);
+    wheel->count--;
+  }
+}
+
+// Move every timer in one higher-level slot down to where it now belongs
+static void cascade(TimerWheel *wheel, int level)
+{
+  size_t slot =
+      (wheel->current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  Timer *timer = wheel->slots[level][slot];
+  wheel->slots[level][slot] = NULL;
+
+  while (timer) {
+    Timer *next = timer->next;
+    timer->pprev = NULL;
+    link_timer(wheel, timer);
+    timer = next;
+  }
+}
+
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms,
+                         void (*expire)(Timer *timer))
+{
+  uint64_t target = now_ms / TIMER_TICK_MS;
+
+  while (wheel->current < target) {
+    if (wheel->count == 0) {
+      wheel->current = target;
+      break;
+    }
+
+    wheel->current++;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if ((wheel->current & (((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1)) !=
+          0) {
+        break;
+      }
+      cascade(wheel, level);
+    }
+
+    // Pop one at a time: an expiry callback may cancel or re-arm others
+    Timer **head = &wheel->slots[0][wheel->current & TIMER_WHEEL_MASK];
+    while (*head) {
+      Timer *timer = *head;
+      unlink_timer(timer);
+      wheel->count--;
+      if (timer->expires > wheel->current) {
+        // Parked at the top level past its real deadline
+        link_timer(wheel, timer);
+        wheel->count++;
+        continue;
+      }
+      expire(timer);
+    }
+  }
+}
+
+// Milliseconds until the wheel next needs turning, or -1 when it is empty
+int timer_wheel_next_timeout(const TimerWheel *wheel, uint64_t now_ms)
+{
+  if (wheel->count == 0) {
+    return -1;
+  }
+
+  uint64_t ticks = TIMER_WHEEL_SLOTS - (wheel->current & TIMER_WHEEL_MASK);
+  for (uint64_t i = 1; i < ticks; i++) {
+    if (wheel->slots[0][(wheel->current + i) & TIMER_WHEEL_MASK]) {
+      ticks = i;
+      break;
+    }
+  }
+
+  uint64_t due = (wheel->current + ticks) * TIMER_TICK_MS;
+  return due > now_ms ? (int)(due - now_ms) : 0;
+}
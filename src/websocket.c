@@ -0,0 +1,122 @@
+#include "websocket.h"
+#include "sha1.h"
+#include <string.h>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+static void base64_encode(const uint8_t *data, size_t length, char *out)
+{
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  size_t i = 0;
+  for (; i + 2 < length; i += 3) {
+    uint32_t group = (uint32_t)data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+    *out++ = alphabet[group >> 18 & 63];
+    *out++ = alphabet[group >> 12 & 63];
+    *out++ = alphabet[group >> 6 & 63];
+    *out++ = alphabet[group & 63];
+  }
+  if (i < length) {
+    uint32_t group = (uint32_t)data[i] << 16;
+    if (i + 1 < length) {
+      group |= data[i + 1] << 8;
+    }
+    *out++ = alphabet[group >> 18 & 63];
+    *out++ = alphabet[group >> 12 & 63];
+    *out++ = i + 1 < length ? alphabet[group >> 6 & 63] : '=';
+    *out++ = '=';
+  }
+  *out = '\0';
+}
+
+void websocket_accept_key(const char *key, char accept[WEBSOCKET_ACCEPT_SIZE])
+{
+  Sha1 ctx;
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  sha1_init(&ctx);
+  sha1_update(&ctx, key, strlen(key));
+  sha1_update(&ctx, WEBSOCKET_GUID, strlen(WEBSOCKET_GUID));
+  sha1_final(&ctx, digest);
+  base64_encode(digest, sizeof(digest), accept);
+}
+
+size_t websocket_frame_header(WebSocketOpcode opcode, size_t length,
+                              uint8_t header[WEBSOCKET_MAX_HEADER])
+{
+  header[0] = 0x80 | opcode;
+  if (length < 126) {
+    header[1] = (uint8_t)length;
+    return 2;
+  }
+  if (length <= 0xffff) {
+    header[1] = 126;
+    header[2] = (uint8_t)(length >> 8);
+    header[3] = (uint8_t)length;
+    return 4;
+  }
+  header[1] = 127;
+  for (int i = 0; i < 8; i++) {
+    header[2 + i] = (uint8_t)((uint64_t)length >> (56 - i * 8));
+  }
+  return 10;
+}
+
+long websocket_parse_frame(char *buffer, size_t length, size_t max_payload,
+                           WebSocketFrame *frame)
+{
+  const uint8_t *bytes = (const uint8_t *)buffer;
+  if (length < 2) {
+    return 0;
+  }
+
+  // No extensions are negotiated, so the reserved bits must be clear, and
+  // every client frame must be masked
+  if ((bytes[0] & 0x70) || !(bytes[1] & 0x80)) {
+    return -1;
+  }
+  frame->fin = bytes[0] >> 7;
+  frame->opcode = bytes[0] & 0x0f;
+
+  size_t header_length = 2;
+  uint64_t payload_length = bytes[1] & 0x7f;
+  if (payload_length == 126) {
+    header_length = 4;
+    if (length < header_length) {
+      return 0;
+    }
+    payload_length = (uint64_t)bytes[2] << 8 | bytes[3];
+  } else if (payload_length == 127) {
+    header_length = 10;
+    if (length < header_length) {
+      return 0;
+    }
+    payload_length = 0;
+    for (int i = 0; i < 8; i++) {
+      payload_length = payload_length << 8 | bytes[2 + i];
+    }
+  }
+
+  // Control frames are never fragmented and carry at most 125 bytes
+  if (frame->opcode & 0x8) {
+    if (!frame->fin || payload_length > 125) {
+      return -1;
+    }
+  }
+  if (payload_length > max_payload) {
+    return -1;
+  }
+
+  size_t total = header_length + 4 + (size_t)payload_length;
+  if (length < total) {
+    return 0;
+  }
+
+  const uint8_t *mask = bytes + header_length;
+  frame->payload = buffer + header_length + 4;
+  frame->length = (size_t)payload_length;
+  for (size_t i = 0; i < frame->length; i++) {
+    frame->payload[i] ^= mask[i & 3];
+  }
+  return (long)total;
+}
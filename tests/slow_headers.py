@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+"""Slow-header (slowloris) check for the event loop.
+
+Starts the server in a scratch directory with a short header timeout, holds
+a batch of connections open that dribble header lines and never finish the
+request head, and checks that:
+
+  - another client's requests keep succeeding while they are held open,
+  - every slow connection is closed once the header timeout passes,
+  - each of those closes is counted in the header_timeouts metric.
+
+Usage: python3 tests/slow_headers.py [path/to/server]
+"""
+
+import json
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+HOST = "127.0.0.1"
+PORT = 8080
+SLOW_CONNECTIONS = 200
+HEADER_TIMEOUT_MS = 1000
+
+
+def request(path):
+    """One request on a fresh connection; returns (status, body)."""
+    with socket.create_connection((HOST, PORT), timeout=5) as sock:
+        sock.sendall(
+            f"GET {path} HTTP/1.1\r\nHost: test\r\n"
+            "Connection: close\r\n\r\n".encode()
+        )
+        data = b""
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+    head, _, body = data.partition(b"\r\n\r\n")
+    return int(head.split(b" ", 2)[1]), body
+
+
+def metrics():
+    status, body = request("/metrics")
+    assert status == 200, f"GET /metrics returned {status}"
+    return json.loads(body)
+
+
+def wait_for_server(process):
+    deadline = time.time() + 30
+    while time.time() < deadline:
+        if process.poll() is not None:
+            raise RuntimeError("server exited during startup")
+        try:
+            metrics()
+            return
+        except OSError:
+            time.sleep(0.1)
+    raise RuntimeError("server did not start accepting connections")
+
+
+def is_closed(sock):
+    """True once the server has closed its end of the connection."""
+    try:
+        sock.sendall(b"X-Slow: y\r\n")
+        return sock.recv(1) == b""
+    except socket.timeout:
+        return False
+    except OSError:
+        return True
+
+
+def main():
+    server = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "bin/server")
+    workdir = tempfile.mkdtemp(prefix="slow_headers_")
+    env = dict(os.environ, STEAM_HEADER_TIMEOUT_MS=str(HEADER_TIMEOUT_MS))
+    process = subprocess.Popen(
+        [server],
+        cwd=workdir,
+        env=env,
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+    )
+    slow = []
+    try:
+        wait_for_server(process)
+        timeouts_before = metrics()["header_timeouts"]
+
+        # Each slow client sends a request line and then one header line at
+        # a time, never the blank line that ends the head
+        for _ in range(SLOW_CONNECTIONS):
+            sock = socket.create_connection((HOST, PORT), timeout=5)
+            sock.sendall(b"GET /metrics HTTP/1.1\r\nHost: test\r\n")
+            slow.append(sock)
+
+        # A well-behaved client is served throughout, well inside the
+        # header timeout each time
+        started = time.time()
+        served = 0
+        while time.time() - started < HEADER_TIMEOUT_MS / 1000 * 2:
+            for sock in slow:
+                try:
+                    sock.sendall(b"X-Slow: y\r\n")
+                except OSError:
+                    pass
+            began = time.time()
+            status, _ = request("/leaderboard")
+            assert status == 200, f"GET /leaderboard returned {status}"
+            assert time.time() - began < HEADER_TIMEOUT_MS / 1000 / 2, (
+                "request was held up behind the slow connections"
+            )
+            served += 1
+            time.sleep(0.05)
+
+        # Dribbling headers does not extend the deadline, so by now every
+        # slow connection has been closed
+        for sock in slow:
+            sock.settimeout(1)
+        still_open = sum(1 for sock in slow if not is_closed(sock))
+        assert still_open == 0, f"{still_open} slow connections still open"
+
+        timeouts = metrics()["header_timeouts"] - timeouts_before
+        assert timeouts >= SLOW_CONNECTIONS, (
+            f"header_timeouts went up by {timeouts}, "
+            f"expected {SLOW_CONNECTIONS}"
+        )
+
+        print(
+            f"ok: {served} requests served while {SLOW_CONNECTIONS} slow "
+            f"connections were held, {timeouts} header timeouts"
+        )
+    finally:
+        for sock in slow:
+            sock.close()
+        process.terminate()
+        process.wait()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()